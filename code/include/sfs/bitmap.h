@@ -0,0 +1,76 @@
+// bitmap.h: two-level block bitmap
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+class Bitmap {
+private:
+    std::vector<uint64_t> Words;    // One bit per block, set if used
+    std::vector<uint64_t> Summary;  // One bit per word, set if the word is full
+    size_t  Bits;		    // Number of valid bits
+    size_t  Used;		    // Number of set bits
+
+    // Update summary bit of a word
+    // @param	word	    Index of word
+    void update(size_t word);
+
+    // Find first word at or after word that is not full
+    // @param	word	    Index of word to start from
+    // Returns Words.size() if every word is full.
+    size_t next_open_word(size_t word) const;
+
+public:
+    const static size_t WORD_BITS = 64;
+
+    // Default constructor
+    Bitmap() : Bits(0), Used(0) {}
+
+    // Reset bitmap to nbits clear bits
+    // @param	nbits	    Number of bits
+    void resize(size_t nbits);
+
+    // Return number of bits
+    size_t size() const { return Bits; }
+
+    // Return number of set bits
+    size_t count() const { return Used; }
+
+    // Return number of set bits in [begin, end)
+    // @param	begin	    First bit
+    // @param	end	    One past last bit
+    size_t count(size_t begin, size_t end) const;
+
+    // Return whether bit is set
+    // @param	bit	    Bit to test
+    bool test(size_t bit) const { return Words[bit / WORD_BITS] >> (bit % WORD_BITS) & 1; }
+
+    bool operator[](size_t bit) const { return test(bit); }
+
+    // Set bit (mark block used)
+    // @param	bit	    Bit to set
+    void set(size_t bit);
+
+    // Clear bit (mark block free)
+    // @param	bit	    Bit to clear
+    void reset(size_t bit);
+
+    // Find first clear bit at or after start
+    // @param	start	    Bit to start from
+    // Returns size() if there is none.
+    size_t find_clear(size_t start) const;
+
+    // Find first set bit at or after start
+    // @param	start	    Bit to start from
+    // Returns size() if there is none.
+    size_t find_set(size_t start) const;
+
+    // Find first run of clear bits at or after start
+    // @param	start	    Bit to start from
+    // @param	length	    Length of run
+    // Returns size() if there is none.
+    size_t find_clear_run(size_t start, size_t length) const;
+};
@@ -0,0 +1,85 @@
+// client.h: sfsd client library
+
+#pragma once
+
+#include "sfs/fs.h"
+#include "sfs/protocol.h"
+
+#include <string>
+#include <vector>
+
+// Mirrors the FileSystem interface over a connection to sfsd
+class Client {
+private:
+    int	    Socket;	    // Connection to daemon
+    uint32_t NextTag;	    // Tag of next request
+    size_t  Outstanding;    // Requests sent but not yet completed
+
+    // Send and complete a single request
+    // @param	request	    Request to send (Tag is filled in)
+    // @param	payload	    Request payload (request.Length bytes)
+    // @param	reply	    Response payload
+    // Returns Result of response.
+    int64_t call(Protocol::Request &request, const char *payload, std::string *reply = nullptr);
+
+public:
+    typedef FileSystem::DirectoryEntry DirectoryEntry;
+    typedef FileSystem::StatFS StatFS;
+
+    // Default constructor
+    Client() : Socket(-1), NextTag(0), Outstanding(0) {}
+
+    // Destructor
+    ~Client();
+
+    // Connect to daemon
+    // @param	path	    Path to daemon socket
+    // Throws runtime_error exception on error.
+    void connect(const char *path);
+
+    // Pipelined interface
+
+    // Send a request without waiting for its response
+    // @param	request	    Request to send (Tag is filled in)
+    // @param	payload	    Request payload (request.Length bytes)
+    // Returns tag of request.
+    // Throws runtime_error exception on error.
+    uint32_t submit(Protocol::Request &request, const char *payload = nullptr);
+
+    // Wait for the response to the oldest outstanding request
+    // @param	response    Response header
+    // @param	payload	    Response payload
+    // Throws runtime_error exception on error.
+    void complete(Protocol::Response &response, std::string &payload);
+
+    // Return number of outstanding requests
+    size_t outstanding() const { return Outstanding; }
+
+    // FileSystem interface
+
+    ssize_t create();
+
+    bool remove(size_t inumber);
+
+    ssize_t stat(size_t inumber);
+
+    ssize_t read(size_t inumber, char *data, size_t length, size_t offset);
+
+    ssize_t write(size_t inumber, char *data, size_t length, size_t offset);
+
+    ssize_t clone(size_t inumber);
+
+    ssize_t copy_range(size_t src, size_t src_offset, size_t dst, size_t dst_offset, size_t length);
+
+    bool statfs(StatFS &stats);
+
+    ssize_t open(const char *path);
+
+    ssize_t create(const char *path);
+
+    ssize_t mkdir(const char *path);
+
+    bool unlink(const char *path);
+
+    bool list(const char *path, std::vector<DirectoryEntry> &entries);
+};
@@ -2,37 +2,191 @@
 
 #pragma once
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
 
 class Disk {
-private:
+public:
+    // Timing model parameters (times in microseconds)
+    struct Timing {
+    	double	SeekBase;	    // Cost of any non-sequential access
+    	double	SeekPerBlock;	    // Additional cost per block of head travel
+    	double	SeekMax;	    // Upper bound on seek cost
+    	double	Latency;	    // Fixed cost per I/O request
+    	double	Bandwidth;	    // Transfer rate in MB/s
+    };
+
+protected:
     int	    FileDescriptor; // File descriptor of disk image
     size_t  Blocks;	    // Number of blocks in disk image
     size_t  Reads;	    // Number of reads performed
     size_t  Writes;	    // Number of writes performed
+    size_t  Discards;	    // Number of blocks discarded
     size_t  Mounts;	    // Number of mounts
+    bool    Timed;	    // Whether the timing model is enabled
+    Timing  Model;	    // Timing model parameters
+    size_t  Head;	    // Block following the last request
+    double  Elapsed;	    // Simulated time (in microseconds)
+    bool    Direct;	    // Whether the image is opened with O_DIRECT
+    char   *Bounce;	    // Aligned buffer for unaligned O_DIRECT requests
+    size_t  BounceBlocks;   // Size of bounce buffer (in terms of blocks)
+    bool    Tracking;	    // Whether changed blocks are being tracked
+    std::string ChangedPath;	    // Sidecar file holding the changed-block bitmap
+    std::vector<uint64_t> Changed;  // Blocks written since the last checkpoint
+    char   *Mapping;	    // Read-only mapping of the image (MAP_FAILED if unmappable)
+    size_t  MappedBlocks;   // Size of mapping (in terms of blocks)
+    std::vector<std::pair<char *, size_t>> Retired;	// Mappings outgrown by the disk (unmapped when closed)
+    size_t  Batching;	    // Depth of nested batches
+    bool    Flushing;	    // Whether queued requests are being performed
+
+    struct Request {	    // Read waiting for the next flush
+    	size_t	Start;	    // First block to read
+    	size_t	Count;	    // Number of blocks to read
+    	char   *Data;	    // Buffer to read into
+    };
+
+    std::map<size_t, std::vector<char>> Queued;	// Latest queued write of each block
+    std::vector<Request> Submitted;		// Reads waiting for the next flush
+
+    struct ChangedHeader {  // Sidecar file header, followed by the bitmap
+    	uint32_t Magic;	    // CHANGED_MAGIC
+    	uint32_t Clean;	    // Whether the bitmap was saved when the disk was closed
+    	uint64_t Blocks;    // Number of blocks covered by the bitmap
+    };
+
+    struct DeltaHeader {    // Incremental delta header
+    	uint32_t Magic;	    // DELTA_MAGIC
+    	uint32_t BlockSize; // Bytes per block
+    	uint64_t Blocks;    // Number of blocks in source disk
+    };
+
+    struct DeltaExtent {    // Run of changed blocks, followed by their data unless Zero
+    	uint64_t Start;	    // First block of run (a run of 0 blocks ends the delta)
+    	uint32_t Count;	    // Number of blocks in run
+    	uint32_t Zero;	    // Whether every block in the run is zero-filled
+    };
 
     // Check parameters
     // @param	blocknum    Block to operate on
     // @param	data	    Buffer to operate on
     // Throws invalid_argument exception on error.
-    void sanity_check(int blocknum, char *data);
+    void sanity_check(size_t blocknum, char *data);
+
+    // Check a range of blocks
+    // @param	blocknum    First block to operate on
+    // @param	nblocks	    Number of blocks to operate on
+    // @param	data	    Buffer to operate on
+    // Throws invalid_argument exception on error.
+    void sanity_check(size_t blocknum, size_t nblocks, char *data);
+
+    // Return a buffer suitable for the request
+    // @param	data	    Caller's buffer
+    // @param	nblocks	    Number of blocks in request
+    // Returns data itself unless O_DIRECT needs an aligned bounce buffer.
+    // Throws runtime_error exception on error.
+    char *aligned(char *data, size_t nblocks);
+
+    // Charge simulated time for a request
+    // @param	blocknum    First block of request
+    // @param	nblocks	    Number of blocks in request
+    void charge(size_t blocknum, size_t nblocks);
+
+    // Print block counters
+    void report() const;
+
+    // Queue a write while a batch is open
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer to write from
+    // Returns false if the caller should perform the write now.
+    // Throws runtime_error exception on error.
+    bool queue_write(size_t blocknum, size_t nblocks, char *data);
+
+    // Copy queued writes over blocks just read
+    // @param	blocknum    First block read
+    // @param	nblocks	    Number of blocks read
+    // @param	data	    Buffer read into
+    void overlay(size_t blocknum, size_t nblocks, char *data) const;
+
+    // Perform submitted reads that overlap a range before it is written
+    // @param	blocknum    First block of range
+    // @param	nblocks	    Number of blocks in range
+    // Throws runtime_error exception on error.
+    void settle_reads(size_t blocknum, size_t nblocks);
+
+    // Perform submitted reads, and queued writes if requested, in one sweep
+    // @param	writes	    Whether queued writes are performed too
+    // Throws runtime_error exception on error.
+    void perform(bool writes);
+
+    // Copy between host files inside the kernel (copy_file_range)
+    // @param	in	    File to copy from
+    // @param	in_offset   Offset in source
+    // @param	out	    File to copy to
+    // @param	out_offset  Offset in destination
+    // @param	length	    Number of bytes to copy
+    // Returns false if the files cannot be copied this way or the source ends early.
+    static bool copy_file(int in, off_t in_offset, int out, off_t out_offset, size_t length);
+
+    // Punch a hole over blocks so they read back as zeros
+    // @param	blocknum    First block to punch
+    // @param	nblocks	    Number of blocks to punch
+    // Returns false if the host does not support hole punching.
+    // Throws runtime_error exception on error.
+    virtual bool punch(size_t blocknum, size_t nblocks);
+
+    // Adopt a new size after the backing storage has been enlarged
+    // @param	nblocks	    New number of blocks
+    // Throws runtime_error exception on error.
+    void resize(size_t nblocks);
+
+    // Record blocks as changed since the last checkpoint
+    // @param	blocknum    First block written
+    // @param	nblocks	    Number of blocks written
+    void mark(size_t blocknum, size_t nblocks);
+
+    // Resume change tracking if the image has a changed-block sidecar
+    // @param	path	    Path to disk image
+    // Throws runtime_error exception on error.
+    void load_changed(const char *path);
+
+    // Write the changed-block sidecar
+    // @param	clean	    Whether the disk is being closed
+    // Throws runtime_error exception on error.
+    void save_changed(bool clean);
 
 public:
     // Number of bytes per block
     const static size_t BLOCK_SIZE = 4096;
+
+    // Magic numbers of the changed-block sidecar and incremental deltas
+    const static uint32_t CHANGED_MAGIC = 0xf0f03411;
+    const static uint32_t DELTA_MAGIC	= 0xf0f03412;
+
+    // Queued blocks that force a flush before the batch ends
+    const static size_t QUEUE_BLOCKS = 4096;
+
+    // Writes at least this large are already efficient and skip the queue
+    const static size_t BYPASS_BLOCKS = 64;
     
     // Default constructor
-    Disk() : FileDescriptor(0), Blocks(0), Reads(0), Writes(0), Mounts(0) {}
+    Disk() : FileDescriptor(0), Blocks(0), Reads(0), Writes(0), Discards(0), Mounts(0), Timed(false), Model(), Head(0), Elapsed(0), Direct(false), Bounce(NULL), BounceBlocks(0), Tracking(false), Mapping(NULL), MappedBlocks(0), Batching(0), Flushing(false) {}
     
     // Destructor
-    ~Disk();
+    virtual ~Disk();
 
     // Open disk image
     // @param	path	    Path to disk image
     // @param	nblocks	    Number of blocks in disk image
+    // @param	direct	    Whether to bypass the host page cache (O_DIRECT)
     // Throws runtime_error exception on error.
-    void open(const char *path, size_t nblocks);
+    void open(const char *path, size_t nblocks, bool direct = false);
 
     // Return size of disk (in terms of blocks)
     size_t size() const { return Blocks; }
@@ -40,19 +194,144 @@ public:
     // Return whether or not disk is mounted
     bool mounted() const { return Mounts > 0; }
 
+    // Enable the timing model
+    // @param	timing	    Timing model parameters
+    void set_timing(const Timing &timing) { Model = timing; Timed = true; Head = 0; Elapsed = 0; }
+
+    // Look up a timing profile
+    // @param	name	    Profile name ("hdd", "ssd") or
+    //			    "seek_base,seek_per_block,seek_max,latency,bandwidth"
+    // @param	timing	    Timing model parameters to fill in
+    // Returns false if the profile is not recognized.
+    static bool timing_profile(const char *name, Timing &timing);
+
+    // Return simulated time (in microseconds)
+    double elapsed() const { return Elapsed; }
+
     // Increment mounts
     void mount() { Mounts++; }
 
     // Decrement mounts
     void unmount() { if (Mounts > 0) Mounts--; }
 
+    // Return whether or not changed blocks are being tracked
+    bool tracking() const { return Tracking; }
+
+    // Return number of blocks changed since the last checkpoint
+    size_t changed() const;
+
+    // Forget changed blocks and start tracking from now on
+    // Returns number of blocks changed since the last checkpoint, or -1 if
+    // tracking was not enabled before.
+    // Throws runtime_error exception on error.
+    ssize_t checkpoint();
+
+    // Write the blocks changed since the last checkpoint as a delta
+    // @param	fd	    File to write delta to
+    // @param	extents	    Number of runs written
+    // Returns number of blocks written, or -1 if tracking is not enabled.
+    // Throws runtime_error exception on error.
+    ssize_t export_changes(int fd, size_t &extents);
+
+    // Write the blocks of a delta into the disk
+    // @param	fd	    File to read delta from
+    // Returns number of blocks applied, or -1 if the delta is invalid or
+    // was taken from a disk of another size.
+    // Throws runtime_error exception on error.
+    ssize_t apply_changes(int fd);
+
+    // Start collecting requests (batches nest)
+    // Writes are queued, deduplicated and performed when the outermost batch
+    // ends; reads see queued writes. Outside a batch requests run at once.
+    void begin_batch() { Batching++; }
+
+    // End a batch, flushing queued requests if it is the outermost one
+    // Throws runtime_error exception on error.
+    void end_batch();
+
+    // Perform queued requests in one elevator sweep
+    // Requests are sorted by block number starting from the head position,
+    // and adjacent requests in the same direction are merged. Use it as a
+    // barrier when later writes must not reach the disk before earlier ones.
+    // If a transfer fails the rest are still performed, blocks whose write
+    // failed stay queued for the next flush, and the first error is thrown.
+    // Throws runtime_error exception on error.
+    void flush();
+
+    // Perform submitted reads now, leaving writes queued
+    // Throws runtime_error exception on error.
+    void finish_reads();
+
+    // Read contiguous blocks at the next flush or finish_reads
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer to read into (must stay valid until the flush)
+    // Reads at once outside a batch.
+    void submit_read(size_t blocknum, size_t nblocks, char *data);
+
+    // Enlarge the disk
+    // @param	nblocks	    Number of blocks the disk should have
+    // Added blocks read as zeros, and pointers returned by map stay valid.
+    // Returns true if the disk already has nblocks blocks, or false if it
+    // cannot grow.
+    // Throws runtime_error exception on error.
+    virtual bool grow(size_t nblocks);
+
     // Read block from disk
     // @param	blocknum    Block to read from
     // @param	data	    Buffer to read into
-    void read(int blocknum, char *data);
+    virtual void read(size_t blocknum, char *data);
     
     // Write block to disk
     // @param	blocknum    Block to write to
     // @param	data	    Buffer to write from
-    void write(int blocknum, char *data);
+    virtual void write(size_t blocknum, char *data);
+
+    // Read contiguous blocks from disk
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	data	    Buffer to read into
+    virtual void read_blocks(size_t blocknum, size_t nblocks, char *data);
+
+    // Write contiguous blocks to disk
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	data	    Buffer to write from
+    virtual void write_blocks(size_t blocknum, size_t nblocks, char *data);
+
+    // Discard blocks by punching a hole in the disk image
+    // @param	blocknum    First block to discard
+    // @param	nblocks	    Number of blocks to discard
+    // Returns false if the host does not support hole punching.
+    virtual bool discard(size_t blocknum, size_t nblocks);
+
+    // Fill blocks with zeros, punching a hole when the host supports it
+    // @param	blocknum    First block to clear
+    // @param	nblocks	    Number of blocks to clear
+    // Counted as writes either way.
+    void zero_blocks(size_t blocknum, size_t nblocks);
+
+    // Map contiguous blocks of the image read-only
+    // @param	blocknum    First block to map
+    // @param	nblocks	    Number of blocks to map
+    // Returns a pointer valid until the disk is closed, or NULL if the image
+    // cannot be mapped. Counted as reads.
+    // Throws invalid_argument exception on error.
+    virtual const char *map(size_t blocknum, size_t nblocks);
+
+    // Copy contiguous blocks from a host file without a user buffer
+    // @param	blocknum    First block to write to
+    // @param	nblocks	    Number of blocks to write
+    // @param	fd	    Host file to copy from
+    // @param	offset	    Offset in host file
+    // Returns false if the host cannot copy between the files.
+    virtual bool copy_in(size_t blocknum, size_t nblocks, int fd, off_t offset);
+
+    // Copy contiguous blocks to a host file without a user buffer
+    // @param	blocknum    First block to read from
+    // @param	nblocks	    Number of blocks to read
+    // @param	fd	    Host file to copy to
+    // @param	offset	    Offset in host file
+    // Returns false if the host cannot copy between the files.
+    virtual bool copy_out(size_t blocknum, size_t nblocks, int fd, off_t offset);
 };
@@ -2,62 +2,506 @@
 
 #pragma once
 
+#include "sfs/bitmap.h"
 #include "sfs/disk.h"
+#include "sfs/log_disk.h"
 
 #include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
 #include <sys/types.h>
 
-class FileSystem {
+// Read-only view of a file's contents. Spans point straight into the mapped
+// disk image where possible and into buffers owned by the view otherwise.
+// A view is a snapshot that is valid only until the next call that changes
+// the file system: writes, copy-on-write, defrag and discard can move,
+// overwrite or zero the blocks a mapped span points at.
+class FileView {
+public:
+    struct Span {
+        const char *Data;     // First byte of span
+        size_t Length;        // Number of bytes
+        bool Mapped;          // Whether Data points into the disk image
+    };
+
+    // Return spans in file order
+    const std::vector<Span> &spans() const { return Spans; }
+
+    // Return number of bytes in view
+    size_t size() const { return Size; }
+
+    // Return number of bytes exposed directly from the disk image
+    size_t mapped() const;
+
+    // Append bytes of the mapped image, merging with the previous span
+    // @param	data	    First byte
+    // @param	length	    Number of bytes
+    void append(const char *data, size_t length);
+
+    // Append a span backed by a buffer owned by the view
+    // @param	length	    Number of bytes in span
+    // @param	capacity    Bytes to allocate (at least length)
+    // Returns the buffer, aligned to Disk::BLOCK_SIZE, for the caller to fill.
+    char *gather(size_t length, size_t capacity = 0);
+
+private:
+    std::vector<Span> Spans;        // Spans in file order
+    std::vector<std::unique_ptr<char, void (*)(void *)>> Buffers; // Gathered data
+    size_t Size = 0;                // Total bytes
+};
+
+// Geometry independent layout and interface shared by every block size
+class Volume {
+    friend class FileSystem;
+
 public:
     const static uint32_t MAGIC_NUMBER = 0xf0f03410;
-    const static uint32_t INODES_PER_BLOCK = 128;
     const static uint32_t POINTERS_PER_INODE = 5;
-    const static uint32_t POINTERS_PER_BLOCK = 1024;
 
-private:
+    // Format-time geometry
+    const static size_t MIN_BLOCK_SIZE = Disk::BLOCK_SIZE;
+    const static size_t MAX_BLOCK_SIZE = 16 * Disk::BLOCK_SIZE;
+    const static uint32_t DEFAULT_INODE_PERCENT = 10;
+
+    // Superblock feature flags
+    const static uint32_t FEATURE_DIRECTORIES = 0x1;
+    const static uint32_t FEATURE_GROUPS = 0x2;       // Inode table split across block groups
+    const static uint32_t FEATURE_GROWN = 0x4;        // Regions added after format (see grow)
+
+    // Regions a file system can be grown by
+    const static uint32_t MAX_EXTENSIONS = 64;
+
+    // Inode flags (stored in Inode.Valid)
+    const static uint32_t INODE_VALID = 0x1;
+    const static uint32_t INODE_DIRECTORY = 0x2;
+    const static uint32_t INODE_INLINE = 0x4;     // Data stored in pointer area
+    const static uint32_t INODE_FRAGMENT = 0x8;   // Data stored in a fragment run
+    const static uint32_t FRAGMENT_SHIFT = 16;    // First fragment index in Valid
+    const static uint32_t INODE_UNWRITTEN = 0x10; // Preallocated blocks not yet written
+    const static uint32_t UNWRITTEN_SHIFT = 16;   // First unwritten block index in Valid
+
+    // Small file geometry
+    const static uint32_t INLINE_SIZE = (POINTERS_PER_INODE + 1) * sizeof(uint32_t);
+    const static uint32_t FRAGMENTS_PER_BLOCK = 16;
+    const static uint32_t FRAGMENT_FULL = (1u << FRAGMENTS_PER_BLOCK) - 1;
+
+    // Directory geometry
+    const static uint32_t NAME_LENGTH = 27;
+    const static size_t DENTRY_CACHE_SIZE = 1 << 16;
+
+    // Bytes moved per step of an internal copy
+    const static size_t COPY_CHUNK = 1 << 20;
+
+    struct DirectoryEntry {   // Directory listing entry
+        std::string Name;     // Entry name
+        size_t Inumber;       // Inode number of entry
+        bool Directory;       // Whether or not entry is a directory
+    };
+
+    struct StatFS {           // File system usage
+        size_t BlockSize;     // Bytes per block
+        size_t Blocks;        // Total number of blocks
+        size_t DataBlocks;    // Number of blocks available for data
+        size_t FreeBlocks;    // Number of free data blocks
+        size_t Inodes;        // Total number of inodes
+        size_t FreeInodes;    // Number of free inodes
+    };
+
+    virtual ~Volume() {}
+
+    virtual bool mount(Disk *disk) = 0;
+
+    virtual ssize_t create() = 0;
+
+    virtual bool remove(size_t inumber) = 0;
+
+    virtual ssize_t stat(size_t inumber) = 0;
+
+    virtual ssize_t read(size_t inumber, char *data, size_t length, size_t offset) = 0;
+
+    virtual ssize_t write(size_t inumber, char *data, size_t length, size_t offset) = 0;
+
+    virtual bool map(size_t inumber, FileView &view) = 0;
+
+    virtual size_t create_many(size_t count, std::vector<size_t> &inumbers) = 0;
+
+    virtual void stat_many(const std::vector<size_t> &inumbers, std::vector<ssize_t> &sizes) = 0;
+
+    virtual size_t remove_many(const std::vector<size_t> &inumbers) = 0;
+
+    virtual ssize_t clone(size_t inumber) = 0;
+
+    virtual ssize_t copy_range(size_t src, size_t src_offset, size_t dst, size_t dst_offset, size_t length) = 0;
+
+    virtual ssize_t splice_in(size_t inumber, size_t offset, int fd, off_t fd_offset, size_t length) = 0;
+
+    virtual ssize_t splice_out(size_t inumber, size_t offset, int fd, off_t fd_offset, size_t length) = 0;
+
+    virtual bool statfs(StatFS &stats) = 0;
+
+    virtual ssize_t defrag(size_t budget) = 0;
+
+    virtual ssize_t extents(size_t inumber) = 0;
+
+    virtual bool fallocate(size_t inumber, size_t offset, size_t length) = 0;
+
+    virtual bool grow(size_t blocks, bool inodes) = 0;
+
+    virtual void set_discard(bool enabled) = 0;
+
+    virtual ssize_t trim() = 0;
+
+    virtual ssize_t open(const char *path) = 0;
+
+    virtual ssize_t create(const char *path) = 0;
+
+    virtual ssize_t mkdir(const char *path) = 0;
+
+    virtual bool unlink(const char *path) = 0;
+
+    virtual bool list(const char *path, std::vector<DirectoryEntry> &entries) = 0;
+
+protected:
+    struct Extension {          // Region added by grow
+        uint32_t Start;         // First block of region
+        uint32_t InodeBlocks;   // Inode blocks at the start of region
+    };
+
     struct SuperBlock {        // Superblock structure
         uint32_t MagicNumber;    // File system magic number
         uint32_t Blocks;    // Number of blocks in file system
         uint32_t InodeBlocks;    // Number of blocks reserved for inodes
         uint32_t Inodes;    // Number of inodes in file system
+        uint32_t Features;    // Optional features in use (0 on legacy images)
+        uint32_t RootInode;    // Root directory (with FEATURE_DIRECTORIES)
+        uint32_t BlockSize;    // Bytes per block (0 on legacy images: 4096)
+        uint32_t InodePercent;    // Percent of blocks holding inodes (0 on legacy images: 10)
+        uint32_t GroupBlocks;    // Blocks per block group (with FEATURE_GROUPS)
+        uint32_t GroupInodeBlocks;    // Inode blocks at the start of each group (with FEATURE_GROUPS)
+        uint32_t BaseBlocks;    // Blocks laid out by format (with FEATURE_GROWN)
+        uint32_t BaseInodeBlocks;    // Inode blocks laid out by format (with FEATURE_GROWN)
+        uint32_t ExtensionCount;    // Regions added since (with FEATURE_GROWN)
+        Extension Extensions[MAX_EXTENSIONS];    // Regions in block order, each ending where the next starts
     };
 
     struct Inode {
         uint32_t Valid;        // Whether or not inode is valid
         uint32_t Size;        // Size of file
-        uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
-        uint32_t Indirect;    // Indirect pointer
+        union {
+            struct {
+                uint32_t Direct[POINTERS_PER_INODE]; // Direct pointers
+                uint32_t Indirect;    // Indirect pointer
+            };
+            char Inline[INLINE_SIZE];    // Inline data (with INODE_INLINE)
+        };
+    };
+
+    enum EntryType : uint8_t {
+        ENTRY_FREE = 0,
+        ENTRY_FILE,
+        ENTRY_DIRECTORY,
+        ENTRY_DELETED,
+    };
+
+    struct DirEntry {           // Directory hash slot
+        uint32_t Inumber;       // Inode number of entry
+        uint8_t Type;           // EntryType of slot
+        char Name[NAME_LENGTH]; // Name (not NUL terminated when full)
     };
 
-    union Block {
+    struct DirHeader {          // Directory header (occupies slot 0)
+        uint32_t Parent;        // Parent directory inode
+        uint32_t Entries;       // Number of live entries
+        uint32_t Tombstones;    // Number of deleted slots
+        uint32_t Reserved[5];
+    };
+
+    // Read superblock from the first disk block
+    // @param	disk	    Disk to read
+    // @param	super	    Superblock to fill in
+    static void read_super(Disk *disk, SuperBlock &super);
+
+    // Locate a block of the inode table
+    // @param	super	    Superblock describing the layout
+    // @param	index	    Index of block in inode table
+    // Blocks added by grow follow those laid out by format, region by region.
+    // Returns block number of the inode block.
+    static size_t inode_block(const SuperBlock &super, size_t index);
+
+    // Count block groups that get an inode slice
+    // @param	blocks	    Number of blocks in file system
+    // @param	group_blocks	    Blocks per group
+    // @param	group_inode_blocks  Inode blocks per group
+    // A tail too short for an inode slice and data joins the last group.
+    static uint32_t group_count(size_t blocks, uint32_t group_blocks, uint32_t group_inode_blocks);
+
+    // Mount with an already read superblock
+    virtual bool mount(Disk *disk, const SuperBlock &super) = 0;
+};
+
+// File system with BLOCK_BYTES bytes per block. Each block spans
+// BLOCK_BYTES / Disk::BLOCK_SIZE consecutive disk blocks, and all index math
+// is constant folded for the geometry.
+template <size_t BLOCK_BYTES>
+class BlockVolume : public Volume {
+public:
+    const static size_t BLOCK_SIZE = BLOCK_BYTES;
+    const static size_t SECTORS = BLOCK_SIZE / Disk::BLOCK_SIZE;
+    const static uint32_t INODES_PER_BLOCK = BLOCK_SIZE / sizeof(Inode);
+    const static uint32_t POINTERS_PER_BLOCK = BLOCK_SIZE / sizeof(uint32_t);
+    const static uint32_t FRAGMENT_SIZE = BLOCK_SIZE / FRAGMENTS_PER_BLOCK;
+    const static uint32_t FRAGMENT_LIMIT = BLOCK_SIZE / 2;
+    const static uint32_t ENTRIES_PER_BLOCK = BLOCK_SIZE / sizeof(DirEntry);
+    const static uint32_t DIRECTORY_MAX_SLOTS = POINTERS_PER_BLOCK * ENTRIES_PER_BLOCK;
+    const static uint32_t GROUP_BLOCKS = 8 * BLOCK_SIZE;    // Blocks one bitmap block describes
+
+private:
+    union alignas(Disk::BLOCK_SIZE) Block { // 对齐以便O_DIRECT直接读写
         SuperBlock Super;                // Superblock
         Inode Inodes[INODES_PER_BLOCK];        // Inode block
         uint32_t Pointers[POINTERS_PER_BLOCK];   // Pointer block
-        char Data[Disk::BLOCK_SIZE];        // Data block
+        DirHeader Header;                // Directory header block
+        DirEntry Entries[ENTRIES_PER_BLOCK];     // Directory block
+        char Data[BLOCK_SIZE];        // Data block
+    };
+
+    // Allocation, like the rest of the volume, is single-threaded: callers must serialize it
+    struct Group {              // Block group: inode slice followed by data
+        size_t Start;           // First block tracked by Free
+        size_t Data;            // First data block
+        size_t End;             // One past last block
+        Bitmap Free;            // Used blocks in [Start, End)
     };
 
+    // Block I/O in terms of file system blocks
+    static void read_block(Disk *disk, size_t blocknum, char *data);
+
+    static void write_block(Disk *disk, size_t blocknum, char *data);
+
+    static void read_blocks(Disk *disk, size_t blocknum, size_t nblocks, char *data);
+
+    static void write_blocks(Disk *disk, size_t blocknum, size_t nblocks, char *data);
+
+    static bool discard_blocks(Disk *disk, size_t blocknum, size_t nblocks);
+
+    // Block group helper functions
+    size_t group_of(size_t blocknum) const;
+
+    size_t group_of_inode(size_t inumber) const;
+
+    bool block_used(size_t blocknum) const;
+
+    void mark_used(size_t blocknum);
+
+    void mark_free(size_t blocknum);
+
     // Internal helper functions
     bool load_inode(size_t inumber, Inode *inode);
 
-    void read_in_block(uint32_t blocknum, int offset, int *length, char **ptr);
+    void read_in_block(uint32_t blocknum, size_t offset, size_t *length, char **ptr);
+
+    size_t read_run(const uint32_t *pointers, size_t count, size_t *length, char **ptr);
+
+    ssize_t read_inode(size_t inumber, char *data, size_t length, size_t offset);
 
     bool allocate_block(uint32_t &blocknum);
 
+    void release_block(uint32_t blocknum);
+
+    void flush_discards();
+
+    void add_ref(uint32_t blocknum);
+
+    bool drop_ref(uint32_t blocknum);
+
+    bool own_block(uint32_t &blocknum, bool indirect = false);
+
+    bool block_list(const Inode &inode, Block &indirect, std::vector<uint32_t> &blocks);
+
+    uint32_t find_free_run(size_t length, size_t group);
+
+    size_t free_blocks() const;
+
+    size_t relocate(size_t inumber, Inode &inode, Block &indirect, const std::vector<uint32_t> &blocks, uint32_t start);
+
     void write_inode_to_block(size_t inumber, Inode *inode);
 
-    void write_data_to_block(int offset, int *num_bytes, int length, char *data, uint32_t blocknum);
+    void write_data_to_block(size_t offset, size_t *num_bytes, size_t length, char *data, uint32_t blocknum);
+
+    uint32_t block_of(const Inode &inode, uint32_t index);
+
+    // Copy helper functions
+    uint32_t *block_slot(Inode &inode, Block &indirect, bool &loaded, uint32_t index);
+
+    bool claim_block(uint32_t blocknum, uint32_t &target);
+
+    void commit_claim(uint32_t &blocknum, uint32_t target);
+
+    void release_claim(uint32_t blocknum, uint32_t target);
+
+    size_t share_blocks(size_t src, size_t src_offset, size_t dst, size_t dst_offset, size_t length);
+
+    size_t copy_buffered(size_t src, size_t src_offset, size_t dst, size_t dst_offset, size_t length);
+
+    bool blocks_from_file(int fd, off_t fd_offset, uint32_t blocknum, size_t nblocks, char *buffer);
+
+    bool blocks_to_file(uint32_t blocknum, size_t nblocks, int fd, off_t fd_offset, char *buffer);
+
+    // Small file helper functions
+    static bool packed(const Inode &inode);
+
+    static bool has_blocks(const Inode &inode);
+
+    void read_small(const Inode &inode, char *data, size_t length, size_t offset);
+
+    bool allocate_fragments(uint32_t count, uint32_t &blocknum, uint32_t &index, bool &fresh);
+
+    void release_small(Inode &inode, size_t size);
+
+    ssize_t write_small(size_t inumber, Inode &inode, size_t old_size, char *data, size_t length, size_t offset);
+
+    bool unpack_small(Inode &inode, size_t old_size);
+
+    // Preallocation helper functions
+    static uint32_t unwritten_from(const Inode &inode);
+
+    void zero_unwritten(const Inode &inode, uint32_t from, uint32_t to);
+
+    void settle_unwritten(Inode &inode, size_t offset, size_t length);
+
+    void fill_unwritten(size_t inumber, Inode &inode);
+
+    // Directory helper functions
+    bool ensure_root();
+
+    ssize_t resolve(const std::string &path);
+
+    ssize_t resolve_parent(const std::string &path, std::string &name);
+
+    bool init_directory(size_t inumber, size_t parent);
+
+    ssize_t dir_lookup(size_t dir, const std::string &name);
+
+    bool dir_insert(size_t dir, const std::string &name, size_t inumber, uint8_t type);
+
+    bool dir_erase(size_t dir, const std::string &name);
+
+    bool dir_rehash(size_t dir, Inode &inode, uint32_t slots);
+
+    ssize_t create_at(const char *path, bool directory);
 
     // Internal member variables
-    Disk *cur_disk; // 当前选定磁盘
+    Disk *cur_disk = nullptr; // 当前选定磁盘
     struct SuperBlock MetaData; // 超级块信息
-    std::vector<bool> free_block_bitmap; // 空闲块列表
+    std::unique_ptr<Group[]> groups; // 块组，各自的空闲块位图（两级位图）
+    size_t num_groups = 0; // 块组数量（旧布局只有一组）
+    size_t group_blocks = 0; // 每组的块数
+    size_t group_inode_blocks = 0; // 每组开头的inode块数
+    size_t alloc_group = 0; // 分配数据块时优先使用的块组
+    size_t base_groups = 0; // 格式化时划分的块组数量，之后每个扩展区一组
+    size_t base_blocks = 0; // 格式化时的块数
+    size_t base_inode_blocks = 0; // 格式化时的inode块数
     std::vector<int> inode_counter; // 记录每个inode块中已使用的inode数量
+    std::map<uint32_t, uint32_t> fragment_blocks; // 未满的碎片块 -> 已使用碎片的掩码
+    std::unordered_map<std::string, uint32_t> dentry_cache; // (目录inode, 名字) -> inode
+    std::unordered_map<uint32_t, uint32_t> block_refs; // 被克隆共享的块 -> 引用数
+    bool discard_mode = false; // 释放的块是否归还给宿主机
+    std::vector<uint32_t> discard_pending; // 等待批量discard的块
+    size_t defrag_cursor = 0; // 碎片整理下次开始检查的inode
+    size_t inodes_used = 0; // 已使用的inode数量
+
+    bool mount(Disk *disk, const SuperBlock &super);
 
 public:
     static void debug(Disk *disk);
 
-    static bool format(Disk *disk);
+    static void debug(Disk *disk, const SuperBlock &super);
+
+    static bool format(Disk *disk, uint32_t inode_percent);
+
+    bool mount(Disk *disk);
+
+    ssize_t create();
+
+    bool remove(size_t inumber);
+
+    ssize_t stat(size_t inumber);
+
+    ssize_t read(size_t inumber, char *data, size_t length, size_t offset);
+
+    ssize_t write(size_t inumber, char *data, size_t length, size_t offset);
+
+    bool map(size_t inumber, FileView &view);
+
+    // Batch interface (one read-modify-write per inode block)
+    size_t create_many(size_t count, std::vector<size_t> &inumbers);
+
+    void stat_many(const std::vector<size_t> &inumbers, std::vector<ssize_t> &sizes);
+
+    size_t remove_many(const std::vector<size_t> &inumbers);
+
+    ssize_t clone(size_t inumber);
+
+    // Copy interface
+    ssize_t copy_range(size_t src, size_t src_offset, size_t dst, size_t dst_offset, size_t length);
+
+    ssize_t splice_in(size_t inumber, size_t offset, int fd, off_t fd_offset, size_t length);
+
+    ssize_t splice_out(size_t inumber, size_t offset, int fd, off_t fd_offset, size_t length);
+
+    // Statfs interface
+    bool statfs(StatFS &stats);
+
+    // Defragment interface
+    ssize_t defrag(size_t budget);
+
+    ssize_t extents(size_t inumber);
+
+    // Preallocation interface
+    bool fallocate(size_t inumber, size_t offset, size_t length);
+
+    // Grow interface
+    bool grow(size_t blocks, bool inodes);
+
+    // Discard interface
+    void set_discard(bool enabled);
+
+    ssize_t trim();
+
+    // Path based interface
+    ssize_t open(const char *path);
+
+    ssize_t create(const char *path);
+
+    ssize_t mkdir(const char *path);
+
+    bool unlink(const char *path);
+
+    bool list(const char *path, std::vector<DirectoryEntry> &entries);
+};
+
+// File system front end: picks the BlockVolume matching the superblock
+class FileSystem {
+public:
+    typedef Volume::DirectoryEntry DirectoryEntry;
+    typedef Volume::StatFS StatFS;
+
+    // Print the layout and inodes of a disk
+    // @param	disk	    Disk to print
+    // A log-structured disk this file system has mounted is read through
+    // the mounted log, since it cannot be opened a second time.
+    void debug(Disk *disk);
+
+    // Format disk
+    // @param	disk	    Disk to format
+    // @param	block_size  Bytes per block (power of two, 4 KiB to 64 KiB)
+    // @param	inode_percent  Percent of blocks holding inodes
+    // @param	logged	    Whether to append all writes to a log (see LogDisk)
+    static bool format(Disk *disk, size_t block_size = Disk::BLOCK_SIZE, uint32_t inode_percent = Volume::DEFAULT_INODE_PERCENT,
+                       bool logged = false);
 
     bool mount(Disk *disk);
 
@@ -67,7 +511,118 @@ public:
 
     ssize_t stat(size_t inumber);
 
-    ssize_t read(size_t inumber, char *data, int length, size_t offset);
+    ssize_t read(size_t inumber, char *data, size_t length, size_t offset);
+
+    ssize_t write(size_t inumber, char *data, size_t length, size_t offset);
+
+    // Map a file read-only without copying
+    // @param	inumber	    Inode to map
+    // Contiguous extents are exposed in place when the disk can be mapped;
+    // small files and unmappable disks are gathered into buffers. The view
+    // must not be used after the next mutating call (see FileView). Returns
+    // NULL if the inode is invalid.
+    std::unique_ptr<FileView> map(size_t inumber);
+
+    // Batch interface (one read-modify-write per inode block)
+    size_t create_many(size_t count, std::vector<size_t> &inumbers);
+
+    void stat_many(const std::vector<size_t> &inumbers, std::vector<ssize_t> &sizes);
+
+    size_t remove_many(const std::vector<size_t> &inumbers);
+
+    ssize_t clone(size_t inumber);
+
+    // Copy length bytes between inodes without a caller buffer
+    // @param	src	    Inode to copy from
+    // @param	src_offset  Offset in source
+    // @param	dst	    Inode to copy to
+    // @param	dst_offset  Offset in destination
+    // @param	length	    Number of bytes to copy
+    // Aligned whole blocks are shared copy-on-write. Returns bytes copied.
+    ssize_t copy_range(size_t src, size_t src_offset, size_t dst, size_t dst_offset, size_t length);
+
+    // Copy length bytes of a host file into an inode
+    // @param	inumber	    Inode to copy to
+    // @param	offset	    Offset in inode
+    // @param	fd	    Host file to copy from
+    // @param	fd_offset   Offset in host file
+    // @param	length	    Number of bytes to copy
+    // Returns bytes copied.
+    ssize_t splice_in(size_t inumber, size_t offset, int fd, off_t fd_offset, size_t length);
+
+    // Copy up to length bytes of an inode into a host file
+    // @param	inumber	    Inode to copy from
+    // @param	offset	    Offset in inode
+    // @param	fd	    Host file to copy to
+    // @param	fd_offset   Offset in host file
+    // @param	length	    Maximum number of bytes to copy
+    // Returns bytes copied.
+    ssize_t splice_out(size_t inumber, size_t offset, int fd, off_t fd_offset, size_t length);
+
+    // Statfs interface
+    bool statfs(StatFS &stats);
+
+    // Defragment interface
+    ssize_t defrag(size_t budget);
+
+    ssize_t extents(size_t inumber);
+
+    // Reserve blocks for a byte range without writing data
+    // @param	inumber	    Inode to reserve blocks for
+    // @param	offset	    Offset of range
+    // @param	length	    Length of range
+    // Missing blocks are taken from one contiguous run where possible and
+    // marked unwritten, so they read as zeros until written; the file grows
+    // to cover the range. Returns false if the inode is invalid or a
+    // directory, or if the disk has too few free blocks (nothing is reserved).
+    bool fallocate(size_t inumber, size_t offset, size_t length);
+
+    // Grow the mounted file system onto a larger disk
+    // @param	blocks	    New number of blocks
+    // @param	inodes	    Whether to add inode capacity in proportion to the new blocks
+    // The disk is enlarged and the added blocks become a new region that
+    // starts with its own slice of the inode table; nothing already on disk
+    // moves. Returns false if the disk cannot grow (log-structured volumes),
+    // blocks is not larger than the current size, or the file system has
+    // been grown MAX_EXTENSIONS times.
+    bool grow(size_t blocks, bool inodes);
+
+    // Reclaim log segments whose blocks have mostly been overwritten
+    // @param	budget	    Maximum number of segments to clean
+    // Returns segments cleaned, or -1 if the volume is not log-structured.
+    ssize_t clean(size_t budget);
+
+    // Discard interface
+    void set_discard(bool enabled);
+
+    ssize_t trim();
+
+    // Path based interface
+    ssize_t open(const char *path);
+
+    ssize_t create(const char *path);
+
+    ssize_t mkdir(const char *path);
+
+    bool unlink(const char *path);
+
+    bool list(const char *path, std::vector<DirectoryEntry> &entries);
+
+private:
+    // Return block size recorded in superblock (0 if not a file system)
+    static size_t block_size_of(const Volume::SuperBlock &super);
+
+    // Create volume for block size (NULL if unsupported)
+    static Volume *make_volume(size_t block_size);
+
+    // Run an operation with the disk collecting its requests in one batch
+    // @param	operation   Operation to run
+    // Queued requests are performed when the operation returns or throws.
+    template <typename Operation>
+    auto batch(Operation operation) -> decltype(operation());
 
-    ssize_t write(size_t inumber, char *data, int length, size_t offset);
+    Disk *device = nullptr;         // 卷所在的磁盘（日志或物理盘）
+    std::unique_ptr<LogDisk> log;   // 日志结构卷所在的日志（须比卷后析构）
+    std::unique_ptr<Volume> volume; // 当前挂载的卷
+    bool discard_mode = false; // 挂载前设置的discard模式
 };
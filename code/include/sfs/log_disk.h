@@ -0,0 +1,196 @@
+// log_disk.h: log-structured block layer over a disk
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <stdint.h>
+
+#include <vector>
+
+// Presents a smaller logical disk whose writes are appended to segments of
+// the underlying disk.  Each segment starts with a summary block naming the
+// logical blocks it holds and the segment to be written after it; the
+// logical-to-physical block map (which covers the inode table as well as
+// data) is checkpointed to one of two fixed regions, and the chain of
+// segments written after the last checkpoint is rolled forward when the log
+// is opened.  Segments whose blocks have mostly been overwritten
+// are cleaned by copying their live blocks to the head of the log.
+class LogDisk : public Disk {
+private:
+    struct SuperBlock {	    // Physical block 0
+    	uint32_t MagicNumber;	    // LOG_MAGIC
+    	uint32_t SegmentBlocks;	    // Blocks per segment (summary included)
+    	uint64_t Segments;	    // Number of segments
+    	uint64_t Blocks;	    // Number of logical blocks
+    	uint64_t MapBlocks;	    // Blocks of block map in each checkpoint region
+    };
+
+    struct Checkpoint {	    // First block of a checkpoint region, followed by the map
+    	uint32_t MagicNumber;	    // LOG_MAGIC
+    	uint32_t Checksum;	    // Checksum of the block map
+    	uint64_t Generation;	    // Checkpoint number (region is Generation % 2)
+    	uint64_t Sequence;	    // Last segment written before the checkpoint
+    	uint64_t Head;		    // Segment to be written after it (NONE if undecided)
+    };
+
+    struct Summary {	    // First block of a segment
+    	uint32_t MagicNumber;	    // LOG_MAGIC
+    	uint32_t Count;		    // Number of blocks following the summary
+    	uint64_t Sequence;	    // Order in which segments were written
+    	uint64_t Following;	    // Segment to be written next (NONE if undecided)
+    	uint64_t Logical[BLOCK_SIZE / sizeof(uint64_t) - 3];	// Logical block of each following block
+    };
+
+    enum State : uint8_t {
+    	FREE,			    // Reusable
+    	PENDING,		    // Emptied since the last checkpoint, which may still refer to it
+    	USED,			    // Holds live blocks
+    	CURRENT,		    // Being filled in memory
+    };
+
+    Disk   *Base;		    // Disk holding the log
+    SuperBlock	Geometry;	    // Layout of the log
+    size_t  Start;		    // First block of segment 0
+    std::vector<uint64_t> Map;	    // Physical block of each logical block (0 if unwritten)
+    std::vector<uint64_t> Owner;    // Logical block held by each segment slot (NONE if dead)
+    std::vector<uint32_t> Live;	    // Live blocks in each segment
+    std::vector<State> States;	    // State of each segment
+    std::vector<bool> Stale[2];	    // Map blocks changed since each region was written
+    size_t  Current;		    // Segment being filled (NONE if none)
+    size_t  Next;		    // Free segment reserved to be written next (NONE if none)
+    size_t  Cursor;		    // Segment opened last
+    size_t  Fill;		    // Next slot in current segment
+    char   *Buffer;		    // Current segment (summary first)
+    uint64_t Sequence;		    // Last segment sequence number used
+    uint64_t Generation;	    // Last checkpoint written
+    size_t  Flushed;		    // Segments written since the last checkpoint
+    bool    Dirty;		    // Whether the map changed since the last checkpoint
+    bool    Cleaning;		    // Whether the cleaner is relocating blocks
+    size_t  Cleaned;		    // Segments cleaned since the log was opened
+
+    const static uint64_t NONE = UINT64_MAX;
+
+    // Compute the layout of a log on a disk
+    // @param	blocks	    Number of blocks in underlying disk
+    // @param	geometry    Layout to fill in
+    // Returns false if the disk is too small.
+    static bool layout(size_t blocks, SuperBlock &geometry);
+
+    // Checksum of a block map
+    static uint32_t checksum(const std::vector<uint64_t> &map);
+
+    // Return first block of a checkpoint region
+    size_t region(uint64_t generation) const { return 1 + (generation % 2) * (1 + Geometry.MapBlocks); }
+
+    // Return first block of a segment
+    size_t segment_start(size_t segment) const { return Start + segment * Geometry.SegmentBlocks; }
+
+    // Return number of segments that are free or pending
+    size_t available() const;
+
+    // Load the newest valid checkpoint and roll later segments forward
+    // Returns false if no checkpoint is valid.
+    bool recover();
+
+    // Forget the location of a block
+    // @param	physical    Block that no longer holds live data
+    void release(uint64_t physical);
+
+    // Point a logical block at a new location
+    // @param	blocknum    Logical block
+    // @param	physical    New location (0 to unmap)
+    void remap(size_t blocknum, uint64_t physical);
+
+    // Append a block to the head of the log
+    // @param	blocknum    Logical block
+    // @param	data	    Block contents
+    void append(size_t blocknum, const char *data);
+
+    // Reserve the next segment to write, if none is reserved
+    // @param	pending	    Whether segments emptied since the last checkpoint qualify
+    void reserve(bool pending);
+
+    // Start filling the reserved segment
+    // Throws runtime_error exception if the log is full.
+    void open_segment();
+
+    // Write the current segment, if any
+    void write_segment();
+
+    // Write the block map
+    void checkpoint();
+
+    // Copy the live blocks of the emptiest segment to the head of the log
+    // @param	limit	    Most live blocks worth copying
+    // Returns false if no segment can be reclaimed.
+    bool clean_one(size_t limit);
+
+protected:
+    bool punch(size_t blocknum, size_t nblocks);
+
+public:
+    // Magic number of the log superblock, checkpoints and segment summaries
+    const static uint32_t LOG_MAGIC = 0xf0f03413;
+
+    // Blocks per segment on large disks (small disks use shorter segments)
+    const static uint32_t SEGMENT_BLOCKS = 64;
+
+    // Segments written between checkpoints
+    const static size_t CHECKPOINT_SEGMENTS = 16;
+
+    // Segments kept in reserve so the cleaner can always make progress
+    const static size_t RESERVE_SEGMENTS = 4;
+
+    // Default constructor
+    LogDisk() : Base(NULL), Geometry(), Start(0), Current(NONE), Next(NONE), Cursor(0), Fill(0), Buffer(NULL), Sequence(0), Generation(0), Flushed(0), Dirty(false), Cleaning(false), Cleaned(0) {}
+
+    // Destructor (writes the current segment and a checkpoint)
+    ~LogDisk();
+
+    // Initialize an empty log on a disk
+    // @param	disk	    Disk to format
+    // Returns false if the disk is mounted or too small.
+    static bool format(Disk *disk);
+
+    // Print the layout and checkpoints of a log
+    // @param	disk	    Disk holding the log
+    static void debug(Disk *disk);
+
+    // Open the log on a disk, holding the disk mounted until destroyed
+    // @param	disk	    Disk holding the log
+    // Returns false if the disk is mounted or holds no valid log.
+    bool open(Disk *disk);
+
+    // Perform queued writes, write the current segment and checkpoint the block map
+    void sync();
+
+    // Clean segments while few are free
+    // @param	budget	    Maximum number of segments to clean
+    // Returns number of segments cleaned.
+    size_t clean(size_t budget);
+
+    // Return number of segments cleaned since the log was opened
+    size_t cleaned() const { return Cleaned; }
+
+    // Return the disk holding the log (NULL if not open)
+    Disk *base() const { return Base; }
+
+    void read(size_t blocknum, char *data);
+
+    void write(size_t blocknum, char *data);
+
+    void read_blocks(size_t blocknum, size_t nblocks, char *data);
+
+    void write_blocks(size_t blocknum, size_t nblocks, char *data);
+
+    // The block map regions are sized when the log is formatted, so it never grows
+    bool grow(size_t nblocks) { return nblocks <= Blocks; }
+
+    // Logical blocks move around, so they are never mapped or copied in place
+    const char *map(size_t blocknum, size_t nblocks) { return NULL; }
+
+    bool copy_in(size_t blocknum, size_t nblocks, int fd, off_t offset) { return false; }
+
+    bool copy_out(size_t blocknum, size_t nblocks, int fd, off_t offset) { return false; }
+};
@@ -0,0 +1,45 @@
+// profile.h: hot-path profiling probes
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// PROFILE_SCOPE(name) times the rest of the enclosing scope.  Probes exist
+// only when the library is built with `make PROFILE=1` (-DSFS_PROFILE);
+// otherwise they expand to nothing.
+#ifdef SFS_PROFILE
+#define PROFILE_SCOPE(name) Profile::Scope profile_scope(name)
+#else
+#define PROFILE_SCOPE(name) do {} while (0)
+#endif
+
+class Profile {
+public:
+    // Return whether the probes were compiled in
+    static bool enabled();
+
+    // Print flat and call-path profiles of every thread
+    // @param	stream	    Stream to print to
+    // Other threads should not be inside a probe while this runs.
+    static void report(FILE *stream);
+
+    // Forget everything recorded so far
+    // Other threads should not be inside a probe while this runs.
+    static void reset();
+
+#ifdef SFS_PROFILE
+    struct Node;
+
+    class Scope {
+    private:
+    	Node	*Parent;    // Node that was current when scope was entered
+    	uint64_t Start;	    // Cycle counter at entry
+
+    public:
+    	// @param	name	    Probe name (must be a string literal)
+    	explicit Scope(const char *name);
+    	~Scope();
+    };
+#endif
+};
@@ -0,0 +1,56 @@
+// protocol.h: sfsd wire protocol
+
+#pragma once
+
+#include <stdint.h>
+
+// Every message is a fixed header followed by Length bytes of payload.
+// A client may send any number of requests before reading responses;
+// responses on a connection come back in request order.
+class Protocol {
+public:
+    // Largest payload in either direction (larger reads are shortened)
+    const static uint32_t MAX_PAYLOAD = 1 << 20;
+
+    enum Operation : uint16_t {
+    	OP_CREATE = 1,	    // -> inode
+    	OP_REMOVE,	    // Inumber -> 1 or 0
+    	OP_STAT,	    // Inumber -> size
+    	OP_READ,	    // Inumber, Offset, Count -> bytes read, data
+    	OP_WRITE,	    // Inumber, Offset, data -> bytes written
+    	OP_CLONE,	    // Inumber -> inode
+    	OP_COPY_RANGE,	    // Inumber, Offset, Target, TargetOffset, Count -> bytes copied
+    	OP_STATFS,	    // -> 1 or 0, StatFS
+    	OP_OPEN,	    // path -> inode
+    	OP_CREATE_PATH,	    // path -> inode
+    	OP_MKDIR,	    // path -> inode
+    	OP_UNLINK,	    // path -> 1 or 0
+    	OP_LIST,	    // path -> 1 or 0, entries
+    };
+
+    struct Request {
+    	uint32_t Tag;		    // Chosen by client, echoed in response
+    	uint16_t Op;		    // Operation
+    	uint16_t Reserved;
+    	uint32_t Length;	    // Payload bytes (write data or path)
+    	uint32_t Padding;
+    	uint64_t Inumber;	    // Inode (source of OP_COPY_RANGE)
+    	uint64_t Offset;	    // Offset in inode
+    	uint64_t Target;	    // Destination inode of OP_COPY_RANGE
+    	uint64_t TargetOffset;	    // Offset in destination
+    	uint64_t Count;		    // Bytes to read or copy
+    };
+
+    struct Response {
+    	uint32_t Tag;		    // Tag of request
+    	uint32_t Length;	    // Payload bytes
+    	int64_t  Result;	    // Return value of the operation (-1 on failure)
+    };
+
+    // OP_LIST payload: one record per entry, followed by the name
+    struct ListRecord {
+    	uint64_t Inumber;	    // Inode number of entry
+    	uint8_t  Directory;	    // Whether or not entry is a directory
+    	uint8_t  NameLength;	    // Bytes of name that follow
+    };
+};
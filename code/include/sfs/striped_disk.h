@@ -0,0 +1,75 @@
+// striped_disk.h: RAID-0 disk emulator over several image files
+
+#pragma once
+
+#include "sfs/disk.h"
+
+#include <string>
+#include <vector>
+
+class StripedDisk : public Disk {
+private:
+    std::vector<int> Members;	    // File descriptors of member images
+    size_t  StripeBlocks;	    // Number of blocks per stripe unit
+
+    // One contiguous piece of a request on a single member
+    struct Extent {
+    	size_t	Member;		    // Member index
+    	off_t	Offset;		    // Byte offset in member image
+    	size_t	Length;		    // Number of bytes
+    	char   *Data;		    // Buffer position
+    };
+
+    // Split a range of blocks into per-member extents
+    // @param	blocknum    First block of range
+    // @param	nblocks	    Number of blocks in range
+    // @param	data	    Buffer for range
+    std::vector<Extent> split(size_t blocknum, size_t nblocks, char *data) const;
+
+    // Perform extents, one thread per member involved
+    // @param	extents	    Extents to perform
+    // @param	writing	    Whether to write instead of read
+    // Throws runtime_error exception on error.
+    void transfer(const std::vector<Extent> &extents, bool writing);
+
+protected:
+    bool punch(size_t blocknum, size_t nblocks);
+
+public:
+    // Default stripe unit (in terms of blocks)
+    const static size_t DEFAULT_STRIPE = 16;
+
+    // Default constructor
+    StripedDisk() : StripeBlocks(DEFAULT_STRIPE) {}
+
+    // Destructor
+    ~StripedDisk();
+
+    // Open member images
+    // @param	paths	    Paths to member images
+    // @param	nblocks	    Number of blocks in striped disk
+    // @param	stripe	    Number of blocks per stripe unit
+    // @param	direct	    Whether to bypass the host page cache (O_DIRECT)
+    // Throws runtime_error exception on error.
+    void open(const std::vector<std::string> &paths, size_t nblocks, size_t stripe = DEFAULT_STRIPE, bool direct = false);
+
+    // Return number of member images
+    size_t members() const { return Members.size(); }
+
+    bool grow(size_t nblocks);
+
+    void read(size_t blocknum, char *data);
+
+    void write(size_t blocknum, char *data);
+
+    void read_blocks(size_t blocknum, size_t nblocks, char *data);
+
+    void write_blocks(size_t blocknum, size_t nblocks, char *data);
+
+    // Blocks are spread across members, so they are never mapped
+    const char *map(size_t blocknum, size_t nblocks) { return NULL; }
+
+    bool copy_in(size_t blocknum, size_t nblocks, int fd, off_t offset);
+
+    bool copy_out(size_t blocknum, size_t nblocks, int fd, off_t offset);
+};
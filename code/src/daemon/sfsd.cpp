@@ -0,0 +1,503 @@
+// sfsd.cpp: Simple file system daemon
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+#include "sfs/protocol.h"
+#include "sfs/striped_disk.h"
+
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Macros
+
+#define streq(a, b) (strcmp((a), (b)) == 0)
+
+// Globals
+
+static volatile sig_atomic_t Running = 1;	// Cleared by SIGINT/SIGTERM
+
+static size_t Requests = 0;	// Requests served
+static size_t Batches  = 0;	// Batches executed
+static size_t Merged   = 0;	// Requests folded into another request's I/O
+
+// Connections stop being read while this many response bytes are queued
+static const size_t OUTPUT_LIMIT = 4 * Protocol::MAX_PAYLOAD;
+
+// Types
+
+struct Connection {
+    int		Socket;	    // Client socket
+    std::string	In;	    // Received bytes not yet parsed
+    std::string	Out;	    // Responses not yet sent
+    bool	Closed;	    // Whether the client has gone away
+};
+
+struct Pending {
+    Connection	       *Client;	    // Connection of request
+    Protocol::Request	Request;    // Request header
+    std::string		Payload;    // Request payload
+    int64_t		Result;	    // Result of request
+    std::string		Reply;	    // Response payload
+};
+
+// Request execution
+
+void execute(FileSystem &fs, Pending &p);
+size_t find_run(const std::vector<Pending> &batch, size_t i);
+void execute_run(FileSystem &fs, std::vector<Pending> &batch, size_t i, size_t j);
+void execute_batch(FileSystem &fs, std::vector<Pending> &batch);
+
+// Connection handling
+
+int listen_on(const char *path);
+void accept_clients(int listener, std::list<Connection> &clients);
+void receive(Connection &client);
+void parse(Connection &client, std::vector<Pending> &requests);
+void flush(Connection &client);
+
+void stop(int signum) {
+    Running = 0;
+}
+
+// Main execution
+
+int main(int argc, char *argv[]) {
+    std::unique_ptr<Disk> disk;
+    FileSystem	fs;
+    size_t	stripe = 0;
+    Disk::Timing timing{};
+    bool	timed = false;
+    bool	direct = false;
+
+    // 可选参数与sfssh相同：条带单元、时间模型、O_DIRECT
+    int argi = 1;
+    while (argc - argi > 3 && argv[argi][0] == '-') {
+    	if (streq(argv[argi], "-d")) {
+    	    direct = true;
+    	    argi += 1;
+    	    continue;
+	} else if (streq(argv[argi], "-s")) {
+    	    stripe = atoi(argv[argi + 1]);
+	} else if (streq(argv[argi], "-t") && Disk::timing_profile(argv[argi + 1], timing)) {
+    	    timed = true;
+	} else {
+    	    break;
+	}
+    	argi += 2;
+    }
+
+    if (argc - argi != 3) {
+    	fprintf(stderr, "Usage: %s [-d] [-s <stripe>] [-t <hdd|ssd|seek_base,seek_per_block,seek_max,latency,bandwidth>] <socket> <diskfile>[,<diskfile>...] <nblocks>\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+    const char *socket_path = argv[argi];
+
+    std::vector<std::string> paths;
+    std::stringstream ss(argv[argi + 1]);
+    for (std::string path; std::getline(ss, path, ',');) {
+    	paths.push_back(path);
+    }
+
+    try {
+    	if (paths.size() > 1 || stripe) {
+    	    StripedDisk *striped = new StripedDisk();
+    	    disk.reset(striped);
+    	    striped->open(paths, strtoull(argv[argi + 2], NULL, 10), stripe ? stripe : StripedDisk::DEFAULT_STRIPE, direct);
+	} else {
+    	    disk.reset(new Disk());
+    	    disk->open(argv[argi + 1], strtoull(argv[argi + 2], NULL, 10), direct);
+	}
+    } catch (std::exception &e) {
+    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[argi + 1], e.what());
+    	return EXIT_FAILURE;
+    }
+
+    if (timed) {
+    	disk->set_timing(timing);
+    }
+
+    // 守护进程只服务已经格式化的磁盘
+    if (!fs.mount(disk.get())) {
+    	fprintf(stderr, "Unable to mount %s\n", argv[argi + 1]);
+    	return EXIT_FAILURE;
+    }
+
+    int listener = listen_on(socket_path);
+    if (listener < 0) {
+    	return EXIT_FAILURE;
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    std::list<Connection> clients;
+    while (Running) {
+    	// 输出积压过多的客户端暂停读取，等待其取走响应
+    	std::vector<struct pollfd> fds(1, {listener, POLLIN, 0});
+    	for (Connection &client : clients) {
+    	    short events = client.Out.size() < OUTPUT_LIMIT ? POLLIN : 0;
+    	    if (!client.Out.empty()) {
+    	    	events |= POLLOUT;
+	    }
+    	    fds.push_back({client.Socket, events, 0});
+	}
+
+    	if (poll(fds.data(), fds.size(), -1) < 0) {
+    	    if (errno == EINTR) {
+    	    	continue;
+	    }
+    	    perror("poll");
+    	    break;
+	}
+
+    	// 收集所有就绪客户端的完整请求，轮流各取一个组成一批
+    	std::vector<std::vector<Pending>> queues;
+    	size_t k = 1;
+    	for (Connection &client : clients) {
+    	    short revents = fds[k++].revents;
+    	    if (revents & POLLIN) {
+    	    	receive(client);
+	    } else if (revents & (POLLHUP | POLLERR)) {
+    	    	client.Closed = true;
+	    }
+    	    if (revents & POLLOUT) {
+    	    	flush(client);
+	    }
+    	    queues.push_back(std::vector<Pending>());
+    	    parse(client, queues.back());
+	}
+
+    	std::vector<Pending> batch;
+    	for (size_t round = 0, added = 1; added; round++) {
+    	    added = 0;
+    	    for (std::vector<Pending> &queue : queues) {
+    	    	if (round < queue.size()) {
+    	    	    batch.push_back(std::move(queue[round]));
+    	    	    added++;
+		}
+	    }
+	}
+
+    	if (!batch.empty()) {
+    	    execute_batch(fs, batch);
+    	    for (Pending &p : batch) {
+    	    	Protocol::Response response = {p.Request.Tag, (uint32_t) p.Reply.size(), p.Result};
+    	    	p.Client->Out.append((const char *)&response, sizeof(response));
+    	    	p.Client->Out.append(p.Reply);
+	    }
+    	    for (Connection &client : clients) {
+    	    	flush(client);
+	    }
+	}
+
+    	// 新客户端在本轮结束后加入，不会被上面的下标错位
+    	if (fds[0].revents & POLLIN) {
+    	    accept_clients(listener, clients);
+	}
+
+    	for (auto it = clients.begin(); it != clients.end();) {
+    	    if (it->Closed) {
+    	    	close(it->Socket);
+    	    	it = clients.erase(it);
+	    } else {
+    	    	++it;
+	    }
+	}
+    }
+
+    for (Connection &client : clients) {
+    	close(client.Socket);
+    }
+    close(listener);
+    unlink(socket_path);
+
+    printf("served %lu requests in %lu batches (%lu merged)\n", Requests, Batches, Merged);
+    return EXIT_SUCCESS;
+}
+
+// Request execution
+
+void execute(FileSystem &fs, Pending &p) {
+    const Protocol::Request &r = p.Request;
+    std::string path = p.Payload;
+
+    switch (r.Op) {
+    	case Protocol::OP_REMOVE:
+    	    p.Result = fs.remove(r.Inumber);
+    	    break;
+    	case Protocol::OP_CLONE:
+    	    p.Result = fs.clone(r.Inumber);
+    	    break;
+    	case Protocol::OP_COPY_RANGE:
+    	    p.Result = fs.copy_range(r.Inumber, r.Offset, r.Target, r.TargetOffset, r.Count);
+    	    break;
+    	case Protocol::OP_STATFS: {
+    	    FileSystem::StatFS stats;
+    	    p.Result = fs.statfs(stats);
+    	    if (p.Result) {
+    	    	p.Reply.assign((const char *)&stats, sizeof(stats));
+	    }
+    	    break;
+	}
+    	case Protocol::OP_OPEN:
+    	    p.Result = fs.open(path.c_str());
+    	    break;
+    	case Protocol::OP_CREATE_PATH:
+    	    p.Result = fs.create(path.c_str());
+    	    break;
+    	case Protocol::OP_MKDIR:
+    	    p.Result = fs.mkdir(path.c_str());
+    	    break;
+    	case Protocol::OP_UNLINK:
+    	    p.Result = fs.unlink(path.c_str());
+    	    break;
+    	case Protocol::OP_LIST: {
+    	    std::vector<FileSystem::DirectoryEntry> entries;
+    	    p.Result = fs.list(path.c_str(), entries);
+    	    for (auto &entry : entries) {
+    	    	Protocol::ListRecord record = {};
+    	    	record.Inumber = entry.Inumber;
+    	    	record.Directory = entry.Directory;
+    	    	record.NameLength = entry.Name.size();
+    	    	p.Reply.append((const char *)&record, sizeof(record));
+    	    	p.Reply.append(entry.Name);
+	    }
+    	    break;
+	}
+    	default:
+    	    p.Result = -1;
+    	    break;
+    }
+}
+
+size_t find_run(const std::vector<Pending> &batch, size_t i) {
+    const Protocol::Request &first = batch[i].Request;
+    size_t j = i + 1;
+
+    switch (first.Op) {
+    	case Protocol::OP_CREATE:
+    	case Protocol::OP_STAT:
+    	    // 连续的创建、stat各合并为一次批量操作
+    	    while (j < batch.size() && batch[j].Request.Op == first.Op) {
+    	    	j++;
+	    }
+    	    break;
+    	case Protocol::OP_READ: {
+    	    // 同一inode上首尾相接的读取
+    	    uint64_t total = std::min<uint64_t>(first.Count, Protocol::MAX_PAYLOAD);
+    	    while (j < batch.size() && batch[j].Request.Op == first.Op && batch[j].Request.Inumber == first.Inumber &&
+    	    	   batch[j].Request.Offset == first.Offset + total &&
+    	    	   total + batch[j].Request.Count <= Protocol::MAX_PAYLOAD) {
+    	    	total += batch[j++].Request.Count;
+	    }
+    	    break;
+	}
+    	case Protocol::OP_WRITE: {
+    	    // 同一inode上首尾相接的写入
+    	    uint64_t total = batch[i].Payload.size();
+    	    while (j < batch.size() && batch[j].Request.Op == first.Op && batch[j].Request.Inumber == first.Inumber &&
+    	    	   batch[j].Request.Offset == first.Offset + total &&
+    	    	   total + batch[j].Payload.size() <= Protocol::MAX_PAYLOAD) {
+    	    	total += batch[j++].Payload.size();
+	    }
+    	    break;
+	}
+    	default:
+    	    break;
+    }
+    return j;
+}
+
+void execute_run(FileSystem &fs, std::vector<Pending> &batch, size_t i, size_t j) {
+    switch (batch[i].Request.Op) {
+    	case Protocol::OP_CREATE: {
+    	    // 每个inode块只读写一次
+    	    std::vector<size_t> inumbers;
+    	    fs.create_many(j - i, inumbers);
+    	    for (size_t k = i; k < j; k++) {
+    	    	batch[k].Result = k - i < inumbers.size() ? (int64_t) inumbers[k - i] : -1;
+	    }
+    	    break;
+	}
+    	case Protocol::OP_STAT: {
+    	    std::vector<size_t> inumbers;
+    	    for (size_t k = i; k < j; k++) {
+    	    	inumbers.push_back(batch[k].Request.Inumber);
+	    }
+    	    std::vector<ssize_t> sizes;
+    	    fs.stat_many(inumbers, sizes);
+    	    for (size_t k = i; k < j; k++) {
+    	    	batch[k].Result = sizes[k - i];
+	    }
+    	    break;
+	}
+    	case Protocol::OP_READ: {
+    	    // 合并为一次读取，再按请求拆分
+    	    const Protocol::Request &first = batch[i].Request;
+    	    uint64_t total = 0;
+    	    for (size_t k = i; k < j; k++) {
+    	    	total += std::min<uint64_t>(batch[k].Request.Count, Protocol::MAX_PAYLOAD);
+	    }
+    	    std::string data(total, '\0');
+    	    ssize_t result = fs.read(first.Inumber, &data[0], total, first.Offset);
+    	    uint64_t position = 0;
+    	    for (size_t k = i; k < j; k++) {
+    	    	uint64_t count = std::min<uint64_t>(batch[k].Request.Count, Protocol::MAX_PAYLOAD);
+    	    	uint64_t got = result > (ssize_t) position ? std::min<uint64_t>(count, result - position) : 0;
+    	    	batch[k].Result = result < 0 ? -1 : (int64_t) got;
+    	    	batch[k].Reply = data.substr(position, got);
+    	    	position += count;
+	    }
+    	    break;
+	}
+    	case Protocol::OP_WRITE: {
+    	    // 合并为一次写入
+    	    const Protocol::Request &first = batch[i].Request;
+    	    std::string data;
+    	    for (size_t k = i; k < j; k++) {
+    	    	data += batch[k].Payload;
+	    }
+    	    ssize_t result = fs.write(first.Inumber, &data[0], data.size(), first.Offset);
+    	    uint64_t position = 0;
+    	    for (size_t k = i; k < j; k++) {
+    	    	uint64_t count = batch[k].Payload.size();
+    	    	uint64_t put = result > (ssize_t) position ? std::min<uint64_t>(count, result - position) : 0;
+    	    	batch[k].Result = result < 0 ? -1 : (int64_t) put;
+    	    	position += count;
+	    }
+    	    break;
+	}
+    	default:
+    	    execute(fs, batch[i]);
+    	    break;
+    }
+}
+
+void execute_batch(FileSystem &fs, std::vector<Pending> &batch) {
+    // 按顺序执行，只合并相邻的同类请求，因此每个客户端看到的顺序不变
+    for (size_t i = 0; i < batch.size();) {
+    	// 先确定整段的范围：出错时整段一起失败，不会把已部分完成的请求再执行一遍
+    	size_t j = find_run(batch, i);
+    	try {
+    	    execute_run(fs, batch, i, j);
+	} catch (std::exception &e) {
+    	    fprintf(stderr, "request failed: %s\n", e.what());
+    	    for (size_t k = i; k < j; k++) {
+    	    	batch[k].Result = -1;
+    	    	batch[k].Reply.clear();
+	    }
+	}
+    	Merged += j - i - 1;
+    	i = j;
+    }
+
+    Requests += batch.size();
+    Batches++;
+}
+
+// Connection handling
+
+int listen_on(const char *path) {
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+    	fprintf(stderr, "socket path %s is too long!\n", path);
+    	return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    // 上次异常退出可能留下了旧的套接字文件
+    unlink(path);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0) {
+    	fprintf(stderr, "Unable to listen on %s: %s\n", path, strerror(errno));
+    	if (listener >= 0) {
+    	    close(listener);
+	}
+    	return -1;
+    }
+    return listener;
+}
+
+void accept_clients(int listener, std::list<Connection> &clients) {
+    while (true) {
+    	int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK);
+    	if (fd < 0) {
+    	    return;
+	}
+    	clients.push_back({fd, std::string(), std::string(), false});
+    }
+}
+
+void receive(Connection &client) {
+    char buffer[64 * 1024];
+    while (true) {
+    	ssize_t received = recv(client.Socket, buffer, sizeof(buffer), 0);
+    	if (received > 0) {
+    	    client.In.append(buffer, received);
+    	    continue;
+	}
+    	if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+    	    client.Closed = true;
+	}
+    	if (received == 0 || errno != EINTR) {
+    	    return;
+	}
+    }
+}
+
+void parse(Connection &client, std::vector<Pending> &requests) {
+    size_t position = 0;
+    while (client.In.size() - position >= sizeof(Protocol::Request)) {
+    	Protocol::Request request;
+    	memcpy(&request, client.In.data() + position, sizeof(request));
+    	// 负载过大视为协议错误，断开连接
+    	if (request.Length > Protocol::MAX_PAYLOAD) {
+    	    client.Closed = true;
+    	    break;
+	}
+    	if (client.In.size() - position - sizeof(request) < request.Length) {
+    	    break;
+	}
+    	position += sizeof(request);
+    	requests.push_back({&client, request, client.In.substr(position, request.Length), -1, std::string()});
+    	position += request.Length;
+    }
+    client.In.erase(0, position);
+}
+
+void flush(Connection &client) {
+    size_t position = 0;
+    while (position < client.Out.size()) {
+    	ssize_t sent = send(client.Socket, client.Out.data() + position, client.Out.size() - position, MSG_NOSIGNAL);
+    	if (sent < 0) {
+    	    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    	    	client.Closed = true;
+	    }
+    	    if (errno != EINTR) {
+    	    	break;
+	    }
+    	    continue;
+	}
+    	position += sent;
+    }
+    client.Out.erase(0, position);
+}
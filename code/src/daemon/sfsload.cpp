@@ -0,0 +1,148 @@
+// sfsload.cpp: Load generator for sfsd
+
+#include "sfs/client.h"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Each request moves this many bytes of file data
+static const size_t CHUNK_SIZE = 1024;
+
+static std::atomic<size_t> Requests(0);
+static std::atomic<size_t> Errors(0);
+
+// Fill chunk with a pattern unique to client and chunk
+static void fill(std::string &chunk, int client, size_t index) {
+    chunk.resize(CHUNK_SIZE);
+    for (size_t i = 0; i < CHUNK_SIZE; i++) {
+    	chunk[i] = (char) (client * 131 + index * 7 + i);
+    }
+}
+
+// Keep at most depth requests in flight; check each response as it arrives
+// @param	payloads    Data sent with requests that have a Length
+// @param	expected    What check compares each response against
+static void pipeline(Client &client, std::vector<Protocol::Request> &requests, const std::vector<std::string> &payloads,
+    	    	     const std::vector<std::string> &expected, int depth,
+    	    	     bool (*check)(const Protocol::Response &, const std::string &, const std::string &)) {
+    std::deque<size_t> inflight;
+    Protocol::Response response;
+    std::string reply;
+
+    for (size_t i = 0; i < requests.size() || !inflight.empty();) {
+    	if (i < requests.size() && inflight.size() < (size_t) depth) {
+    	    client.submit(requests[i], requests[i].Length ? payloads[i].data() : nullptr);
+    	    inflight.push_back(i++);
+    	    continue;
+	}
+    	client.complete(response, reply);
+    	size_t k = inflight.front();
+    	inflight.pop_front();
+    	if (response.Tag != requests[k].Tag || !check(response, expected[k], reply)) {
+    	    Errors++;
+	}
+    	Requests++;
+    }
+}
+
+static bool check_write(const Protocol::Response &response, const std::string &expected, const std::string &reply) {
+    return response.Result == (int64_t) expected.size();
+}
+
+static bool check_read(const Protocol::Response &response, const std::string &expected, const std::string &reply) {
+    return response.Result == (int64_t) expected.size() && reply == expected;
+}
+
+static bool check_stat(const Protocol::Response &response, const std::string &expected, const std::string &reply) {
+    return response.Result == atoll(expected.c_str());
+}
+
+// Create a file, write it, read it back, stat it and remove it
+static void run(const char *path, int id, size_t chunks, int depth) {
+    try {
+    	Client client;
+    	client.connect(path);
+
+    	ssize_t inumber = client.create();
+    	Requests++;
+    	if (inumber < 0) {
+    	    Errors++;
+    	    return;
+	}
+
+    	std::vector<Protocol::Request> requests(chunks);
+    	std::vector<std::string> payloads(chunks);
+
+    	// 连续写入：守护进程可以把同一批中的写请求合并
+    	for (size_t i = 0; i < chunks; i++) {
+    	    requests[i].Op = Protocol::OP_WRITE;
+    	    requests[i].Inumber = inumber;
+    	    requests[i].Offset = i * CHUNK_SIZE;
+    	    requests[i].Length = CHUNK_SIZE;
+    	    fill(payloads[i], id, i);
+	}
+    	pipeline(client, requests, payloads, payloads, depth, check_write);
+
+    	// 读回刚写入的数据并校验
+    	for (size_t i = 0; i < chunks; i++) {
+    	    requests[i].Op = Protocol::OP_READ;
+    	    requests[i].Length = 0;
+    	    requests[i].Count = CHUNK_SIZE;
+	}
+    	pipeline(client, requests, payloads, payloads, depth, check_read);
+
+    	// stat请求：守护进程用一次stat_many处理同一批中的所有stat
+    	std::vector<std::string> sizes(chunks, std::to_string(chunks * CHUNK_SIZE));
+    	for (size_t i = 0; i < chunks; i++) {
+    	    requests[i].Op = Protocol::OP_STAT;
+	}
+    	pipeline(client, requests, payloads, sizes, depth, check_stat);
+
+    	if (!client.remove(inumber)) {
+    	    Errors++;
+	}
+    	Requests++;
+    } catch (std::exception &e) {
+    	fprintf(stderr, "client %d: %s\n", id, e.what());
+    	Errors++;
+    }
+}
+
+// Main execution
+
+int main(int argc, char *argv[]) {
+    if (argc != 4 && argc != 5) {
+    	fprintf(stderr, "Usage: %s <socket> <clients> <chunks> [depth]\n", argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    int	   clients = atoi(argv[2]);
+    size_t chunks  = atoi(argv[3]);
+    int	   depth   = argc == 5 ? atoi(argv[4]) : 16;
+    if (clients <= 0 || depth <= 0) {
+    	fprintf(stderr, "clients and depth must be positive!\n");
+    	return EXIT_FAILURE;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int id = 0; id < clients; id++) {
+    	threads.emplace_back(run, argv[1], id, chunks, depth);
+    }
+    for (std::thread &thread : threads) {
+    	thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%d clients, %lu requests, %lu errors\n", clients, Requests.load(), Errors.load());
+    fprintf(stderr, "%.0f requests/s\n", seconds > 0 ? Requests.load() / seconds : 0.0);
+    return Errors.load() ? EXIT_FAILURE : EXIT_SUCCESS;
+}
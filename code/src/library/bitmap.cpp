@@ -0,0 +1,128 @@
+// bitmap.cpp: two-level block bitmap
+
+#include "sfs/bitmap.h"
+
+static const uint64_t FULL = ~(uint64_t)0;
+
+void Bitmap::resize(size_t nbits) {
+    Bits = nbits;
+    Used = 0;
+    Words.assign((nbits + WORD_BITS - 1) / WORD_BITS, 0);
+    Summary.assign((Words.size() + WORD_BITS - 1) / WORD_BITS, 0);
+
+    // 最后一个字中超出范围的位视为已使用，但不计入Used
+    if (nbits % WORD_BITS) {
+    	Words.back() = FULL << (nbits % WORD_BITS);
+    	update(Words.size() - 1);
+    }
+}
+
+void Bitmap::update(size_t word) {
+    uint64_t mask = (uint64_t)1 << (word % WORD_BITS);
+    if (Words[word] == FULL) {
+    	Summary[word / WORD_BITS] |= mask;
+    } else {
+    	Summary[word / WORD_BITS] &= ~mask;
+    }
+}
+
+void Bitmap::set(size_t bit) {
+    uint64_t &word = Words[bit / WORD_BITS];
+    uint64_t mask = (uint64_t)1 << (bit % WORD_BITS);
+    if (!(word & mask)) {
+    	word |= mask;
+    	Used++;
+    	update(bit / WORD_BITS);
+    }
+}
+
+void Bitmap::reset(size_t bit) {
+    uint64_t &word = Words[bit / WORD_BITS];
+    uint64_t mask = (uint64_t)1 << (bit % WORD_BITS);
+    if (word & mask) {
+    	word &= ~mask;
+    	Used--;
+    	update(bit / WORD_BITS);
+    }
+}
+
+size_t Bitmap::count(size_t begin, size_t end) const {
+    size_t total = 0;
+    while (begin < end && begin % WORD_BITS) {
+    	total += test(begin++);
+    }
+    for (; begin + WORD_BITS <= end; begin += WORD_BITS) {
+    	total += __builtin_popcountll(Words[begin / WORD_BITS]);
+    }
+    while (begin < end) {
+    	total += test(begin++);
+    }
+    return total;
+}
+
+size_t Bitmap::next_open_word(size_t word) const {
+    // 利用摘要层跳过已满的字
+    for (size_t s = word / WORD_BITS; s < Summary.size(); s++) {
+    	uint64_t open = ~Summary[s];
+    	if (s == word / WORD_BITS) {
+    	    open &= FULL << (word % WORD_BITS);
+	}
+    	if (open) {
+    	    size_t found = s * WORD_BITS + __builtin_ctzll(open);
+    	    return found < Words.size() ? found : Words.size();
+	}
+    }
+    return Words.size();
+}
+
+size_t Bitmap::find_clear(size_t start) const {
+    if (start >= Bits) {
+    	return Bits;
+    }
+
+    // 起始字中只看start之后的位
+    size_t word = start / WORD_BITS;
+    uint64_t open = ~Words[word] & (FULL << (start % WORD_BITS));
+    if (!open) {
+    	word = next_open_word(word + 1);
+    	if (word == Words.size()) {
+    	    return Bits;
+	}
+    	open = ~Words[word];
+    }
+
+    size_t found = word * WORD_BITS + __builtin_ctzll(open);
+    return found < Bits ? found : Bits;
+}
+
+size_t Bitmap::find_set(size_t start) const {
+    if (start >= Bits) {
+    	return Bits;
+    }
+
+    size_t word = start / WORD_BITS;
+    uint64_t used = Words[word] & (FULL << (start % WORD_BITS));
+    while (!used && ++word < Words.size()) {
+    	used = Words[word];
+    }
+    if (!used) {
+    	return Bits;
+    }
+
+    size_t found = word * WORD_BITS + __builtin_ctzll(used);
+    return found < Bits ? found : Bits;
+}
+
+size_t Bitmap::find_clear_run(size_t start, size_t length) const {
+    while (true) {
+    	start = find_clear(start);
+    	if (start == Bits) {
+    	    return Bits;
+	}
+    	size_t end = find_set(start);
+    	if (end - start >= length) {
+    	    return start;
+	}
+    	start = end;
+    }
+}
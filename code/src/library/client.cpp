@@ -0,0 +1,261 @@
+// client.cpp: sfsd client library
+
+#include "sfs/client.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+const uint32_t Protocol::MAX_PAYLOAD;
+
+static void send_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+    	ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+    	if (sent < 0 && errno == EINTR) {
+    	    continue;
+	}
+    	if (sent <= 0) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to send request: %s", strerror(errno));
+    	    throw std::runtime_error(what);
+	}
+    	data   += sent;
+    	length -= sent;
+    }
+}
+
+static void recv_all(int fd, char *data, size_t length) {
+    while (length > 0) {
+    	ssize_t received = recv(fd, data, length, 0);
+    	if (received < 0 && errno == EINTR) {
+    	    continue;
+	}
+    	if (received <= 0) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to receive response: %s", received ? strerror(errno) : "connection closed");
+    	    throw std::runtime_error(what);
+	}
+    	data   += received;
+    	length -= received;
+    }
+}
+
+Client::~Client() {
+    if (Socket >= 0) {
+    	close(Socket);
+    }
+}
+
+void Client::connect(const char *path) {
+    char what[BUFSIZ];
+
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+    	snprintf(what, BUFSIZ, "socket path %s is too long!", path);
+    	throw std::invalid_argument(what);
+    }
+    strcpy(address.sun_path, path);
+
+    Socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Socket < 0 || ::connect(Socket, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    	snprintf(what, BUFSIZ, "Unable to connect to %s: %s", path, strerror(errno));
+    	if (Socket >= 0) {
+    	    close(Socket);
+    	    Socket = -1;
+	}
+    	throw std::runtime_error(what);
+    }
+}
+
+uint32_t Client::submit(Protocol::Request &request, const char *payload) {
+    request.Tag = NextTag++;
+    send_all(Socket, (const char *)&request, sizeof(request));
+    if (request.Length) {
+    	send_all(Socket, payload, request.Length);
+    }
+    Outstanding++;
+    return request.Tag;
+}
+
+void Client::complete(Protocol::Response &response, std::string &payload) {
+    if (!Outstanding) {
+    	throw std::logic_error("no outstanding request to complete");
+    }
+    recv_all(Socket, (char *)&response, sizeof(response));
+    payload.resize(response.Length);
+    if (response.Length) {
+    	recv_all(Socket, &payload[0], response.Length);
+    }
+    Outstanding--;
+}
+
+int64_t Client::call(Protocol::Request &request, const char *payload, std::string *reply) {
+    // 同步调用不能与未完成的流水线请求混用，否则响应会错位
+    if (Outstanding) {
+    	throw std::logic_error("synchronous call with outstanding pipelined requests");
+    }
+    submit(request, payload);
+
+    Protocol::Response response;
+    std::string data;
+    complete(response, data);
+    if (reply) {
+    	reply->swap(data);
+    }
+    return response.Result;
+}
+
+ssize_t Client::create() {
+    Protocol::Request request = {};
+    request.Op = Protocol::OP_CREATE;
+    return call(request, nullptr);
+}
+
+bool Client::remove(size_t inumber) {
+    Protocol::Request request = {};
+    request.Op = Protocol::OP_REMOVE;
+    request.Inumber = inumber;
+    return call(request, nullptr) > 0;
+}
+
+ssize_t Client::stat(size_t inumber) {
+    Protocol::Request request = {};
+    request.Op = Protocol::OP_STAT;
+    request.Inumber = inumber;
+    return call(request, nullptr);
+}
+
+ssize_t Client::read(size_t inumber, char *data, size_t length, size_t offset) {
+    // 超过单个响应上限的读取拆成多个请求
+    ssize_t total = 0;
+    while (length > 0) {
+    	Protocol::Request request = {};
+    	request.Op = Protocol::OP_READ;
+    	request.Inumber = inumber;
+    	request.Offset = offset + total;
+    	request.Count = std::min<size_t>(length, Protocol::MAX_PAYLOAD);
+
+    	std::string reply;
+    	int64_t result = call(request, nullptr, &reply);
+    	if (result <= 0) {
+    	    return total ? total : result;
+	}
+    	memcpy(data + total, reply.data(), result);
+    	total  += result;
+    	length -= result;
+    	if ((uint64_t) result < request.Count) {
+    	    break;
+	}
+    }
+    return total;
+}
+
+ssize_t Client::write(size_t inumber, char *data, size_t length, size_t offset) {
+    ssize_t total = 0;
+    while (length > 0) {
+    	Protocol::Request request = {};
+    	request.Op = Protocol::OP_WRITE;
+    	request.Inumber = inumber;
+    	request.Offset = offset + total;
+    	request.Length = std::min<size_t>(length, Protocol::MAX_PAYLOAD);
+
+    	int64_t result = call(request, data + total);
+    	if (result <= 0) {
+    	    return total ? total : result;
+	}
+    	total  += result;
+    	length -= result;
+    	if (result < request.Length) {
+    	    break;
+	}
+    }
+    return total;
+}
+
+ssize_t Client::clone(size_t inumber) {
+    Protocol::Request request = {};
+    request.Op = Protocol::OP_CLONE;
+    request.Inumber = inumber;
+    return call(request, nullptr);
+}
+
+ssize_t Client::copy_range(size_t src, size_t src_offset, size_t dst, size_t dst_offset, size_t length) {
+    Protocol::Request request = {};
+    request.Op = Protocol::OP_COPY_RANGE;
+    request.Inumber = src;
+    request.Offset = src_offset;
+    request.Target = dst;
+    request.TargetOffset = dst_offset;
+    request.Count = length;
+    return call(request, nullptr);
+}
+
+bool Client::statfs(StatFS &stats) {
+    Protocol::Request request = {};
+    request.Op = Protocol::OP_STATFS;
+
+    std::string reply;
+    if (call(request, nullptr, &reply) <= 0 || reply.size() != sizeof(stats)) {
+    	return false;
+    }
+    memcpy(&stats, reply.data(), sizeof(stats));
+    return true;
+}
+
+// 路径请求：路径作为负载发送
+static Protocol::Request path_request(uint16_t op, const char *path) {
+    Protocol::Request request = {};
+    request.Op = op;
+    request.Length = strlen(path);
+    return request;
+}
+
+ssize_t Client::open(const char *path) {
+    Protocol::Request request = path_request(Protocol::OP_OPEN, path);
+    return call(request, path);
+}
+
+ssize_t Client::create(const char *path) {
+    Protocol::Request request = path_request(Protocol::OP_CREATE_PATH, path);
+    return call(request, path);
+}
+
+ssize_t Client::mkdir(const char *path) {
+    Protocol::Request request = path_request(Protocol::OP_MKDIR, path);
+    return call(request, path);
+}
+
+bool Client::unlink(const char *path) {
+    Protocol::Request request = path_request(Protocol::OP_UNLINK, path);
+    return call(request, path) > 0;
+}
+
+bool Client::list(const char *path, std::vector<DirectoryEntry> &entries) {
+    Protocol::Request request = path_request(Protocol::OP_LIST, path);
+
+    std::string reply;
+    entries.clear();
+    if (call(request, path, &reply) <= 0) {
+    	return false;
+    }
+
+    // 依次解析每个目录项记录
+    size_t position = 0;
+    while (position + sizeof(Protocol::ListRecord) <= reply.size()) {
+    	Protocol::ListRecord record;
+    	memcpy(&record, reply.data() + position, sizeof(record));
+    	position += sizeof(record);
+    	if (position + record.NameLength > reply.size()) {
+    	    return false;
+	}
+    	entries.push_back({reply.substr(position, record.NameLength), (size_t) record.Inumber, record.Directory != 0});
+    	position += record.NameLength;
+    }
+    return true;
+}
@@ -1,52 +1,183 @@
 // disk.cpp: disk emulator
 
 #include "sfs/disk.h"
+#include "sfs/profile.h"
 
+#include <exception>
 #include <stdexcept>
 
+#include <algorithm>
+
 #include <errno.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-void Disk::open(const char *path, size_t nblocks) {
-    FileDescriptor = ::open(path, O_RDWR|O_CREAT, 0600);
+void Disk::open(const char *path, size_t nblocks, bool direct) {
+    FileDescriptor = ::open(path, O_RDWR|O_CREAT|(direct ? O_DIRECT : 0), 0600);
     if (FileDescriptor < 0) {
     	char what[BUFSIZ];
     	snprintf(what, BUFSIZ, "Unable to open %s: %s", path, strerror(errno));
     	throw std::runtime_error(what);
     }
 
-    if (ftruncate(FileDescriptor, nblocks*BLOCK_SIZE) < 0) {
+    // 只扩展不截断：在线扩容过的镜像以较小的块数打开时不丢失后面的数据
+    struct stat st;
+    if (fstat(FileDescriptor, &st) < 0 || (st.st_size < (off_t)(nblocks*BLOCK_SIZE) && ftruncate(FileDescriptor, nblocks*BLOCK_SIZE) < 0)) {
     	char what[BUFSIZ];
     	snprintf(what, BUFSIZ, "Unable to open %s: %s", path, strerror(errno));
     	throw std::runtime_error(what);
     }
 
     Blocks = nblocks;
-    Reads  = 0;
-    Writes = 0;
+    Reads    = 0;
+    Writes   = 0;
+    Discards = 0;
+    Head     = 0;
+    Elapsed  = 0;
+    Direct   = direct;
+
+    load_changed(path);
 }
 
 Disk::~Disk() {
+    // 析构函数不能抛出异常，保存失败时下次打开会把所有块视为已修改
+    try {
+    	flush();
+    } catch (std::exception &e) {
+    	fprintf(stderr, "%s\n", e.what());
+    }
+    if (Tracking) {
+    	try {
+    	    save_changed(true);
+	} catch (std::exception &e) {
+    	    fprintf(stderr, "%s\n", e.what());
+	}
+    }
+
     if (FileDescriptor > 0) {
-    	printf("%lu disk block reads\n", Reads);
-    	printf("%lu disk block writes\n", Writes);
+    	report();
     	close(FileDescriptor);
     	FileDescriptor = 0;
     }
+    free(Bounce);
+    if (Mapping && Mapping != MAP_FAILED) {
+    	munmap(Mapping, MappedBlocks*BLOCK_SIZE);
+    }
+    for (auto &mapping : Retired) {
+    	munmap(mapping.first, mapping.second*BLOCK_SIZE);
+    }
 }
 
-void Disk::sanity_check(int blocknum, char *data) {
-    char what[BUFSIZ];
+bool Disk::grow(size_t nblocks) {
+    if (nblocks <= Blocks) {
+    	return true;
+    }
 
-    if (blocknum < 0) {
-    	snprintf(what, BUFSIZ, "blocknum (%d) is negative!", blocknum);
-    	throw std::invalid_argument(what);
+    // 先截掉旧大小之后可能残留的内容，再扩展到新大小，新加的块都读出为零
+    if (ftruncate(FileDescriptor, Blocks*BLOCK_SIZE) < 0 || ftruncate(FileDescriptor, nblocks*BLOCK_SIZE) < 0) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to grow disk to %lu blocks: %s", nblocks, strerror(errno));
+    	throw std::runtime_error(what);
+    }
+    resize(nblocks);
+    return true;
+}
+
+void Disk::resize(size_t nblocks) {
+    Blocks = nblocks;
+    Changed.resize((Blocks + 63) / 64, 0);
+
+    // 已交出的映射指针在关闭前一直有效，旧映射保留到析构，下次map时映射整个新镜像
+    if (Mapping && Mapping != MAP_FAILED) {
+    	Retired.push_back({Mapping, MappedBlocks});
+    }
+    Mapping = NULL;
+    MappedBlocks = 0;
+
+    // 位图大小变了，崩溃后不能再相信旧的边车文件
+    if (Tracking) {
+    	save_changed(false);
+    }
+}
+
+char *Disk::aligned(char *data, size_t nblocks) {
+    if (!Direct || (uintptr_t)data % BLOCK_SIZE == 0) {
+    	return data;
+    }
+
+    // 按需扩大对齐的缓冲区，之后重复使用
+    if (BounceBlocks < nblocks) {
+    	free(Bounce);
+    	Bounce = NULL;
+    	BounceBlocks = 0;
+    	if (posix_memalign((void **)&Bounce, BLOCK_SIZE, nblocks*BLOCK_SIZE) != 0) {
+    	    Bounce = NULL;
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to allocate %lu aligned blocks", nblocks);
+    	    throw std::runtime_error(what);
+	}
+    	BounceBlocks = nblocks;
+    }
+    return Bounce;
+}
+
+void Disk::report() const {
+    printf("%lu disk block reads\n", Reads);
+    printf("%lu disk block writes\n", Writes);
+    if (Discards) {
+    	printf("%lu disk block discards\n", Discards);
+    }
+    if (Timed) {
+    	printf("%.3f ms simulated disk time\n", Elapsed / 1000);
+    }
+}
+
+bool Disk::timing_profile(const char *name, Timing &timing) {
+    // 机械硬盘：寻道加半圈旋转延迟，顺序访问只有传输时间
+    if (strcmp(name, "hdd") == 0) {
+    	timing = {6000, 0.05, 14000, 50, 150};
+    	return true;
+    }
+    // 固态硬盘：没有寻道，每个请求有固定延迟
+    if (strcmp(name, "ssd") == 0) {
+    	timing = {0, 0, 0, 80, 500};
+    	return true;
+    }
+
+    Timing custom{};
+    char tail;
+    if (sscanf(name, "%lf,%lf,%lf,%lf,%lf%c", &custom.SeekBase, &custom.SeekPerBlock,
+    	       &custom.SeekMax, &custom.Latency, &custom.Bandwidth, &tail) != 5 || custom.Bandwidth <= 0) {
+    	return false;
+    }
+    timing = custom;
+    return true;
+}
+
+void Disk::charge(size_t blocknum, size_t nblocks) {
+    if (!Timed) {
+    	return;
     }
 
-    if (blocknum >= (int)Blocks) {
-    	snprintf(what, BUFSIZ, "blocknum (%d) is too big!", blocknum);
+    // 接着上一个请求的顺序访问不需要寻道
+    if (blocknum != Head) {
+    	size_t distance = blocknum > Head ? blocknum - Head : Head - blocknum;
+    	Elapsed += std::min(Model.SeekBase + Model.SeekPerBlock * distance, Model.SeekMax);
+    }
+    // 带宽以MB/s计，即每微秒传输的字节数
+    Elapsed += Model.Latency + nblocks * BLOCK_SIZE / Model.Bandwidth;
+    Head = blocknum + nblocks;
+}
+
+void Disk::sanity_check(size_t blocknum, char *data) {
+    char what[BUFSIZ];
+
+    if (blocknum >= Blocks) {
+    	snprintf(what, BUFSIZ, "blocknum (%lu) is too big!", blocknum);
     	throw std::invalid_argument(what);
     }
 
@@ -56,38 +187,622 @@ void Disk::sanity_check(int blocknum, char *data) {
     }
 }
 
-void Disk::read(int blocknum, char *data) {
+void Disk::sanity_check(size_t blocknum, size_t nblocks, char *data) {
     sanity_check(blocknum, data);
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
+    if (nblocks > Blocks - blocknum) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "block range (%lu, %lu) is too big!", blocknum, nblocks);
+    	throw std::invalid_argument(what);
+    }
+}
+
+void Disk::read(size_t blocknum, char *data) {
+    PROFILE_SCOPE("Disk::read");
+    sanity_check(blocknum, data);
+    // 同步读之前先完成已提交的读，保持请求的先后顺序，避免来回寻道
+    finish_reads();
+
+    if (lseek(FileDescriptor, (off_t)blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to lseek %lu: %s", blocknum, strerror(errno));
     	throw std::runtime_error(what);
     }
 
-    if (::read(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
+    char *buffer = aligned(data, 1);
+    if (::read(FileDescriptor, buffer, BLOCK_SIZE) != BLOCK_SIZE) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to read %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "Unable to read %lu: %s", blocknum, strerror(errno));
     	throw std::runtime_error(what);
     }
+    if (buffer != data) {
+    	memcpy(data, buffer, BLOCK_SIZE);
+    }
+    overlay(blocknum, 1, data);
 
+    charge(blocknum, 1);
     Reads++;
 }
 
-void Disk::write(int blocknum, char *data) {
+void Disk::write(size_t blocknum, char *data) {
+    PROFILE_SCOPE("Disk::write");
     sanity_check(blocknum, data);
+    if (queue_write(blocknum, 1, data)) {
+    	return;
+    }
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
+    if (lseek(FileDescriptor, (off_t)blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "Unable to lseek %lu: %s", blocknum, strerror(errno));
     	throw std::runtime_error(what);
     }
 
-    if (::write(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
+    char *buffer = aligned(data, 1);
+    if (buffer != data) {
+    	memcpy(buffer, data, BLOCK_SIZE);
+    }
+    if (::write(FileDescriptor, buffer, BLOCK_SIZE) != BLOCK_SIZE) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to write %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "Unable to write %lu: %s", blocknum, strerror(errno));
     	throw std::runtime_error(what);
     }
 
+    charge(blocknum, 1);
+    mark(blocknum, 1);
     Writes++;
 }
+
+void Disk::read_blocks(size_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, nblocks, data);
+    finish_reads();
+
+    char *buffer = aligned(data, nblocks);
+    if (pread(FileDescriptor, buffer, nblocks*BLOCK_SIZE, (off_t)blocknum*BLOCK_SIZE) != (ssize_t)(nblocks*BLOCK_SIZE)) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to read %lu: %s", blocknum, strerror(errno));
+    	throw std::runtime_error(what);
+    }
+    if (buffer != data) {
+    	memcpy(data, buffer, nblocks*BLOCK_SIZE);
+    }
+    overlay(blocknum, nblocks, data);
+
+    charge(blocknum, nblocks);
+    Reads += nblocks;
+}
+
+void Disk::write_blocks(size_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, nblocks, data);
+    if (queue_write(blocknum, nblocks, data)) {
+    	return;
+    }
+
+    char *buffer = aligned(data, nblocks);
+    if (buffer != data) {
+    	memcpy(buffer, data, nblocks*BLOCK_SIZE);
+    }
+    if (pwrite(FileDescriptor, buffer, nblocks*BLOCK_SIZE, (off_t)blocknum*BLOCK_SIZE) != (ssize_t)(nblocks*BLOCK_SIZE)) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to write %lu: %s", blocknum, strerror(errno));
+    	throw std::runtime_error(what);
+    }
+
+    charge(blocknum, nblocks);
+    mark(blocknum, nblocks);
+    Writes += nblocks;
+}
+
+bool Disk::punch(size_t blocknum, size_t nblocks) {
+    if (fallocate(FileDescriptor, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, (off_t)blocknum*BLOCK_SIZE, nblocks*BLOCK_SIZE) < 0) {
+    	if (errno == EOPNOTSUPP || errno == ENOSYS) {
+    	    return false;
+	}
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to discard %lu: %s", blocknum, strerror(errno));
+    	throw std::runtime_error(what);
+    }
+    return true;
+}
+
+bool Disk::discard(size_t blocknum, size_t nblocks) {
+    if (blocknum > Blocks || nblocks > Blocks - blocknum) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "discard range (%lu, %lu) is out of bounds!", blocknum, nblocks);
+    	throw std::invalid_argument(what);
+    }
+
+    // 排队的写入不能晚于打洞
+    flush();
+
+    // 中途失败时部分块可能已经改动，所以先标记
+    mark(blocknum, nblocks);
+    if (!punch(blocknum, nblocks)) {
+    	return false;
+    }
+
+    Discards += nblocks;
+    return true;
+}
+
+void Disk::zero_blocks(size_t blocknum, size_t nblocks) {
+    if (blocknum > Blocks || nblocks > Blocks - blocknum) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "zero range (%lu, %lu) is out of bounds!", blocknum, nblocks);
+    	throw std::invalid_argument(what);
+    }
+
+    // 排队的写入不能晚于打洞
+    flush();
+
+    // 打洞后读出的就是零，稀疏镜像也不会因此占满空间
+    mark(blocknum, nblocks);
+    if (punch(blocknum, nblocks)) {
+    	charge(blocknum, nblocks);
+    	Writes += nblocks;
+    	return;
+    }
+
+    const size_t CHUNK = 256;
+    std::vector<char> zeros(std::min(nblocks, CHUNK) * BLOCK_SIZE, 0);
+    for (size_t done = 0; done < nblocks;) {
+    	size_t count = std::min(nblocks - done, CHUNK);
+    	write_blocks(blocknum + done, count, zeros.data());
+    	done += count;
+    }
+}
+
+bool Disk::copy_file(int in, off_t in_offset, int out, off_t out_offset, size_t length) {
+    // 由内核在文件之间复制，数据不经过用户空间
+    loff_t in_pos = in_offset, out_pos = out_offset;
+    while (length > 0) {
+    	ssize_t done = copy_file_range(in, &in_pos, out, &out_pos, length, 0);
+    	// 跨文件系统、O_DIRECT等不支持的组合由调用者改用缓冲区，真正的I/O错误会在那里报告
+    	if (done <= 0) {
+    	    return false;
+	}
+    	length -= done;
+    }
+    return true;
+}
+
+const char *Disk::map(size_t blocknum, size_t nblocks) {
+    if (blocknum > Blocks || nblocks > Blocks - blocknum) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "map range (%lu, %lu) is out of bounds!", blocknum, nblocks);
+    	throw std::invalid_argument(what);
+    }
+
+    flush();
+
+    // O_DIRECT要绕过页缓存，不使用映射
+    if (Direct || Mapping == MAP_FAILED || !Blocks) {
+    	return NULL;
+    }
+    // 第一次使用时映射整个镜像，失败后不再尝试
+    if (!Mapping) {
+    	Mapping = (char *) mmap(NULL, Blocks*BLOCK_SIZE, PROT_READ, MAP_SHARED, FileDescriptor, 0);
+    	if (Mapping == MAP_FAILED) {
+    	    return NULL;
+	}
+    	MappedBlocks = Blocks;
+    }
+
+    charge(blocknum, nblocks);
+    Reads += nblocks;
+    return Mapping + blocknum*BLOCK_SIZE;
+}
+
+bool Disk::copy_in(size_t blocknum, size_t nblocks, int fd, off_t offset) {
+    if (blocknum > Blocks || nblocks > Blocks - blocknum) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "copy range (%lu, %lu) is out of bounds!", blocknum, nblocks);
+    	throw std::invalid_argument(what);
+    }
+
+    // 排队的写入不能覆盖之后直接复制进来的内容
+    flush();
+
+    // 中途失败时部分块可能已经改动，所以先标记
+    mark(blocknum, nblocks);
+    if (!copy_file(fd, offset, FileDescriptor, (off_t)blocknum*BLOCK_SIZE, nblocks*BLOCK_SIZE)) {
+    	return false;
+    }
+
+    charge(blocknum, nblocks);
+    Writes += nblocks;
+    return true;
+}
+
+bool Disk::copy_out(size_t blocknum, size_t nblocks, int fd, off_t offset) {
+    if (blocknum > Blocks || nblocks > Blocks - blocknum) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "copy range (%lu, %lu) is out of bounds!", blocknum, nblocks);
+    	throw std::invalid_argument(what);
+    }
+
+    flush();
+    if (!copy_file(FileDescriptor, (off_t)blocknum*BLOCK_SIZE, fd, offset, nblocks*BLOCK_SIZE)) {
+    	return false;
+    }
+
+    charge(blocknum, nblocks);
+    Reads += nblocks;
+    return true;
+}
+
+// Request queue
+
+bool Disk::queue_write(size_t blocknum, size_t nblocks, char *data) {
+    if (!Batching || Flushing) {
+    	return false;
+    }
+
+    // 排在前面的读请求要读到写入之前的内容
+    settle_reads(blocknum, nblocks);
+
+    // 大请求本身已经足够高效，不与排队的写入重叠时直接执行
+    auto next = Queued.lower_bound(blocknum);
+    if (nblocks >= BYPASS_BLOCKS && (next == Queued.end() || next->first >= blocknum + nblocks)) {
+    	return false;
+    }
+
+    // 同一块只保留最后一次写入
+    for (size_t i = 0; i < nblocks; i++) {
+    	Queued[blocknum + i].assign(data + i*BLOCK_SIZE, data + (i + 1)*BLOCK_SIZE);
+    }
+    if (Queued.size() >= QUEUE_BLOCKS) {
+    	flush();
+    }
+    return true;
+}
+
+void Disk::overlay(size_t blocknum, size_t nblocks, char *data) const {
+    for (auto it = Queued.lower_bound(blocknum); it != Queued.end() && it->first < blocknum + nblocks; it++) {
+    	memcpy(data + (it->first - blocknum)*BLOCK_SIZE, it->second.data(), BLOCK_SIZE);
+    }
+}
+
+void Disk::settle_reads(size_t blocknum, size_t nblocks) {
+    std::vector<Request> overlapping;
+    for (size_t i = 0; i < Submitted.size();) {
+    	const Request &request = Submitted[i];
+    	if (request.Start < blocknum + nblocks && blocknum < request.Start + request.Count) {
+    	    overlapping.push_back(request);
+    	    Submitted.erase(Submitted.begin() + i);
+	} else {
+    	    i++;
+	}
+    }
+    for (const Request &request : overlapping) {
+    	read_blocks(request.Start, request.Count, request.Data);
+    }
+}
+
+void Disk::submit_read(size_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, nblocks, data);
+
+    // 与排队的写入重叠时立即读，读到的是排队的内容
+    auto next = Queued.lower_bound(blocknum);
+    if (!Batching || Flushing || (next != Queued.end() && next->first < blocknum + nblocks)) {
+    	read_blocks(blocknum, nblocks, data);
+    	return;
+    }
+    Submitted.push_back({blocknum, nblocks, data});
+}
+
+void Disk::end_batch() {
+    if (Batching > 0 && --Batching == 0) {
+    	flush();
+    }
+}
+
+void Disk::flush() {
+    perform(true);
+}
+
+void Disk::finish_reads() {
+    perform(false);
+}
+
+void Disk::perform(bool writes) {
+    if (Flushing || ((!writes || Queued.empty()) && Submitted.empty())) {
+    	return;
+    }
+
+    // 一次传输：连续的写入合并为一段，相邻或重叠的读请求合并为一段
+    struct Transfer {
+    	size_t	Start;
+    	size_t	Count;
+    	bool	Writing;
+    	size_t	First;	    // First submitted read covered (reads only)
+    	size_t	Last;	    // One past the last submitted read covered
+    };
+    std::vector<Transfer> transfers;
+    std::vector<std::vector<char>> buffers;
+
+    for (auto it = Queued.begin(); writes && it != Queued.end();) {
+    	size_t start = it->first;
+    	std::vector<char> buffer;
+    	for (; it != Queued.end() && it->first == start + buffer.size()/BLOCK_SIZE; it++) {
+    	    buffer.insert(buffer.end(), it->second.begin(), it->second.end());
+	}
+    	transfers.push_back({start, buffer.size()/BLOCK_SIZE, true, buffers.size(), 0});
+    	buffers.push_back(std::move(buffer));
+    }
+
+    std::sort(Submitted.begin(), Submitted.end(), [](const Request &a, const Request &b) {
+    	return a.Start < b.Start;
+    });
+    for (size_t i = 0; i < Submitted.size();) {
+    	size_t start = Submitted[i].Start;
+    	size_t end   = start + Submitted[i].Count;
+    	size_t first = i;
+    	for (i++; i < Submitted.size() && Submitted[i].Start <= end; i++) {
+    	    end = std::max(end, Submitted[i].Start + Submitted[i].Count);
+	}
+    	transfers.push_back({start, end - start, false, first, i});
+    }
+
+    // 电梯调度：按块号单向扫描，从磁头位置开始扫到最高处再回到最低处；
+    // 磁头之后的请求很少时，直接从最低处开始扫一遍寻道更短
+    std::sort(transfers.begin(), transfers.end(), [](const Transfer &a, const Transfer &b) {
+    	return a.Start < b.Start;
+    });
+    auto ahead = std::find_if(transfers.begin(), transfers.end(), [this](const Transfer &t) {
+    	return t.Start >= Head;
+    });
+    auto distance = [this](const std::vector<Transfer> &order) {
+    	size_t position = Head, total = 0;
+    	for (const Transfer &transfer : order) {
+    	    total   += transfer.Start > position ? transfer.Start - position : position - transfer.Start;
+    	    position = transfer.Start + transfer.Count;
+	}
+    	return total;
+    };
+    std::vector<Transfer> rotated(transfers);
+    std::rotate(rotated.begin(), rotated.begin() + (ahead - transfers.begin()), rotated.end());
+    if (distance(rotated) < distance(transfers)) {
+    	transfers.swap(rotated);
+    }
+
+    // 某次传输出错时其余传输照常完成，写失败的块留在队列中，下次flush时重试
+    Flushing = true;
+    std::exception_ptr error;
+    std::vector<char> span;
+    std::map<size_t, std::vector<char>> failed;
+    for (const Transfer &transfer : transfers) {
+    	try {
+    	    if (transfer.Writing) {
+    	    	write_blocks(transfer.Start, transfer.Count, buffers[transfer.First].data());
+	    } else if (transfer.Last - transfer.First == 1) {
+    	    	read_blocks(transfer.Start, transfer.Count, Submitted[transfer.First].Data);
+	    } else {
+    	    	span.resize(transfer.Count*BLOCK_SIZE);
+    	    	read_blocks(transfer.Start, transfer.Count, span.data());
+    	    	for (size_t k = transfer.First; k < transfer.Last; k++) {
+    	    	    const Request &request = Submitted[k];
+    	    	    memcpy(request.Data, span.data() + (request.Start - transfer.Start)*BLOCK_SIZE, request.Count*BLOCK_SIZE);
+		}
+	    }
+	} catch (...) {
+    	    if (!error) {
+    	    	error = std::current_exception();
+	    }
+    	    for (size_t i = 0; transfer.Writing && i < transfer.Count; i++) {
+    	    	failed[transfer.Start + i] = std::move(Queued[transfer.Start + i]);
+	    }
+	}
+    }
+    Flushing = false;
+    if (writes) {
+    	Queued.swap(failed);
+    }
+    Submitted.clear();
+    if (error) {
+    	std::rethrow_exception(error);
+    }
+}
+
+// Changed block tracking
+
+const uint32_t Disk::CHANGED_MAGIC;
+const uint32_t Disk::DELTA_MAGIC;
+
+static void write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+    	ssize_t done = ::write(fd, data, length);
+    	if (done < 0 && errno == EINTR) {
+    	    continue;
+	}
+    	if (done <= 0) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to write delta: %s", strerror(errno));
+    	    throw std::runtime_error(what);
+	}
+    	data   += done;
+    	length -= done;
+    }
+}
+
+// Returns false if the file ends first
+static bool read_all(int fd, char *data, size_t length) {
+    while (length > 0) {
+    	ssize_t done = ::read(fd, data, length);
+    	if (done < 0 && errno == EINTR) {
+    	    continue;
+	}
+    	if (done < 0) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to read delta: %s", strerror(errno));
+    	    throw std::runtime_error(what);
+	}
+    	if (done == 0) {
+    	    return false;
+	}
+    	data   += done;
+    	length -= done;
+    }
+    return true;
+}
+
+void Disk::mark(size_t blocknum, size_t nblocks) {
+    if (!Tracking) {
+    	return;
+    }
+    for (size_t block = blocknum; block < blocknum + nblocks; block++) {
+    	Changed[block / 64] |= 1UL << (block % 64);
+    }
+}
+
+void Disk::load_changed(const char *path) {
+    ChangedPath = std::string(path) + ".changed";
+    Tracking = false;
+    Changed.assign((Blocks + 63) / 64, 0);
+
+    int fd = ::open(ChangedPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+    	return;
+    }
+
+    // 没有正常关闭或大小不符时无法知道改过哪些块，只能全部视为已修改
+    ChangedHeader header;
+    size_t bytes = Changed.size() * sizeof(uint64_t);
+    bool valid = read_all(fd, (char *)&header, sizeof(header)) && header.Magic == CHANGED_MAGIC &&
+    		 header.Clean && header.Blocks == Blocks && read_all(fd, (char *)Changed.data(), bytes);
+    close(fd);
+    if (!valid) {
+    	fprintf(stderr, "%s was not saved cleanly, treating all blocks as changed\n", ChangedPath.c_str());
+    	Changed.assign(Changed.size(), ~0UL);
+    	if (Blocks % 64) {
+    	    Changed.back() = (1UL << (Blocks % 64)) - 1;
+	}
+    }
+
+    // 先标记为未保存，进程崩溃后下次打开就不会相信旧的位图
+    Tracking = true;
+    save_changed(false);
+}
+
+void Disk::save_changed(bool clean) {
+    int fd = ::open(ChangedPath.c_str(), O_WRONLY|O_CREAT, 0600);
+    if (fd < 0) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to open %s: %s", ChangedPath.c_str(), strerror(errno));
+    	throw std::runtime_error(what);
+    }
+
+    ChangedHeader header = {CHANGED_MAGIC, clean, Blocks};
+    size_t bytes = Changed.size() * sizeof(uint64_t);
+    bool saved = pwrite(fd, &header, sizeof(header), 0) == sizeof(header) &&
+    		 (!clean || pwrite(fd, Changed.data(), bytes, sizeof(header)) == (ssize_t)bytes) &&
+    		 ftruncate(fd, sizeof(header) + bytes) == 0 && fsync(fd) == 0;
+    int error = errno;
+    close(fd);
+    if (!saved) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to save %s: %s", ChangedPath.c_str(), strerror(error));
+    	throw std::runtime_error(what);
+    }
+}
+
+size_t Disk::changed() const {
+    size_t count = 0;
+    for (uint64_t word : Changed) {
+    	count += __builtin_popcountll(word);
+    }
+    return count;
+}
+
+ssize_t Disk::checkpoint() {
+    ssize_t count = Tracking ? (ssize_t)changed() : -1;
+    Changed.assign(Changed.size(), 0);
+    Tracking = true;
+    save_changed(false);
+    return count;
+}
+
+ssize_t Disk::export_changes(int fd, size_t &extents) {
+    extents = 0;
+    if (!Tracking) {
+    	return -1;
+    }
+
+    DeltaHeader header = {DELTA_MAGIC, BLOCK_SIZE, Blocks};
+    write_all(fd, (const char *)&header, sizeof(header));
+
+    // 逐段读取连续的已修改块，再按是否全零切成更小的段
+    const size_t CHUNK = 256;
+    std::vector<char> buffer(CHUNK * BLOCK_SIZE);
+    size_t exported = 0;
+    for (size_t start = 0; start < Blocks;) {
+    	if (!(Changed[start / 64] & (1UL << (start % 64)))) {
+    	    start++;
+    	    continue;
+	}
+    	size_t count = 0;
+    	while (start + count < Blocks && count < CHUNK && (Changed[(start + count) / 64] & (1UL << ((start + count) % 64)))) {
+    	    count++;
+	}
+    	read_blocks(start, count, buffer.data());
+
+    	for (size_t i = 0; i < count;) {
+    	    bool zero = true;
+    	    size_t j = i;
+    	    for (; j < count; j++) {
+    	    	const char *block = buffer.data() + j*BLOCK_SIZE;
+    	    	bool empty = block[0] == 0 && memcmp(block, block + 1, BLOCK_SIZE - 1) == 0;
+    	    	if (j == i) {
+    	    	    zero = empty;
+		} else if (empty != zero) {
+    	    	    break;
+		}
+	    }
+    	    DeltaExtent extent = {start + i, (uint32_t)(j - i), zero};
+    	    write_all(fd, (const char *)&extent, sizeof(extent));
+    	    if (!zero) {
+    	    	write_all(fd, buffer.data() + i*BLOCK_SIZE, (j - i)*BLOCK_SIZE);
+	    }
+    	    extents++;
+    	    i = j;
+	}
+
+    	exported += count;
+    	start += count;
+    }
+
+    DeltaExtent end = {0, 0, 0};
+    write_all(fd, (const char *)&end, sizeof(end));
+    return exported;
+}
+
+ssize_t Disk::apply_changes(int fd) {
+    DeltaHeader header;
+    if (!read_all(fd, (char *)&header, sizeof(header)) || header.Magic != DELTA_MAGIC ||
+    	header.BlockSize != BLOCK_SIZE || header.Blocks != Blocks) {
+    	return -1;
+    }
+
+    std::vector<char> buffer;
+    size_t applied = 0;
+    while (true) {
+    	DeltaExtent extent;
+    	if (!read_all(fd, (char *)&extent, sizeof(extent))) {
+    	    return -1;
+	}
+    	if (extent.Count == 0) {
+    	    return applied;
+	}
+    	if (extent.Start + extent.Count > Blocks) {
+    	    return -1;
+	}
+
+    	buffer.resize(extent.Count * BLOCK_SIZE);
+    	if (extent.Zero) {
+    	    std::fill(buffer.begin(), buffer.end(), 0);
+	} else if (!read_all(fd, buffer.data(), buffer.size())) {
+    	    return -1;
+	}
+    	write_blocks(extent.Start, extent.Count, buffer.data());
+    	applied += extent.Count;
+    }
+}
@@ -1,20 +1,161 @@
 // fs.cpp: File System
 
 #include "sfs/fs.h"
+#include "sfs/profile.h"
 
 #include <algorithm>
 
 #include <cmath>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <new>
 
-// Debug file system -----------------------------------------------------------
+#include <unistd.h>
 
-void FileSystem::debug(Disk *disk) {
-    Block block{};
+// Block I/O -------------------------------------------------------------------
 
-    // Read superblock
+// 每个文件系统块对应SECTORS个连续的磁盘块，4 KiB块时直接读写
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::read_block(Disk *disk, size_t blocknum, char *data) {
+    if (SECTORS == 1) {
+        disk->read(blocknum, data);
+    } else {
+        disk->read_blocks(blocknum * SECTORS, SECTORS, data);
+    }
+}
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::write_block(Disk *disk, size_t blocknum, char *data) {
+    if (SECTORS == 1) {
+        disk->write(blocknum, data);
+    } else {
+        disk->write_blocks(blocknum * SECTORS, SECTORS, data);
+    }
+}
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::read_blocks(Disk *disk, size_t blocknum, size_t nblocks, char *data) {
+    disk->read_blocks(blocknum * SECTORS, nblocks * SECTORS, data);
+}
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::write_blocks(Disk *disk, size_t blocknum, size_t nblocks, char *data) {
+    disk->write_blocks(blocknum * SECTORS, nblocks * SECTORS, data);
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::discard_blocks(Disk *disk, size_t blocknum, size_t nblocks) {
+    return disk->discard(blocknum * SECTORS, nblocks * SECTORS);
+}
+
+// Superblock ------------------------------------------------------------------
+
+void Volume::read_super(Disk *disk, SuperBlock &super) {
+    // 超级块总位于第一个磁盘块的开头，与块大小无关
+    union alignas(Disk::BLOCK_SIZE) {
+        SuperBlock Super;
+        char Data[Disk::BLOCK_SIZE];
+    } block;
     disk->read(0, block.Data);
+    super = block.Super;
+}
+
+// Block groups ----------------------------------------------------------------
+
+size_t Volume::inode_block(const SuperBlock &super, size_t index) {
+    // 扩容加入的inode块排在格式化时的inode块之后，位于各扩展区的开头
+    if ((super.Features & FEATURE_GROWN) && index >= super.BaseInodeBlocks) {
+        index -= super.BaseInodeBlocks;
+        uint32_t k = 0;
+        while (k + 1 < super.ExtensionCount && index >= super.Extensions[k].InodeBlocks) {
+            index -= super.Extensions[k++].InodeBlocks;
+        }
+        return super.Extensions[k].Start + index;
+    }
+
+    // 旧布局的inode表紧跟超级块；分组布局中每组开头是本组的一段inode表
+    if (!(super.Features & FEATURE_GROUPS)) {
+        return index + 1;
+    }
+    return 1 + (index / super.GroupInodeBlocks) * (size_t) super.GroupBlocks + index % super.GroupInodeBlocks;
+}
+
+uint32_t Volume::group_count(size_t blocks, uint32_t group_blocks, uint32_t group_inode_blocks) {
+    if (blocks <= 1 || !group_blocks) {
+        return 0;
+    }
+    size_t groups = (blocks - 1 + group_blocks - 1) / group_blocks;
+    if (groups > 1 && blocks - 1 - (groups - 1) * group_blocks <= group_inode_blocks) {
+        groups--;
+    }
+    return groups;
+}
+
+template <size_t BLOCK_BYTES>
+size_t BlockVolume<BLOCK_BYTES>::group_of(size_t blocknum) const {
+    // 超级块属于第0组，末尾的零头属于格式化时的最后一组，扩展区各成一组
+    if (!blocknum) {
+        return 0;
+    }
+    if (blocknum >= base_blocks) {
+        size_t g = num_groups - 1;
+        while (groups[g].Start > blocknum) {
+            g--;
+        }
+        return g;
+    }
+    return std::min((blocknum - 1) / group_blocks, base_groups - 1);
+}
+
+template <size_t BLOCK_BYTES>
+size_t BlockVolume<BLOCK_BYTES>::group_of_inode(size_t inumber) const {
+    size_t index = inumber / INODES_PER_BLOCK;
+    if (index >= base_inode_blocks && num_groups > base_groups) {
+        // 扩展区的inode块位于本组开头
+        index -= base_inode_blocks;
+        size_t g = base_groups;
+        while (g + 1 < num_groups && index >= groups[g].Data - groups[g].Start) {
+            index -= groups[g].Data - groups[g].Start;
+            g++;
+        }
+        return g;
+    }
+    return std::min(index / group_inode_blocks, base_groups - 1);
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::block_used(size_t blocknum) const {
+    const Group &group = groups[group_of(blocknum)];
+    return group.Free[blocknum - group.Start];
+}
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::mark_used(size_t blocknum) {
+    Group &group = groups[group_of(blocknum)];
+    group.Free.set(blocknum - group.Start);
+}
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::mark_free(size_t blocknum) {
+    Group &group = groups[group_of(blocknum)];
+    group.Free.reset(blocknum - group.Start);
+}
+
+// Debug file system -----------------------------------------------------------
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::debug(Disk *disk) {
+    // Read superblock
+    SuperBlock super;
+    read_super(disk, super);
+    debug(disk, super);
+}
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::debug(Disk *disk, const SuperBlock &super) {
+    Block block{};
+    block.Super = super;
 
     printf("SuperBlock:\n");
 
@@ -28,16 +169,32 @@ void FileSystem::debug(Disk *disk) {
     }
 
     printf("    %u blocks\n", block.Super.Blocks);
+    if (BLOCK_SIZE != Disk::BLOCK_SIZE) {
+        printf("    %lu bytes per block\n", BLOCK_SIZE);
+    }
     printf("    %u inode blocks\n", block.Super.InodeBlocks);
     printf("    %u inodes\n", block.Super.Inodes);
+    bool grown = block.Super.Features & FEATURE_GROWN;
+    if (block.Super.Features & FEATURE_GROUPS) {
+        uint32_t base_inode_blocks = grown ? block.Super.BaseInodeBlocks : block.Super.InodeBlocks;
+        printf("    %u block groups of %u blocks (%u inode blocks each)\n",
+               base_inode_blocks / block.Super.GroupInodeBlocks, block.Super.GroupBlocks, block.Super.GroupInodeBlocks);
+    }
+    for (uint32_t k = 0; grown && k < block.Super.ExtensionCount && k < MAX_EXTENSIONS; k++) {
+        printf("    extension at block %u (%u inode blocks)\n", block.Super.Extensions[k].Start, block.Super.Extensions[k].InodeBlocks);
+    }
+    if (block.Super.Features & FEATURE_DIRECTORIES) {
+        printf("    root directory: inode %u\n", block.Super.RootInode);
+    }
 
     // inode编号
     uint32_t n = -1;
 
     // Read Inode blocks
+    SuperBlock layout = block.Super;
     uint32_t num_inode_blocks = block.Super.InodeBlocks;
-    for (uint32_t i = 1; i <= num_inode_blocks; i++) {
-        disk->read(i, block.Data); // array of inodes
+    for (uint32_t i = 0; i < num_inode_blocks; i++) {
+        read_block(disk, inode_block(layout, i), block.Data); // array of inodes
         // 遍历block中的所有可能inode
         for (auto &Inode : block.Inodes) {
             n++;
@@ -46,6 +203,24 @@ void FileSystem::debug(Disk *disk) {
             }
             printf("Inode %u:\n", n);
             printf("    size: %u bytes\n", Inode.Size);
+            if (Inode.Valid & INODE_DIRECTORY) {
+                printf("    type: directory\n");
+            }
+            if (Inode.Valid & INODE_UNWRITTEN) {
+                printf("    unwritten from block index: %u\n", Inode.Valid >> UNWRITTEN_SHIFT);
+            }
+
+            // 小文件没有数据块
+            if (Inode.Valid & INODE_INLINE) {
+                printf("    inline data\n");
+                continue;
+            }
+            if (Inode.Valid & INODE_FRAGMENT) {
+                uint32_t first = Inode.Valid >> FRAGMENT_SHIFT;
+                uint32_t count = (Inode.Size + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+                printf("    fragment block: %u (fragments %u-%u)\n", Inode.Direct[0], first, first + count - 1);
+                continue;
+            }
 
             // 处理直接索引块
             printf("    direct blocks:");
@@ -63,7 +238,7 @@ void FileSystem::debug(Disk *disk) {
             printf("    indirect block: %u\n    indirect data blocks:", Inode.Indirect);
             // 读入间接索引块内容
             Block IndirectBlock{};
-            disk->read(Inode.Indirect, IndirectBlock.Data);
+            read_block(disk, Inode.Indirect, IndirectBlock.Data);
             // 遍历所有可能的间接索引块
             for (uint32_t Pointer : IndirectBlock.Pointers) {
                 if (Pointer) {
@@ -78,7 +253,8 @@ void FileSystem::debug(Disk *disk) {
 
 // Format file system ----------------------------------------------------------
 
-bool FileSystem::format(Disk *disk) {
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::format(Disk *disk, uint32_t inode_percent) {
     // 若已挂载则不处理
     if (disk->mounted()) {
         return false;
@@ -88,37 +264,100 @@ bool FileSystem::format(Disk *disk) {
     Block block{};
     memset(&block, 0, sizeof(Block));
 
-    block.Super.MagicNumber = FileSystem::MAGIC_NUMBER;
-    block.Super.Blocks = (uint32_t) (disk->size());
-    // 分配给inode的block数，十分之一向上取整
-    block.Super.InodeBlocks = (uint32_t) std::ceil((block.Super.Blocks * 1.00) / 10);
-    block.Super.Inodes = block.Super.InodeBlocks * (FileSystem::INODES_PER_BLOCK);
-    disk->write(0, block.Data);
+    block.Super.MagicNumber = MAGIC_NUMBER;
+    // 块指针是32位的，更大的磁盘只使用前2^32-1块
+    block.Super.Blocks = (uint32_t) std::min<size_t>(disk->size() / SECTORS, UINT32_MAX);
+    // 分配给inode的block数，按比例向上取整（默认十分之一）
+    block.Super.InodeBlocks = (uint32_t) std::ceil((block.Super.Blocks * 1.00) * inode_percent / 100);
+    // 超过一个块组时分组：每组开头放本组的inode块，数据紧随其后
+    uint32_t group_inode_blocks = (uint32_t) std::ceil((GROUP_BLOCKS * 1.00) * inode_percent / 100);
+    uint32_t groups = group_count(block.Super.Blocks, GROUP_BLOCKS, group_inode_blocks);
+    if (groups > 1) {
+        block.Super.Features |= FEATURE_GROUPS;
+        block.Super.GroupBlocks = GROUP_BLOCKS;
+        block.Super.GroupInodeBlocks = group_inode_blocks;
+        block.Super.InodeBlocks = groups * group_inode_blocks;
+    }
+    block.Super.Inodes = block.Super.InodeBlocks * INODES_PER_BLOCK;
+    block.Super.BlockSize = BLOCK_SIZE;
+    block.Super.InodePercent = inode_percent;
+    write_block(disk, 0, block.Data);
 
     // Clear all other blocks
-    for (uint32_t i = 1; i < block.Super.Blocks; i++) {
-        Block Empty_block{};
-        memset(&Empty_block, 0, sizeof(Empty_block));
-        disk->write(i, Empty_block.Data);
+    // 能打洞时直接打洞，大镜像仍保持稀疏
+    if (block.Super.Blocks > 1) {
+        disk->zero_blocks(SECTORS, (size_t) (block.Super.Blocks - 1) * SECTORS);
     }
     return true;
 }
 
 // Mount file system -----------------------------------------------------------
 
-bool FileSystem::mount(Disk *disk) {
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::mount(Disk *disk) {
     // 若已挂载则不处理
     if (disk->mounted()) {
         return false;
     }
 
     // Read superblock
+    SuperBlock super;
+    read_super(disk, super);
+    return mount(disk, super);
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::mount(Disk *disk, const SuperBlock &super) {
+    if (disk->mounted()) {
+        return false;
+    }
+
     Block block{};
-    disk->read(0, block.Data);
+    block.Super = super;
     if (block.Super.MagicNumber != MAGIC_NUMBER) {
         return false;
     }
-    if (block.Super.InodeBlocks != std::ceil((block.Super.Blocks * 1.00) / 10)) {
+    // 旧镜像中没有记录块大小和inode比例
+    uint32_t block_size = block.Super.BlockSize ? block.Super.BlockSize : Disk::BLOCK_SIZE;
+    uint32_t inode_percent = block.Super.InodePercent ? block.Super.InodePercent : DEFAULT_INODE_PERCENT;
+    if (block_size != BLOCK_SIZE || (size_t) block.Super.Blocks * SECTORS > disk->size()) {
+        return false;
+    }
+
+    // 扩容过的卷：格式化时的布局照旧检查，扩展区依次相接直到末尾
+    uint32_t format_blocks = block.Super.Blocks;
+    uint32_t format_inode_blocks = block.Super.InodeBlocks;
+    if (block.Super.Features & FEATURE_GROWN) {
+        format_blocks = block.Super.BaseBlocks;
+        format_inode_blocks = block.Super.BaseInodeBlocks;
+        if (!block.Super.ExtensionCount || block.Super.ExtensionCount > MAX_EXTENSIONS) {
+            return false;
+        }
+        size_t start = format_blocks;
+        size_t inode_blocks = format_inode_blocks;
+        for (uint32_t k = 0; k < block.Super.ExtensionCount; k++) {
+            const Extension &extension = block.Super.Extensions[k];
+            size_t end = k + 1 < block.Super.ExtensionCount ? block.Super.Extensions[k + 1].Start : block.Super.Blocks;
+            if (extension.Start != start || end <= start + extension.InodeBlocks) {
+                return false;
+            }
+            start = end;
+            inode_blocks += extension.InodeBlocks;
+        }
+        if (inode_blocks != block.Super.InodeBlocks) {
+            return false;
+        }
+    }
+    if (block.Super.Features & FEATURE_GROUPS) {
+        uint32_t group_inode_blocks = block.Super.GroupInodeBlocks;
+        if (!group_inode_blocks || group_inode_blocks != std::ceil((block.Super.GroupBlocks * 1.00) * inode_percent / 100)) {
+            return false;
+        }
+        uint32_t groups = group_count(format_blocks, block.Super.GroupBlocks, group_inode_blocks);
+        if (groups < 2 || format_inode_blocks != groups * group_inode_blocks) {
+            return false;
+        }
+    } else if (format_inode_blocks != std::ceil((format_blocks * 1.00) * inode_percent / 100)) {
         return false;
     }
     if (block.Super.Inodes != (block.Super.InodeBlocks * INODES_PER_BLOCK)) {
@@ -133,25 +372,76 @@ bool FileSystem::mount(Disk *disk) {
     // Copy metadata
     MetaData = block.Super;
 
-    // Allocate free block bitmap
-    free_block_bitmap.resize(MetaData.Blocks, false);
+    // 旧布局看作只有一组：inode表之后全部是数据
+    if (MetaData.Features & FEATURE_GROUPS) {
+        group_blocks = MetaData.GroupBlocks;
+        group_inode_blocks = MetaData.GroupInodeBlocks;
+        base_groups = format_inode_blocks / group_inode_blocks;
+    } else {
+        group_blocks = format_blocks;
+        group_inode_blocks = format_inode_blocks;
+        base_groups = 1;
+    }
+    base_blocks = format_blocks;
+    base_inode_blocks = format_inode_blocks;
+    uint32_t extensions = (MetaData.Features & FEATURE_GROWN) ? MetaData.ExtensionCount : 0;
+    num_groups = base_groups + extensions;
+    alloc_group = 0;
+
+    // Allocate free block bitmaps
+    groups.reset(new Group[num_groups]);
+    for (size_t g = 0; g < base_groups; g++) {
+        Group &group = groups[g];
+        group.Start = g ? 1 + g * group_blocks : 0;
+        group.Data  = 1 + g * group_blocks + group_inode_blocks;
+        group.End   = g + 1 < base_groups ? 1 + (g + 1) * group_blocks : base_blocks;
+        group.Free.resize(group.End - group.Start);
+    }
+    for (uint32_t k = 0; k < extensions; k++) {
+        Group &group = groups[base_groups + k];
+        group.Start = MetaData.Extensions[k].Start;
+        group.Data  = group.Start + MetaData.Extensions[k].InodeBlocks;
+        group.End   = k + 1 < extensions ? MetaData.Extensions[k + 1].Start : MetaData.Blocks;
+        group.Free.resize(group.End - group.Start);
+    }
     // 超级块已使用
-    free_block_bitmap[0] = true;
+    mark_used(0);
 
     inode_counter.resize(MetaData.InodeBlocks, 0);
+    dentry_cache.clear();
+    fragment_blocks.clear();
+    block_refs.clear();
+    defrag_cursor = 0;
+    inodes_used = 0;
 
     // 遍历所有inode，找寻其中已经使用的block
-    for (uint32_t i = 1; i <= MetaData.InodeBlocks; i++) {
-        disk->read(i, block.Data);
+    for (uint32_t i = 0; i < MetaData.InodeBlocks; i++) {
+        read_block(disk, inode_block(MetaData, i), block.Data);
 
         // 遍历所有可能的inode节点
         for (auto &Inode : block.Inodes) {
             if (!Inode.Valid) {
                 continue;
             }
-            inode_counter[i - 1]++;
+            inode_counter[i]++;
+            inodes_used++;
             // 本块已使用
-            free_block_bitmap[i] = true;
+            mark_used(inode_block(MetaData, i));
+
+            // 内联数据不含块指针
+            if (Inode.Valid & INODE_INLINE) {
+                continue;
+            }
+            // 碎片块记录已使用的碎片
+            if (Inode.Valid & INODE_FRAGMENT) {
+                if (Inode.Direct[0] >= MetaData.Blocks) {
+                    return false;
+                }
+                uint32_t count = (Inode.Size + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+                mark_used(Inode.Direct[0]);
+                fragment_blocks[Inode.Direct[0]] |= ((1u << count) - 1) << (Inode.Valid >> FRAGMENT_SHIFT);
+                continue;
+            }
 
             // 遍历所有可能的直接索引块，找已使用了的
             for (uint32_t k : Inode.Direct) {
@@ -162,8 +452,11 @@ bool FileSystem::mount(Disk *disk) {
                 if (k >= MetaData.Blocks) {
                     return false;
                 }
-                // 本直接索引块已使用
-                free_block_bitmap[k] = true;
+                // 本直接索引块已使用，再次出现说明被克隆共享
+                if (block_used(k)) {
+                    add_ref(k);
+                }
+                mark_used(k);
             }
 
             // 处理间接索引
@@ -174,43 +467,64 @@ bool FileSystem::mount(Disk *disk) {
             if (Inode.Indirect >= MetaData.Blocks) {
                 return false;
             }
+            // 共享的间接索引块，其指向的块已经统计过
+            if (block_used(Inode.Indirect)) {
+                add_ref(Inode.Indirect);
+                continue;
+            }
             // 间接索引块已使用
-            free_block_bitmap[Inode.Indirect] = true;
+            mark_used(Inode.Indirect);
             Block indirect{};
-            cur_disk->read(Inode.Indirect, indirect.Data);
+            read_block(cur_disk, Inode.Indirect, indirect.Data);
             for (uint32_t Pointer : indirect.Pointers) {
                 // 防溢出
                 if (Pointer >= MetaData.Blocks) {
                     return false;
                 }
+                if (!Pointer) {
+                    continue;
+                }
                 // 间接索引块指向的目标已使用
-                free_block_bitmap[Pointer] = true;
+                if (block_used(Pointer)) {
+                    add_ref(Pointer);
+                }
+                mark_used(Pointer);
             }
         }
     }
+
+    // 只保留还有空闲碎片的碎片块
+    for (auto it = fragment_blocks.begin(); it != fragment_blocks.end();) {
+        if (it->second == FRAGMENT_FULL) {
+            it = fragment_blocks.erase(it);
+        } else {
+            ++it;
+        }
+    }
     return true;
 }
 
 // Create inode ----------------------------------------------------------------
 
-ssize_t FileSystem::create() {
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::create() {
     // 不允许未挂载就操作
     if (!cur_disk || !cur_disk->mounted()) {
         return -1;
     }
 
     Block block{};
-    cur_disk->read(0, block.Data);
+    read_block(cur_disk, 0, block.Data);
 
     // Locate free inode in inode table
-    for (uint32_t i = 1; i <= MetaData.InodeBlocks; i++) {
+    for (uint32_t i = 0; i < MetaData.InodeBlocks; i++) {
         // 这个inode块中是否存在未分配inode
-        if (inode_counter[i - 1] == INODES_PER_BLOCK) {
+        if (inode_counter[i] == INODES_PER_BLOCK) {
             continue;
         }
 
         // 这个inode块中必有空闲inode存在
-        cur_disk->read(i, block.Data);
+        read_block(cur_disk, inode_block(MetaData, i), block.Data);
 
         // 遍历找到第一个
         for (uint32_t j = 0; j < INODES_PER_BLOCK; j++) {
@@ -223,34 +537,38 @@ ssize_t FileSystem::create() {
             for (uint32_t &k : block.Inodes[j].Direct) {
                 k = 0;
             }
-            free_block_bitmap[i] = true;
-            inode_counter[i - 1]++;
+            mark_used(inode_block(MetaData, i));
+            inode_counter[i]++;
+            inodes_used++;
 
             // 将更新后的数据写回磁盘
-            cur_disk->write(i, block.Data);
+            write_block(cur_disk, inode_block(MetaData, i), block.Data);
 
             // Record inode if found
-            return (((i - 1) * INODES_PER_BLOCK) + j);
+            return ((i * INODES_PER_BLOCK) + j);
         }
     }
     return -1;
 }
 
 // Load inode -----------------------------------------------------------------
-bool FileSystem::load_inode(size_t inumber, Inode *inode) {
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::load_inode(size_t inumber, Inode *inode) {
+    PROFILE_SCOPE("load_inode");
+
     // 不允许未挂载就操作
     if (!cur_disk || !cur_disk->mounted()) {
         return false;
     }
     Block block{};
 
-    // 在第i+1块inode块的第j个位置
-    int i = (int) (inumber / INODES_PER_BLOCK);
-    int j = (int) (inumber % INODES_PER_BLOCK);
+    // 在第i块inode块的第j个位置
+    size_t i = inumber / INODES_PER_BLOCK;
+    size_t j = inumber % INODES_PER_BLOCK;
 
     // 载入对应位置的inode
     if (inode_counter[i]) {
-        cur_disk->read(i + 1, block.Data);
+        read_block(cur_disk, inode_block(MetaData, i), block.Data);
         if (block.Inodes[j].Valid) {
             *inode = block.Inodes[j];
             return true;
@@ -260,7 +578,8 @@ bool FileSystem::load_inode(size_t inumber, Inode *inode) {
 }
 
 // Remove inode ----------------------------------------------------------------
-bool FileSystem::remove(size_t inumber) {
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::remove(size_t inumber) {
     // 不允许未挂载就操作
     if (!cur_disk || !cur_disk->mounted()) {
         return -1;
@@ -273,47 +592,60 @@ bool FileSystem::remove(size_t inumber) {
         return false;
     }
 
+    // 小文件只需归还碎片
+    if (packed(inode)) {
+        release_small(inode, inode.Size);
+    }
+
     inode.Valid = false;
     inode.Size = 0;
 
-    int i = (int) (inumber / INODES_PER_BLOCK);
-    int j = (int) (inumber % INODES_PER_BLOCK);
+    // 目录项缓存中可能仍指向该inode
+    dentry_cache.clear();
+
+    size_t i = inumber / INODES_PER_BLOCK;
+    size_t j = inumber % INODES_PER_BLOCK;
 
     // 如果这个inode是本块中最后一个inode，则将块状态修改为未使用
+    inodes_used--;
     if (--inode_counter[i] == 0) {
-        free_block_bitmap[i + 1] = false;
+        mark_free(inode_block(MetaData, i));
     }
 
     // Free direct blocks
     for (uint32_t &k : inode.Direct) {
-        free_block_bitmap[k] = false;
+        if (k) {
+            drop_ref(k);
+        }
         k = 0;
     }
 
-    // Free indirect blocks
+    // Free indirect blocks (共享的间接索引块只减少引用)
     if (inode.Indirect) {
-        cur_disk->read(inode.Indirect, block.Data);
-        free_block_bitmap[inode.Indirect] = false;
-        inode.Indirect = 0;
-
-        for (uint32_t Pointer : block.Pointers) {
-            if (Pointer) {
-                free_block_bitmap[Pointer] = false;
+        if (drop_ref(inode.Indirect)) {
+            read_block(cur_disk, inode.Indirect, block.Data);
+            for (uint32_t Pointer : block.Pointers) {
+                if (Pointer) {
+                    drop_ref(Pointer);
+                }
             }
         }
+        inode.Indirect = 0;
     }
 
     // Clear inode in inode table
-    cur_disk->read(i + 1, block.Data);
+    read_block(cur_disk, inode_block(MetaData, i), block.Data);
     block.Inodes[j] = inode;
-    cur_disk->write(i + 1, block.Data);
+    write_block(cur_disk, inode_block(MetaData, i), block.Data);
 
+    flush_discards();
     return true;
 }
 
 // Inode stat ------------------------------------------------------------------
 
-ssize_t FileSystem::stat(size_t inumber) {
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::stat(size_t inumber) {
     if (!cur_disk || !cur_disk->mounted()) {
         return -1;
     }
@@ -328,39 +660,231 @@ ssize_t FileSystem::stat(size_t inumber) {
     return -1;
 }
 
+// Batch metadata operations ---------------------------------------------------
+
+template <size_t BLOCK_BYTES>
+size_t BlockVolume<BLOCK_BYTES>::create_many(size_t count, std::vector<size_t> &inumbers) {
+    // 不允许未挂载就操作
+    if (!cur_disk || !cur_disk->mounted()) {
+        return 0;
+    }
+
+    // 每个inode块只读写一次，尽量填满后再换下一块
+    size_t created = 0;
+    Block block{};
+    for (uint32_t i = 0; i < MetaData.InodeBlocks && created < count; i++) {
+        if (inode_counter[i] == INODES_PER_BLOCK) {
+            continue;
+        }
+
+        read_block(cur_disk, inode_block(MetaData, i), block.Data);
+        for (uint32_t j = 0; j < INODES_PER_BLOCK && created < count; j++) {
+            if (block.Inodes[j].Valid) {
+                continue;
+            }
+            memset(&block.Inodes[j], 0, sizeof(Inode));
+            block.Inodes[j].Valid = true;
+            inode_counter[i]++;
+            inodes_used++;
+            inumbers.push_back((i * INODES_PER_BLOCK) + j);
+            created++;
+        }
+        mark_used(inode_block(MetaData, i));
+        write_block(cur_disk, inode_block(MetaData, i), block.Data);
+    }
+    return created;
+}
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::stat_many(const std::vector<size_t> &inumbers, std::vector<ssize_t> &sizes) {
+    sizes.assign(inumbers.size(), -1);
+    if (!cur_disk || !cur_disk->mounted()) {
+        return;
+    }
+
+    // 按inode块分组，同一块只读一次
+    std::vector<size_t> order(inumbers.size());
+    for (size_t k = 0; k < order.size(); k++) {
+        order[k] = k;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return inumbers[a] < inumbers[b];
+    });
+
+    Block block{};
+    int64_t loaded = -1;
+    for (size_t k : order) {
+        size_t i = inumbers[k] / INODES_PER_BLOCK;
+        if (i >= MetaData.InodeBlocks || !inode_counter[i]) {
+            continue;
+        }
+        if ((int64_t) i != loaded) {
+            read_block(cur_disk, inode_block(MetaData, i), block.Data);
+            loaded = i;
+        }
+        Inode &inode = block.Inodes[inumbers[k] % INODES_PER_BLOCK];
+        if (inode.Valid) {
+            sizes[k] = inode.Size;
+        }
+    }
+}
+
+template <size_t BLOCK_BYTES>
+size_t BlockVolume<BLOCK_BYTES>::remove_many(const std::vector<size_t> &inumbers) {
+    if (!cur_disk || !cur_disk->mounted()) {
+        return 0;
+    }
+
+    std::vector<size_t> sorted(inumbers);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+    // 按inode块分组清除inode，间接索引块留到最后统一处理
+    size_t removed = 0;
+    std::vector<uint32_t> indirects;
+    Block block{};
+    for (size_t k = 0; k < sorted.size();) {
+        size_t i = sorted[k] / INODES_PER_BLOCK;
+        size_t end = k;
+        while (end < sorted.size() && sorted[end] / INODES_PER_BLOCK == i) {
+            end++;
+        }
+        if (i >= MetaData.InodeBlocks || !inode_counter[i]) {
+            k = end;
+            continue;
+        }
+
+        read_block(cur_disk, inode_block(MetaData, i), block.Data);
+        bool dirty = false;
+        for (; k < end; k++) {
+            Inode &inode = block.Inodes[sorted[k] % INODES_PER_BLOCK];
+            if (!inode.Valid) {
+                continue;
+            }
+            if (packed(inode)) {
+                release_small(inode, inode.Size);
+            }
+            for (uint32_t direct : inode.Direct) {
+                if (direct) {
+                    drop_ref(direct);
+                }
+            }
+            if (inode.Indirect && drop_ref(inode.Indirect)) {
+                indirects.push_back(inode.Indirect);
+            }
+            memset(&inode, 0, sizeof(Inode));
+            inode_counter[i]--;
+            inodes_used--;
+            removed++;
+            dirty = true;
+        }
+        if (inode_counter[i] == 0) {
+            mark_free(inode_block(MetaData, i));
+        }
+        if (dirty) {
+            write_block(cur_disk, inode_block(MetaData, i), block.Data);
+        }
+    }
+
+    // 按块号顺序读取间接索引块
+    std::sort(indirects.begin(), indirects.end());
+    for (uint32_t indirect : indirects) {
+        read_block(cur_disk, indirect, block.Data);
+        for (uint32_t Pointer : block.Pointers) {
+            if (Pointer) {
+                drop_ref(Pointer);
+            }
+        }
+    }
+
+    if (removed) {
+        dentry_cache.clear();
+    }
+    flush_discards();
+    return removed;
+}
+
 // Read helper -----------------------------------------------------------------
 
-void FileSystem::read_in_block(uint32_t blocknum, int offset, int *length, char **ptr) {
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::read_in_block(uint32_t blocknum, size_t offset, size_t *length, char **ptr) {
     Block block{};
-    cur_disk->read(blocknum, block.Data);
-    // 读取到的字节数
-    uint32_t num_bytes = Disk::BLOCK_SIZE - offset;
+    read_block(cur_disk, blocknum, block.Data);
+    // 读取到的字节数，不超过剩余需要读取的长度
+    size_t num_bytes = std::min(BLOCK_SIZE - offset, *length);
     memcpy(*ptr, block.Data + offset, num_bytes);
     *ptr += num_bytes;
     *length -= num_bytes;
 }
 
+template <size_t BLOCK_BYTES>
+size_t BlockVolume<BLOCK_BYTES>::read_run(const uint32_t *pointers, size_t count, size_t *length, char **ptr) {
+    size_t i = 0;
+    while (i < count && pointers[i] && *length) {
+        // 物理上连续的整块一次读入用户缓冲区，条带盘可以并行读取
+        size_t run = 1;
+        while (i + run < count && pointers[i + run] == pointers[i] + run &&
+               (run + 1) * BLOCK_SIZE <= *length) {
+            run++;
+        }
+        if (run * BLOCK_SIZE <= *length) {
+            // 批处理中整块只提交请求，读完后统一合并执行
+            cur_disk->submit_read(pointers[i] * SECTORS, run * SECTORS, *ptr);
+            *ptr += run * BLOCK_SIZE;
+            *length -= run * BLOCK_SIZE;
+        } else {
+            read_in_block(pointers[i], 0, length, ptr);
+        }
+        i += run;
+    }
+    return i;
+}
+
 // Read from inode -------------------------------------------------------------
 
-ssize_t FileSystem::read(size_t inumber, char *data, int length, size_t offset) {
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::read(size_t inumber, char *data, size_t length, size_t offset) {
+    PROFILE_SCOPE("read");
+
     // 不允许未挂载就操作
     if (!cur_disk || !cur_disk->mounted()) {
         return -1;
     }
 
+    // 返回前完成提交的整块读，调用者拿到的数据才完整
+    ssize_t result = read_inode(inumber, data, length, offset);
+    cur_disk->finish_reads();
+    return result;
+}
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::read_inode(size_t inumber, char *data, size_t length, size_t offset) {
     // Load inode information
-    ssize_t size_inode = stat(inumber);
-    // 隐含了size_inode = -1的情况
-    if ((int) offset >= size_inode) {
+    Inode inode{};
+    // 隐含了inode无效的情况，只载入一次inode
+    if (!load_inode(inumber, &inode) || offset >= inode.Size) {
         return 0;
-    } else if (length + (int) offset > size_inode) {
-        length = size_inode - (int) offset;
+    }
+    if (length > inode.Size - offset) {
+        length = inode.Size - offset;
     } // Adjust length
 
-    Inode inode{};
+    // 小文件直接从inode或碎片中读取
+    if (packed(inode)) {
+        read_small(inode, data, length, offset);
+        return length;
+    }
 
-    if (!load_inode(inumber, &inode)) {
-        return -1;
+    // 预分配后未写入的部分读出为零，不必读盘
+    size_t zeros = 0;
+    size_t written = (size_t) unwritten_from(inode) * BLOCK_SIZE;
+    if (offset + length > written) {
+        zeros = offset + length - std::max(offset, written);
+        memset(data + length - zeros, 0, zeros);
+        length -= zeros;
+        if (!length) {
+            return zeros;
+        }
     }
 
     // 下一数据保存位置
@@ -371,9 +895,9 @@ ssize_t FileSystem::read(size_t inumber, char *data, int length, size_t offset)
 
     // Read block and copy to data
     // 起始位置在直接索引
-    if (offset < POINTERS_PER_INODE * Disk::BLOCK_SIZE) {
-        uint32_t direct_node = offset / Disk::BLOCK_SIZE;
-        offset %= Disk::BLOCK_SIZE;
+    if (offset < POINTERS_PER_INODE * BLOCK_SIZE) {
+        uint32_t direct_node = offset / BLOCK_SIZE;
+        offset %= BLOCK_SIZE;
 
         // 无存储数据
         if (!inode.Direct[direct_node]) {
@@ -381,14 +905,11 @@ ssize_t FileSystem::read(size_t inumber, char *data, int length, size_t offset)
         }
         read_in_block(inode.Direct[direct_node], offset, &length, &ptr);
         direct_node++;
-        while (length > 0 && direct_node < POINTERS_PER_INODE && inode.Direct[direct_node]) {
-            read_in_block(inode.Direct[direct_node], 0, &length, &ptr);
-            direct_node++;
-        }
+        direct_node += read_run(inode.Direct + direct_node, POINTERS_PER_INODE - direct_node, &length, &ptr);
 
         // 已读取足够数据
-        if (length <= 0) {
-            return num_bytes;
+        if (length == 0) {
+            return num_bytes + zeros;
         }
 
         // 读完了直接索引或没有间接索引
@@ -398,17 +919,12 @@ ssize_t FileSystem::read(size_t inumber, char *data, int length, size_t offset)
 
         // 读取间接索引中的剩余部分
         Block indirect{};
-        cur_disk->read(inode.Indirect, indirect.Data);
-        for (uint32_t &Pointer : indirect.Pointers) {
-            if (!Pointer || length <= 0) {
-                break;
-            }
-            read_in_block(Pointer, 0, &length, &ptr);
-        }
+        read_block(cur_disk, inode.Indirect, indirect.Data);
+        read_run(indirect.Pointers, POINTERS_PER_BLOCK, &length, &ptr);
 
         // 读到了足够的数据
-        if (length <= 0) {
-            return num_bytes;
+        if (length == 0) {
+            return num_bytes + zeros;
         }
 
         // 间接索引也读完了
@@ -420,278 +936,2285 @@ ssize_t FileSystem::read(size_t inumber, char *data, int length, size_t offset)
         }
 
         // 去掉直接索引的偏移量部分
-        offset -= POINTERS_PER_INODE * Disk::BLOCK_SIZE;
+        offset -= POINTERS_PER_INODE * BLOCK_SIZE;
         // 间接索引块下标
-        uint32_t indirect_node = offset / Disk::BLOCK_SIZE;
-        offset %= Disk::BLOCK_SIZE;
+        uint32_t indirect_node = offset / BLOCK_SIZE;
+        offset %= BLOCK_SIZE;
 
         Block indirect{};
-        cur_disk->read(inode.Indirect, indirect.Data);
+        read_block(cur_disk, inode.Indirect, indirect.Data);
 
         // 第一块间接索引，从偏移量开始读
-        if (indirect.Pointers[indirect_node] && length > 0) {
+        if (indirect.Pointers[indirect_node] && length) {
             read_in_block(indirect.Pointers[indirect_node++], offset, &length, &ptr);
         }
 
         // 之后的间接索引直接读取整块
-        for (uint32_t i = indirect_node; i < POINTERS_PER_BLOCK; i++) {
-            if (!indirect.Pointers[i] || length <= 0) {
-                break;
-            }
-            read_in_block(indirect.Pointers[i], 0, &length, &ptr);
+        if (indirect_node < POINTERS_PER_BLOCK) {
+            read_run(indirect.Pointers + indirect_node, POINTERS_PER_BLOCK - indirect_node, &length, &ptr);
         }
 
         // 已读取足够数据
-        if (length <= 0) {
-            return num_bytes;
+        if (length == 0) {
+            return num_bytes + zeros;
         } else {
             return num_bytes - length;
         } // 数据不足
     }
 }
 
-// Allocate a block ------------------------------------------------------------
+// Map inode -------------------------------------------------------------------
 
-bool FileSystem::allocate_block(uint32_t &blocknum) {
-    // 不允许未挂载就操作
-    if (!cur_disk || !cur_disk->mounted()) {
-        return -1;
+size_t FileView::mapped() const {
+    size_t bytes = 0;
+    for (const Span &span : Spans) {
+        if (span.Mapped) {
+            bytes += span.Length;
+        }
     }
+    return bytes;
+}
 
-    if (blocknum) {
-        return true;
-    }
-    for (int i = (int) MetaData.InodeBlocks + 1; i < (int) MetaData.Blocks; i++) {
-        if (!free_block_bitmap[i]) {
-            free_block_bitmap[i] = true;
-            blocknum = i;
-            return true;
-        }
+void FileView::append(const char *data, size_t length) {
+    if (!Spans.empty() && Spans.back().Mapped && Spans.back().Data + Spans.back().Length == data) {
+        Spans.back().Length += length;
+    } else {
+        Spans.push_back({data, length, true});
     }
-    return false;
+    Size += length;
 }
 
-// Write inode back to block ---------------------------------------------------
+char *FileView::gather(size_t length, size_t capacity) {
+    void *data = NULL;
+    if (posix_memalign(&data, Disk::BLOCK_SIZE, std::max(std::max(length, capacity), (size_t) 1)) != 0) {
+        throw std::bad_alloc();
+    }
+    Buffers.emplace_back((char *) data, free);
+    Spans.push_back({(char *) data, length, false});
+    Size += length;
+    return (char *) data;
+}
 
-void FileSystem::write_inode_to_block(size_t inumber, Inode *inode) {
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::map(size_t inumber, FileView &view) {
     // 不允许未挂载就操作
     if (!cur_disk || !cur_disk->mounted()) {
-        return;
+        return false;
     }
 
-    // 在第i+1块inode块的第j个位置
-    int i = (int) (inumber / INODES_PER_BLOCK);
-    int j = (int) (inumber % INODES_PER_BLOCK);
-
-    Block block{};
-    cur_disk->read(i + 1, block.Data);
-    block.Inodes[j] = *inode;
-    cur_disk->write(i + 1, block.Data);
-}
+    Inode inode{};
+    if (!load_inode(inumber, &inode)) {
+        return false;
+    }
 
-// write real data to block ----------------------------------------------------
+    // 小文件保存在inode或碎片块中，只能复制出来
+    if (packed(inode)) {
+        if (inode.Size) {
+            read_small(inode, view.gather(inode.Size), inode.Size, 0);
+        }
+        return true;
+    }
 
-void FileSystem::write_data_to_block(int offset, int *num_bytes, int length, char *data, uint32_t blocknum) {
-    // 不允许未挂载就操作
-    if (!cur_disk || !cur_disk->mounted()) {
-        return;
+    // 按文件顺序列出数据块，与read()一样遇到空指针即结束
+    std::vector<uint32_t> pointers(inode.Direct, inode.Direct + POINTERS_PER_INODE);
+    if (inode.Indirect) {
+        Block indirect{};
+        read_block(cur_disk, inode.Indirect, indirect.Data);
+        pointers.insert(pointers.end(), indirect.Pointers, indirect.Pointers + POINTERS_PER_BLOCK);
     }
 
-    // 缓冲区用于先存储整个块大小的数据
-    char *ptr = (char *) calloc(Disk::BLOCK_SIZE, sizeof(char));
-    cur_disk->read(blocknum, ptr);
+    // 预分配后未写入的部分不映射，在视图末尾补零
+    size_t written = std::min<size_t>(inode.Size, (size_t) unwritten_from(inode) * BLOCK_SIZE);
+    size_t remaining = written;
+    for (size_t i = 0; i < pointers.size() && pointers[i] && remaining;) {
+        size_t run = 1;
+        while (i + run < pointers.size() && pointers[i + run] == pointers[i] + run && run * BLOCK_SIZE < remaining) {
+            run++;
+        }
+        size_t length = std::min(run * BLOCK_SIZE, remaining);
 
-    // 从偏移量开始逐字节修改数据
-    for (int i = offset; i < (int) Disk::BLOCK_SIZE && *num_bytes < length; i++) {
-        ptr[i] = data[*num_bytes];
-        *num_bytes = *num_bytes + 1;
+        // 物理上连续的一段直接指向映射的镜像，不能映射时整段读入视图自己的缓冲区
+        const char *data = cur_disk->map(pointers[i] * SECTORS, run * SECTORS);
+        if (data) {
+            view.append(data, length);
+        } else {
+            read_blocks(cur_disk, pointers[i], run, view.gather(length, run * BLOCK_SIZE));
+        }
+        remaining -= length;
+        i += run;
     }
-    cur_disk->write(blocknum, ptr);
-
-    // 释放缓冲区
-    free(ptr);
+    if (!remaining && written < inode.Size) {
+        memset(view.gather(inode.Size - written), 0, inode.Size - written);
+    }
+    return true;
 }
 
+// Allocate a block ------------------------------------------------------------
 
-// Write to inode --------------------------------------------------------------
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::allocate_block(uint32_t &blocknum) {
+    PROFILE_SCOPE("allocate_block");
 
-ssize_t FileSystem::write(size_t inumber, char *data, int length, size_t offset) {
     // 不允许未挂载就操作
     if (!cur_disk || !cur_disk->mounted()) {
         return -1;
     }
 
-    // Load inode
-    Inode inode{};
-    Block indirect{};
-    int num_bytes = 0;
-    size_t old_offset = offset;
-    size_t old_size = 0;
-
-    int max_size = length + (int) offset;
-    // 超过最大可能长度
-    if (max_size > (int) ((POINTERS_PER_BLOCK + POINTERS_PER_INODE) * Disk::BLOCK_SIZE)) {
-        return -1;
+    if (blocknum) {
+        return true;
     }
 
-    if (!load_inode(inumber, &inode)) {
-        inode.Valid = true;
-        inode.Size = max_size;
-        for (uint32_t &i : inode.Direct) {
-            i = 0;
+    // 待discard的块可能被重新分配，必须先完成discard
+    flush_discards();
+
+    // 优先在当前文件的inode所在组分配，组内借助两级位图直接定位第一个空闲块
+    for (size_t k = 0; k < num_groups; k++) {
+        Group &group = groups[(alloc_group + k) % num_groups];
+        size_t i = group.Free.find_clear(group.Data - group.Start);
+        if (i < group.Free.size()) {
+            group.Free.set(i);
+            blocknum = group.Start + i;
+            return true;
         }
-        inode.Indirect = 0;
-        inode_counter[inumber / INODES_PER_BLOCK]++;
-        free_block_bitmap[inumber / INODES_PER_BLOCK + 1] = true;
-    } else {
-        // 重设inode大小
-        old_size = inode.Size;
-        inode.Size = fmax((int) inode.Size, max_size);
     }
+    return false;
+}
 
-    // Write block and copy to data
-    // 从直接索引开始写
-    if (offset < POINTERS_PER_INODE * Disk::BLOCK_SIZE) {
-        // 直接索引块下标
-        uint32_t direct_node = offset / Disk::BLOCK_SIZE;
-        offset %= Disk::BLOCK_SIZE;
+// Release a block ------------------------------------------------------------
 
-        // 尝试为直接索引分配块，若磁盘已满则直接返回，下同
-        if (!allocate_block(inode.Direct[direct_node])) {
-            inode.Size = old_size;
-            write_inode_to_block(inumber, &inode);
-            return num_bytes;
-        }
-        // 真实写入数据
-        write_data_to_block(offset, &num_bytes, length, data, inode.Direct[direct_node]);
-        direct_node++;
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::release_block(uint32_t blocknum) {
+    mark_free(blocknum);
+    if (discard_mode) {
+        discard_pending.push_back(blocknum);
+    }
+}
 
-        // 写入了足够数据
-        if (num_bytes == length) {
-            write_inode_to_block(inumber, &inode);
-            return length;
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::flush_discards() {
+    if (discard_pending.empty()) {
+        return;
+    }
+
+    // 合并相邻的块，每段只调用一次discard
+    std::sort(discard_pending.begin(), discard_pending.end());
+    discard_pending.erase(std::unique(discard_pending.begin(), discard_pending.end()), discard_pending.end());
+    for (size_t k = 0; k < discard_pending.size();) {
+        size_t end = k + 1;
+        while (end < discard_pending.size() && discard_pending[end] == discard_pending[end - 1] + 1) {
+            end++;
+        }
+        // 宿主机不支持时关闭discard模式
+        if (!discard_blocks(cur_disk, discard_pending[k], end - k)) {
+            discard_mode = false;
+            break;
         }
+        k = end;
+    }
+    discard_pending.clear();
+}
 
-        for (int i = direct_node; i < (int) POINTERS_PER_INODE; i++) {
-            // 之后的直接索引从0开始写
-            if (!allocate_block(inode.Direct[direct_node])) {
-                inode.Size = old_offset + num_bytes;
-                write_inode_to_block(inumber, &inode);
-                return num_bytes;
-            }
-            write_data_to_block(0, &num_bytes, length, data, inode.Direct[direct_node]);
-            direct_node++;
+// Block reference counts ------------------------------------------------------
 
-            // 写入了足够数据
-            if (num_bytes == length) {
-                write_inode_to_block(inumber, &inode);
-                return length;
-            }
-        }
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::add_ref(uint32_t blocknum) {
+    // 表中只记录被多处引用的块
+    uint32_t &refs = block_refs[blocknum];
+    refs = refs ? refs + 1 : 2;
+}
 
-        // 开始使用间接索引块
-        if (inode.Indirect) {
-            cur_disk->read(inode.Indirect, indirect.Data);
-        } else {
-            // 目前没有间接索引块，尝试分配
-            if (!allocate_block(inode.Indirect)) {
-                inode.Size = old_offset + num_bytes;
-                write_inode_to_block(inumber, &inode);
-                return num_bytes;
-            }
-            cur_disk->read(inode.Indirect, indirect.Data);
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::drop_ref(uint32_t blocknum) {
+    auto shared = block_refs.find(blocknum);
+    if (shared == block_refs.end()) {
+        release_block(blocknum);
+        return true;
+    }
+    if (--shared->second == 1) {
+        block_refs.erase(shared);
+    }
+    return false;
+}
 
-            // 新创建的间接索引块，先全部置0
-            for (uint32_t &Pointer : indirect.Pointers) {
-                Pointer = 0;
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::own_block(uint32_t &blocknum, bool indirect) {
+    if (!blocknum) {
+        return allocate_block(blocknum);
+    }
+    if (!block_refs.count(blocknum)) {
+        return true;
+    }
+
+    // 写时复制：复制一份私有的块
+    uint32_t copy = 0;
+    if (!allocate_block(copy)) {
+        return false;
+    }
+    Block block{};
+    read_block(cur_disk, blocknum, block.Data);
+    write_block(cur_disk, copy, block.Data);
+    // 调用者随后让指针指向副本，副本必须先于指针写到磁盘上
+    cur_disk->flush();
+
+    // 复制出的间接索引块同样引用原来的数据块
+    if (indirect) {
+        for (uint32_t Pointer : block.Pointers) {
+            if (Pointer) {
+                add_ref(Pointer);
             }
         }
+    }
+    drop_ref(blocknum);
+    blocknum = copy;
+    return true;
+}
 
-        for (uint32_t &Pointer : indirect.Pointers) {
-            // 尝试分配间接索引块指向的数据块
-            if (!allocate_block(Pointer)) {
-                inode.Size = old_offset + num_bytes;
-                cur_disk->write(inode.Indirect, indirect.Data);
-                write_inode_to_block(inumber, &inode);
-                return num_bytes;
-            }
-            write_data_to_block(0, &num_bytes, length, data, Pointer);
+// Clone inode -----------------------------------------------------------------
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::clone(size_t inumber) {
+    // 不允许未挂载就操作
+    if (!cur_disk || !cur_disk->mounted()) {
+        return -1;
+    }
 
+    Inode inode{};
+    if (!load_inode(inumber, &inode) || (inode.Valid & INODE_DIRECTORY)) {
+        return -1;
+    }
+    ssize_t target = create();
+    if (target < 0) {
+        return -1;
+    }
 
-            // 写入了足够数据
-            if (num_bytes == length) {
-                cur_disk->write(inode.Indirect, indirect.Data);
-                write_inode_to_block(inumber, &inode);
-                return length;
-            }
+    // 小文件直接复制数据
+    if (packed(inode)) {
+        char buffer[FRAGMENT_LIMIT];
+        read_small(inode, buffer, inode.Size, 0);
+        if (write(target, buffer, inode.Size, 0) != (ssize_t) inode.Size) {
+            remove(target);
+            return -1;
         }
+        return target;
+    }
 
-        // 没有多余空间了
-        cur_disk->write(inode.Indirect, indirect.Data);
-        write_inode_to_block(inumber, &inode);
-        return num_bytes;
-    } else { // 从间接索引开始写
-        // 先去掉直接索引块的偏移量部分
-        offset -= POINTERS_PER_INODE * Disk::BLOCK_SIZE;
-        // 计算间接索引块下标
-        uint32_t indirect_node = offset / Disk::BLOCK_SIZE;
-        offset %= Disk::BLOCK_SIZE;
+    // 共享数据块和间接索引块，只增加引用计数；未写入的块先清零，两边都视为已写入
+    fill_unwritten(inumber, inode);
+    for (uint32_t k : inode.Direct) {
+        if (k) {
+            add_ref(k);
+        }
+    }
+    if (inode.Indirect) {
+        add_ref(inode.Indirect);
+    }
+    write_inode_to_block(target, &inode);
+    return target;
+}
 
-        // 同上
-        if (inode.Indirect) {
-            cur_disk->read(inode.Indirect, indirect.Data);
+// Copy between inodes --------------------------------------------------------
+
+const size_t Volume::COPY_CHUNK;
+
+// 按磁盘块对齐的复制缓冲区，O_DIRECT时不需要再经过bounce buffer
+static std::unique_ptr<char, void (*)(void *)> copy_buffer() {
+    void *data = NULL;
+    if (posix_memalign(&data, Disk::BLOCK_SIZE, Volume::COPY_CHUNK) != 0) {
+        throw std::bad_alloc();
+    }
+    return std::unique_ptr<char, void (*)(void *)>((char *) data, free);
+}
+
+template <size_t BLOCK_BYTES>
+uint32_t *BlockVolume<BLOCK_BYTES>::block_slot(Inode &inode, Block &indirect, bool &loaded, uint32_t index) {
+    if (index < POINTERS_PER_INODE) {
+        return &inode.Direct[index];
+    }
+    index -= POINTERS_PER_INODE;
+    if (index >= POINTERS_PER_BLOCK) {
+        return nullptr;
+    }
+
+    // 第一次用到间接索引块时载入，共享的间接索引块需要先复制
+    if (!loaded) {
+        bool fresh = !inode.Indirect;
+        if (!own_block(inode.Indirect, true)) {
+            return nullptr;
+        }
+        if (fresh) {
+            memset(indirect.Pointers, 0, sizeof(indirect.Pointers));
         } else {
-            // 目前没有间接索引块，尝试分配
-            if (!allocate_block(inode.Indirect)) {
-                inode.Size = old_size;
-                write_inode_to_block(inumber, &inode);
-                return num_bytes;
-            }
-            cur_disk->read(inode.Indirect, indirect.Data);
+            read_block(cur_disk, inode.Indirect, indirect.Data);
+        }
+        loaded = true;
+    }
+    return &indirect.Pointers[index];
+}
 
-            // 新创建的间接索引块，先全部置0
-            for (uint32_t &Pointer : indirect.Pointers) {
-                Pointer = 0;
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::claim_block(uint32_t blocknum, uint32_t &target) {
+    // 整块都会被覆盖：私有的块原地覆盖，共享的块和空洞换成新块，不需要复制旧内容
+    target = blocknum;
+    if (blocknum && !block_refs.count(blocknum)) {
+        return true;
+    }
+    target = 0;
+    return allocate_block(target);
+}
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::commit_claim(uint32_t &blocknum, uint32_t target) {
+    // 新块写好之后才换上，旧的共享块交还给其他引用者
+    if (blocknum != target) {
+        if (blocknum) {
+            drop_ref(blocknum);
+        }
+        blocknum = target;
+    }
+}
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::release_claim(uint32_t blocknum, uint32_t target) {
+    if (blocknum != target) {
+        release_block(target);
+    }
+}
+
+template <size_t BLOCK_BYTES>
+size_t BlockVolume<BLOCK_BYTES>::share_blocks(size_t src, size_t src_offset, size_t dst, size_t dst_offset, size_t length) {
+    Inode from{}, to{};
+    if (!load_inode(src, &from) || !load_inode(dst, &to)) {
+        return 0;
+    }
+    alloc_group = group_of_inode(dst);
+    Block from_indirect{}, to_indirect{};
+    if (from.Indirect) {
+        read_block(cur_disk, from.Indirect, from_indirect.Data);
+    }
+
+    // 目标指向源文件的块并增加引用计数，之后任何一方写入时再复制
+    uint32_t index = src_offset / BLOCK_SIZE;
+    bool loaded = false;
+    size_t shared = 0;
+    for (; length - shared >= BLOCK_SIZE; index++, shared += BLOCK_SIZE) {
+        uint32_t block = index < POINTERS_PER_INODE ? from.Direct[index] : from_indirect.Pointers[index - POINTERS_PER_INODE];
+        // 空洞留给缓冲复制处理
+        if (!block) {
+            break;
+        }
+        uint32_t *slot = block_slot(to, to_indirect, loaded, (dst_offset + shared) / BLOCK_SIZE);
+        if (!slot) {
+            break;
+        }
+        if (*slot != block) {
+            add_ref(block);
+            if (*slot) {
+                drop_ref(*slot);
             }
+            *slot = block;
         }
+    }
 
-        if (!allocate_block(indirect.Pointers[indirect_node])) {
-            inode.Size = old_size;
-            cur_disk->write(inode.Indirect, indirect.Data);
-            write_inode_to_block(inumber, &inode);
-            return num_bytes;
+    if (loaded) {
+        write_block(cur_disk, to.Indirect, to_indirect.Data);
+    }
+    to.Size = std::max((size_t) to.Size, dst_offset + shared);
+    write_inode_to_block(dst, &to);
+    return shared;
+}
+
+template <size_t BLOCK_BYTES>
+size_t BlockVolume<BLOCK_BYTES>::copy_buffered(size_t src, size_t src_offset, size_t dst, size_t dst_offset, size_t length) {
+    auto buffer = copy_buffer();
+    size_t copied = 0;
+    while (copied < length) {
+        // 读取时连续的整块合并成一次请求
+        size_t chunk = std::min(length - copied, COPY_CHUNK);
+        ssize_t got = read(src, buffer.get(), chunk, src_offset + copied);
+        if (got <= 0) {
+            break;
         }
-        write_data_to_block(offset, &num_bytes, length, data, indirect.Pointers[indirect_node]);
-        indirect_node++;
+        ssize_t put = write(dst, buffer.get(), got, dst_offset + copied);
+        if (put <= 0) {
+            break;
+        }
+        copied += put;
+        if (put < got) {
+            break;
+        }
+    }
+    return copied;
+}
 
-        // 写入了足够数据
-        if (num_bytes == length) {
-            cur_disk->write(inode.Indirect, indirect.Data);
-            write_inode_to_block(inumber, &inode);
-            return length;
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::copy_range(size_t src, size_t src_offset, size_t dst, size_t dst_offset, size_t length) {
+    // 不允许未挂载就操作
+    if (!cur_disk || !cur_disk->mounted()) {
+        return -1;
+    }
+
+    Inode from{}, to{};
+    if (!load_inode(src, &from) || !load_inode(dst, &to) || ((from.Valid | to.Valid) & INODE_DIRECTORY)) {
+        return -1;
+    }
+    if (src_offset >= from.Size) {
+        return 0;
+    }
+    length = std::min(length, from.Size - src_offset);
+    // 同一文件内重叠的区间不允许复制
+    if (src == dst && src_offset < dst_offset + length && dst_offset < src_offset + length) {
+        return -1;
+    }
+    if (dst_offset + length > (POINTERS_PER_BLOCK + POINTERS_PER_INODE) * BLOCK_SIZE) {
+        return -1;
+    }
+
+    size_t copied = 0;
+    // 两边块内偏移相同时，先复制到块边界，中间的整块直接共享
+    if (src != dst && !packed(from) && src_offset % BLOCK_SIZE == dst_offset % BLOCK_SIZE) {
+        size_t head = std::min(length, (BLOCK_SIZE - src_offset % BLOCK_SIZE) % BLOCK_SIZE);
+        copied = copy_buffered(src, src_offset, dst, dst_offset, head);
+        // 未写入的块不能直接共享，经过缓冲区复制时读出为零
+        if (copied == head && load_inode(dst, &to) && !packed(to) && !((from.Valid | to.Valid) & INODE_UNWRITTEN)) {
+            copied += share_blocks(src, src_offset + copied, dst, dst_offset + copied, length - copied);
         }
+    }
 
-        for (int i = indirect_node; i < (int) POINTERS_PER_BLOCK; i++) {
-            // 尝试分配间接索引指向的块
-            if (!allocate_block(indirect.Pointers[i])) {
-                inode.Size = old_offset + num_bytes;
-                cur_disk->write(inode.Indirect, indirect.Data);
-                write_inode_to_block(inumber, &inode);
-                return num_bytes;
+    // 剩余部分（不足一块的头尾、空洞、小文件）经过内部缓冲区复制
+    copied += copy_buffered(src, src_offset + copied, dst, dst_offset + copied, length - copied);
+    flush_discards();
+    return copied;
+}
+
+// Copy between inodes and host files ------------------------------------------
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::blocks_from_file(int fd, off_t fd_offset, uint32_t blocknum, size_t nblocks, char *buffer) {
+    if (cur_disk->copy_in(blocknum * SECTORS, nblocks * SECTORS, fd, fd_offset)) {
+        return true;
+    }
+
+    // 宿主机不能在文件之间直接复制时经过缓冲区
+    if (pread(fd, buffer, nblocks * BLOCK_SIZE, fd_offset) != (ssize_t) (nblocks * BLOCK_SIZE)) {
+        return false;
+    }
+    write_blocks(cur_disk, blocknum, nblocks, buffer);
+    return true;
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::blocks_to_file(uint32_t blocknum, size_t nblocks, int fd, off_t fd_offset, char *buffer) {
+    if (cur_disk->copy_out(blocknum * SECTORS, nblocks * SECTORS, fd, fd_offset)) {
+        return true;
+    }
+
+    read_blocks(cur_disk, blocknum, nblocks, buffer);
+    return pwrite(fd, buffer, nblocks * BLOCK_SIZE, fd_offset) == (ssize_t) (nblocks * BLOCK_SIZE);
+}
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::splice_in(size_t inumber, size_t offset, int fd, off_t fd_offset, size_t length) {
+    // 不允许未挂载就操作
+    if (!cur_disk || !cur_disk->mounted()) {
+        return -1;
+    }
+
+    if (offset + length > (POINTERS_PER_BLOCK + POINTERS_PER_INODE) * BLOCK_SIZE) {
+        return -1;
+    }
+    alloc_group = group_of_inode(inumber);
+
+    // 小文件直接交给write()，不必多读一次inode
+    Inode inode{};
+    bool whole_blocks = offset % BLOCK_SIZE == 0 && offset + length > FRAGMENT_LIMIT;
+    if (whole_blocks && load_inode(inumber, &inode) && (inode.Valid & INODE_DIRECTORY)) {
+        return -1;
+    }
+
+    auto buffer = copy_buffer();
+    size_t copied = 0;
+
+    // 整块部分先分配好块，物理上连续的一段由宿主机直接复制进磁盘
+    if (whole_blocks && inode.Valid && !packed(inode)) {
+        Block indirect{};
+        bool loaded = false;
+        uint32_t index = offset / BLOCK_SIZE;
+        size_t whole = length / BLOCK_SIZE;
+        uint32_t start = 0;
+        size_t run = 0;
+        // 本段选好的块，复制成功后才写进指针；复制失败时换来的新块全部释放，文件保持原样
+        std::vector<std::pair<uint32_t *, uint32_t>> claims;
+        for (size_t k = 0; k <= whole; k++) {
+            uint32_t *slot = k < whole ? block_slot(inode, indirect, loaded, index + k) : nullptr;
+            uint32_t target = 0;
+            bool claimed = slot && claim_block(*slot, target);
+            if (run && (!claimed || target != start + run || run == COPY_CHUNK / BLOCK_SIZE)) {
+                if (!blocks_from_file(fd, fd_offset + copied, start, run, buffer.get())) {
+                    if (claimed) {
+                        release_claim(*slot, target);
+                    }
+                    claimed = false;
+                    break;
+                }
+                for (auto &claim : claims) {
+                    commit_claim(*claim.first, claim.second);
+                }
+                claims.clear();
+                copied += run * BLOCK_SIZE;
+                run = 0;
             }
-            write_data_to_block(0, &num_bytes, length, data, indirect.Pointers[i]);
+            if (!claimed) {
+                break;
+            }
+            if (!run) {
+                start = target;
+            }
+            claims.push_back({slot, target});
+            run++;
+        }
+        for (auto &claim : claims) {
+            release_claim(*claim.first, claim.second);
+        }
 
-            // 写入了足够数据
-            if (num_bytes == length) {
-                cur_disk->write(inode.Indirect, indirect.Data);
-                write_inode_to_block(inumber, &inode);
-                return length;
+        // 复制完整块之后才处理未写入标记，清零的块留在队列中与末尾的写入合并
+        bool tail = copied == whole * BLOCK_SIZE && length > copied;
+        settle_unwritten(inode, offset, tail ? length : copied);
+
+        // 末尾不足一块的部分：块中没有文件后面的数据时不需要先读出
+        if (tail) {
+            bool tail_data = inode.Size > offset + length;
+            uint32_t *slot = block_slot(inode, indirect, loaded, index + whole);
+            uint32_t target = 0;
+            if (slot && (tail_data ? own_block(*slot) : claim_block(*slot, target))) {
+                if (tail_data) {
+                    target = *slot;
+                }
+                Block block{};
+                if (tail_data) {
+                    read_block(cur_disk, target, block.Data);
+                }
+                if (pread(fd, block.Data, length - copied, fd_offset + copied) == (ssize_t) (length - copied)) {
+                    write_block(cur_disk, target, block.Data);
+                    commit_claim(*slot, target);
+                    copied = length;
+                } else {
+                    release_claim(*slot, target);
+                }
             }
         }
 
-        // 没有多余空间了
-        cur_disk->write(inode.Indirect, indirect.Data);
+        if (loaded) {
+            write_block(cur_disk, inode.Indirect, indirect.Data);
+        }
+        inode.Size = std::max((size_t) inode.Size, offset + copied);
         write_inode_to_block(inumber, &inode);
-        return num_bytes;
     }
+
+    // 小文件和未对齐的部分经过缓冲区写入
+    while (copied < length) {
+        size_t chunk = std::min(length - copied, COPY_CHUNK);
+        ssize_t got = pread(fd, buffer.get(), chunk, fd_offset + copied);
+        if (got <= 0) {
+            break;
+        }
+        ssize_t put = write(inumber, buffer.get(), got, offset + copied);
+        if (put <= 0) {
+            break;
+        }
+        copied += put;
+        if (put < got) {
+            break;
+        }
+    }
+
+    flush_discards();
+    return copied;
+}
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::splice_out(size_t inumber, size_t offset, int fd, off_t fd_offset, size_t length) {
+    // 不允许未挂载就操作
+    if (!cur_disk || !cur_disk->mounted()) {
+        return -1;
+    }
+
+    Inode inode{};
+    if (!load_inode(inumber, &inode) || offset >= inode.Size) {
+        return 0;
+    }
+    length = std::min(length, inode.Size - offset);
+
+    auto buffer = copy_buffer();
+    size_t copied = 0;
+
+    // 预分配后未写入的部分由read()补零，不直接复制
+    size_t written = (size_t) unwritten_from(inode) * BLOCK_SIZE;
+    size_t direct = offset < written ? std::min(length, written - offset) : 0;
+
+    // 物理上连续的整块由宿主机直接复制出磁盘，遇到空洞为止
+    if (!packed(inode) && offset % BLOCK_SIZE == 0 && direct) {
+        Block indirect{};
+        if (inode.Indirect) {
+            read_block(cur_disk, inode.Indirect, indirect.Data);
+        }
+        uint32_t index = offset / BLOCK_SIZE;
+        size_t whole = direct / BLOCK_SIZE;
+        uint32_t start = 0;
+        size_t run = 0;
+        for (size_t k = 0; k <= whole; k++, index++) {
+            uint32_t block = 0;
+            if (k < whole) {
+                block = index < POINTERS_PER_INODE ? inode.Direct[index] : indirect.Pointers[index - POINTERS_PER_INODE];
+            }
+            if (run && (!block || block != start + run || run == COPY_CHUNK / BLOCK_SIZE)) {
+                if (!blocks_to_file(start, run, fd, fd_offset + copied, buffer.get())) {
+                    return copied;
+                }
+                copied += run * BLOCK_SIZE;
+                run = 0;
+            }
+            if (!block) {
+                break;
+            }
+            if (!run) {
+                start = block;
+            }
+            run++;
+        }
+
+        // 末尾不足一块的部分直接读出，不再重新载入inode
+        index = offset / BLOCK_SIZE + whole;
+        if (copied == whole * BLOCK_SIZE && direct > copied) {
+            uint32_t block = index < POINTERS_PER_INODE ? inode.Direct[index] : indirect.Pointers[index - POINTERS_PER_INODE];
+            Block tail{};
+            if (block) {
+                read_block(cur_disk, block, tail.Data);
+                if (pwrite(fd, tail.Data, direct - copied, fd_offset + copied) != (ssize_t) (direct - copied)) {
+                    return copied;
+                }
+                copied = direct;
+            }
+        }
+    }
+
+    // 小文件和未对齐的部分经过缓冲区读出
+    while (copied < length) {
+        size_t chunk = std::min(length - copied, COPY_CHUNK);
+        ssize_t got = read(inumber, buffer.get(), chunk, offset + copied);
+        if (got <= 0 || pwrite(fd, buffer.get(), got, fd_offset + copied) != got) {
+            break;
+        }
+        copied += got;
+    }
+    return copied;
+}
+
+// Statfs ----------------------------------------------------------------------
+
+template <size_t BLOCK_BYTES>
+size_t BlockVolume<BLOCK_BYTES>::free_blocks() const {
+    // 位图中也记录了超级块和非空的inode块，只有数据区可供分配
+    size_t used = 0;
+    for (size_t g = 0; g < num_groups; g++) {
+        const Group &group = groups[g];
+        used += group.Free.count() - group.Free.count(0, group.Data - group.Start);
+    }
+    return (MetaData.Blocks - MetaData.InodeBlocks - 1) - used;
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::statfs(StatFS &stats) {
+    // 不允许未挂载就操作
+    if (!cur_disk || !cur_disk->mounted()) {
+        return false;
+    }
+
+    stats.BlockSize   = BLOCK_SIZE;
+    stats.Blocks      = MetaData.Blocks;
+    stats.DataBlocks  = MetaData.Blocks - MetaData.InodeBlocks - 1;
+    stats.FreeBlocks  = free_blocks();
+    stats.Inodes      = MetaData.Inodes;
+    stats.FreeInodes  = MetaData.Inodes - inodes_used;
+    return true;
+}
+
+// Defragment ------------------------------------------------------------------
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::block_list(const Inode &inode, Block &indirect, std::vector<uint32_t> &blocks) {
+    // 按文件内的顺序排列：直接索引块、间接索引块、间接索引指向的块
+    blocks.clear();
+    for (uint32_t k : inode.Direct) {
+        if (k) {
+            blocks.push_back(k);
+        }
+    }
+    if (inode.Indirect) {
+        blocks.push_back(inode.Indirect);
+        read_block(cur_disk, inode.Indirect, indirect.Data);
+        for (uint32_t Pointer : indirect.Pointers) {
+            if (Pointer) {
+                blocks.push_back(Pointer);
+            }
+        }
+    }
+
+    // 含有共享块的文件不移动
+    for (uint32_t k : blocks) {
+        if (block_refs.count(k)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t count_extents(const std::vector<uint32_t> &blocks) {
+    size_t extents = 0;
+    for (size_t k = 0; k < blocks.size(); k++) {
+        if (!k || blocks[k] != blocks[k - 1] + 1) {
+            extents++;
+        }
+    }
+    return extents;
+}
+
+template <size_t BLOCK_BYTES>
+uint32_t BlockVolume<BLOCK_BYTES>::find_free_run(size_t length, size_t group) {
+    // 优先在inode所在组中找最靠前的足够长的空闲区间，使空闲空间逐渐集中到组的末尾
+    for (size_t k = 0; k < num_groups; k++) {
+        const Group &candidate = groups[(group + k) % num_groups];
+        size_t start = candidate.Free.find_clear_run(candidate.Data - candidate.Start, length);
+        if (start < candidate.Free.size()) {
+            return candidate.Start + start;
+        }
+    }
+    return 0;
+}
+
+template <size_t BLOCK_BYTES>
+size_t BlockVolume<BLOCK_BYTES>::relocate(size_t inumber, Inode &inode, Block &indirect, const std::vector<uint32_t> &blocks, uint32_t start) {
+    // 新位置可能刚被释放，必须先完成discard，再占用新位置
+    flush_discards();
+    for (size_t k = 0; k < blocks.size(); k++) {
+        mark_used(start + k);
+    }
+
+    // 复制数据块，同时更新指针
+    size_t next = 0;
+    Block block{};
+    for (uint32_t &k : inode.Direct) {
+        if (k) {
+            read_block(cur_disk, k, block.Data);
+            write_block(cur_disk, start + next++, block.Data);
+            k = start + next - 1;
+        }
+    }
+    if (inode.Indirect) {
+        uint32_t target = start + next++;
+        for (uint32_t &Pointer : indirect.Pointers) {
+            if (Pointer) {
+                read_block(cur_disk, Pointer, block.Data);
+                write_block(cur_disk, start + next++, block.Data);
+                Pointer = start + next - 1;
+            }
+        }
+        write_block(cur_disk, target, indirect.Data);
+        inode.Indirect = target;
+    }
+
+    // 写入inode后新位置才生效，之后再释放旧块；
+    // 排队的写入按块号执行，inode块靠前，所以先把搬过去的块写到磁盘上
+    cur_disk->flush();
+    write_inode_to_block(inumber, &inode);
+    for (uint32_t k : blocks) {
+        release_block(k);
+    }
+    return blocks.size();
+}
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::defrag(size_t budget) {
+    // 不允许未挂载就操作
+    if (!cur_disk || !cur_disk->mounted()) {
+        return -1;
+    }
+
+    size_t moved = 0;
+    size_t inodes = MetaData.InodeBlocks * INODES_PER_BLOCK;
+    Block table{};
+    std::vector<uint32_t> blocks;
+
+    // 从上次停下的位置继续，最多扫描一遍
+    for (size_t scanned = 0; scanned < inodes && moved < budget; scanned++, defrag_cursor = (defrag_cursor + 1) % inodes) {
+        size_t i = defrag_cursor / INODES_PER_BLOCK;
+        if (!inode_counter[i]) {
+            continue;
+        }
+        if (defrag_cursor % INODES_PER_BLOCK == 0 || !scanned) {
+            read_block(cur_disk, inode_block(MetaData, i), table.Data);
+        }
+
+        Inode inode = table.Inodes[defrag_cursor % INODES_PER_BLOCK];
+        Block indirect{};
+        if (!inode.Valid || packed(inode) || !has_blocks(inode) || !block_list(inode, indirect, blocks)) {
+            continue;
+        }
+
+        // 超出预算的文件留到下次，除非本次还没有移动过任何块
+        if (moved && moved + blocks.size() > budget) {
+            break;
+        }
+
+        // 碎片化的文件整体移到连续区间，连续的文件只在能前移时移动
+        // 连续的文件只在能前移或能移回inode所在组时移动
+        size_t home = group_of_inode(defrag_cursor);
+        uint32_t start = find_free_run(blocks.size(), home);
+        bool closer = group_of(start) == home && (group_of(blocks.front()) != home || start < blocks.front());
+        if (!start || (count_extents(blocks) == 1 && !closer)) {
+            continue;
+        }
+        moved += relocate(defrag_cursor, inode, indirect, blocks, start);
+    }
+
+    flush_discards();
+    return moved;
+}
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::extents(size_t inumber) {
+    Inode inode{};
+    if (!load_inode(inumber, &inode)) {
+        return -1;
+    }
+    if (packed(inode)) {
+        return (inode.Valid & INODE_FRAGMENT) ? 1 : 0;
+    }
+
+    Block indirect{};
+    std::vector<uint32_t> blocks;
+    block_list(inode, indirect, blocks);
+    return count_extents(blocks);
+}
+
+// Preallocate blocks ----------------------------------------------------------
+
+template <size_t BLOCK_BYTES>
+uint32_t BlockVolume<BLOCK_BYTES>::unwritten_from(const Inode &inode) {
+    // 下标之后的已分配块都未写入过，没有标记时返回上限
+    return (inode.Valid & INODE_UNWRITTEN) ? inode.Valid >> UNWRITTEN_SHIFT : UINT32_MAX;
+}
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::zero_unwritten(const Inode &inode, uint32_t from, uint32_t to) {
+    Block indirect{};
+    if (to > POINTERS_PER_INODE && inode.Indirect) {
+        read_block(cur_disk, inode.Indirect, indirect.Data);
+    }
+    to = std::min<uint32_t>(to, POINTERS_PER_INODE + POINTERS_PER_BLOCK);
+
+    // 物理上连续的一段只清零一次，能打洞时不写数据
+    uint32_t start = 0;
+    size_t run = 0;
+    for (uint32_t index = from; index <= to; index++) {
+        uint32_t block = 0;
+        if (index < to) {
+            block = index < POINTERS_PER_INODE ? inode.Direct[index] : indirect.Pointers[index - POINTERS_PER_INODE];
+        }
+        if (run && block != start + run) {
+            cur_disk->zero_blocks(start * SECTORS, run * SECTORS);
+            run = 0;
+        }
+        if (block && !run++) {
+            start = block;
+        }
+    }
+}
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::settle_unwritten(Inode &inode, size_t offset, size_t length) {
+    uint32_t written = unwritten_from(inode);
+    if (!length || (offset + length - 1) / BLOCK_SIZE < written) {
+        return;
+    }
+    uint32_t first = offset / BLOCK_SIZE;
+    uint32_t last = (offset + length - 1) / BLOCK_SIZE;
+
+    // 被跳过的未写入块之后就算已写入，先清零
+    if (first > written) {
+        zero_unwritten(inode, written, first);
+    }
+
+    // 只写一部分的块其余部分必须读出为零：先写入全零块，批处理中与随后的写入合并
+    Block zeros{};
+    bool head = first >= written && offset % BLOCK_SIZE;
+    bool tail = (offset + length) % BLOCK_SIZE && !(head && last == first);
+    uint32_t block = head ? block_of(inode, first) : 0;
+    if (block) {
+        write_block(cur_disk, block, zeros.Data);
+    }
+    block = tail ? block_of(inode, last) : 0;
+    if (block) {
+        write_block(cur_disk, block, zeros.Data);
+    }
+
+    // 未写入的块都在文件大小之内，写到最后一块时去掉标记
+    size_t size = std::max<size_t>(inode.Size, offset + length);
+    inode.Valid &= ~(INODE_UNWRITTEN | (UINT32_MAX << UNWRITTEN_SHIFT));
+    if ((size_t) (last + 1) * BLOCK_SIZE < size) {
+        inode.Valid |= INODE_UNWRITTEN | ((last + 1) << UNWRITTEN_SHIFT);
+    }
+}
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::fill_unwritten(size_t inumber, Inode &inode) {
+    if (!(inode.Valid & INODE_UNWRITTEN)) {
+        return;
+    }
+
+    // 直接暴露或共享数据块之前，把未写入的块真正清零
+    zero_unwritten(inode, unwritten_from(inode), (inode.Size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    inode.Valid &= ~(INODE_UNWRITTEN | (UINT32_MAX << UNWRITTEN_SHIFT));
+    write_inode_to_block(inumber, &inode);
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::fallocate(size_t inumber, size_t offset, size_t length) {
+    // 不允许未挂载就操作
+    if (!cur_disk || !cur_disk->mounted()) {
+        return false;
+    }
+
+    const size_t max_file = (POINTERS_PER_BLOCK + POINTERS_PER_INODE) * BLOCK_SIZE;
+    if (offset > max_file || length > max_file - offset) {
+        return false;
+    }
+    Inode inode{};
+    if (!load_inode(inumber, &inode) || (inode.Valid & INODE_DIRECTORY)) {
+        return false;
+    }
+    size_t end = offset + length;
+    alloc_group = group_of_inode(inumber);
+
+    if (!length) {
+        return true;
+    }
+
+    // 放得进inode或碎片的小文件不需要整块，直接补零到新的大小
+    if ((packed(inode) || !has_blocks(inode)) && end <= FRAGMENT_LIMIT) {
+        if (end <= inode.Size) {
+            return true;
+        }
+        std::vector<char> zeros(end - inode.Size);
+        return write(inumber, zeros.data(), zeros.size(), inode.Size) == (ssize_t) zeros.size();
+    }
+
+    // 先数出缺少的块，空间不够时不改动文件；读到空洞即停止，文件末尾之后的空隙一并分配
+    // 小文件要先搬到独立的块中，这时从第0块起全部要分配（搬出的块也算在内）
+    bool unpack = packed(inode);
+    uint32_t first = std::min<size_t>(offset, inode.Size) / BLOCK_SIZE;
+    uint32_t last = (end - 1) / BLOCK_SIZE;
+    bool indirect_used = last >= POINTERS_PER_INODE;
+    bool fresh_indirect = indirect_used && (unpack || !inode.Indirect);
+    Block indirect{};
+    if (indirect_used && !fresh_indirect) {
+        read_block(cur_disk, inode.Indirect, indirect.Data);
+    }
+    auto slot = [&](uint32_t index) -> uint32_t & {
+        return index < POINTERS_PER_INODE ? inode.Direct[index] : indirect.Pointers[index - POINTERS_PER_INODE];
+    };
+    size_t missing = fresh_indirect;
+    for (uint32_t index = first; index <= last; index++) {
+        missing += unpack || !slot(index);
+    }
+    bool shared_indirect = indirect_used && !fresh_indirect && block_refs.count(inode.Indirect);
+    if (missing + shared_indirect > free_blocks()) {
+        return false;
+    }
+    if (unpack) {
+        if (!unpack_small(inode, inode.Size)) {
+            return false;
+        }
+        write_inode_to_block(inumber, &inode);
+        missing -= inode.Direct[0] != 0;
+    }
+    if (missing == 0 && end <= inode.Size) {
+        return true;
+    }
+
+    // 共享的间接索引块先复制
+    if (shared_indirect && !own_block(inode.Indirect, true)) {
+        return false;
+    }
+
+    // 文件末尾不足一块的部分之后要读出为零
+    uint32_t written = unwritten_from(inode);
+    if (written == UINT32_MAX) {
+        written = (inode.Size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        uint32_t tail = written ? block_of(inode, written - 1) : 0;
+        if (end > inode.Size && inode.Size % BLOCK_SIZE && tail) {
+            Block block{};
+            read_block(cur_disk, tail, block.Data);
+            memset(block.Data + inode.Size % BLOCK_SIZE, 0, BLOCK_SIZE - inode.Size % BLOCK_SIZE);
+            write_block(cur_disk, tail, block.Data);
+        }
+    }
+
+    // 缺少的块（连同间接索引块）尽量取自同一段连续空闲区间，按文件顺序排列
+    flush_discards();
+    uint32_t start = missing ? find_free_run(missing, alloc_group) : 0;
+    size_t taken = 0;
+    auto take = [&](uint32_t &blocknum) {
+        if (start) {
+            blocknum = start + taken++;
+            mark_used(blocknum);
+        } else {
+            allocate_block(blocknum);
+        }
+    };
+    std::vector<uint32_t> holes;
+    for (uint32_t index = first; index <= last; index++) {
+        if (fresh_indirect && index >= POINTERS_PER_INODE && !inode.Indirect) {
+            take(inode.Indirect);
+        }
+        if (!slot(index)) {
+            take(slot(index));
+            // 已写入区域中的空洞没有未写入标记，直接清零
+            if (index < written) {
+                holes.push_back(slot(index));
+            }
+        }
+    }
+    for (uint32_t block : holes) {
+        cur_disk->zero_blocks(block * SECTORS, SECTORS);
+    }
+
+    inode.Size = std::max<size_t>(inode.Size, end);
+    inode.Valid &= ~(INODE_UNWRITTEN | (UINT32_MAX << UNWRITTEN_SHIFT));
+    if ((size_t) written * BLOCK_SIZE < inode.Size) {
+        inode.Valid |= INODE_UNWRITTEN | (written << UNWRITTEN_SHIFT);
+    }
+    if (indirect_used) {
+        write_block(cur_disk, inode.Indirect, indirect.Data);
+    }
+    write_inode_to_block(inumber, &inode);
+    return true;
+}
+
+// Grow file system ------------------------------------------------------------
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::grow(size_t blocks, bool inodes) {
+    // 不允许未挂载就操作
+    if (!cur_disk || !cur_disk->mounted()) {
+        return false;
+    }
+    // 只能变大，块指针是32位的，扩展区个数受超级块大小限制
+    uint32_t extensions = (MetaData.Features & FEATURE_GROWN) ? MetaData.ExtensionCount : 0;
+    if (blocks <= MetaData.Blocks || blocks > UINT32_MAX || extensions >= MAX_EXTENSIONS) {
+        return false;
+    }
+
+    // 新增部分成为一个扩展区：需要时开头放按比例分配的inode块，其余是数据
+    size_t added = blocks - MetaData.Blocks;
+    uint32_t inode_percent = MetaData.InodePercent ? MetaData.InodePercent : DEFAULT_INODE_PERCENT;
+    size_t inode_blocks = inodes ? (size_t) std::ceil((added * 1.00) * inode_percent / 100) : 0;
+    if (inode_blocks >= added || (MetaData.InodeBlocks + inode_blocks) * INODES_PER_BLOCK > UINT32_MAX) {
+        return false;
+    }
+    if (!cur_disk->grow(blocks * SECTORS)) {
+        return false;
+    }
+    size_t start = MetaData.Blocks;
+    if (inode_blocks) {
+        cur_disk->zero_blocks(start * SECTORS, inode_blocks * SECTORS);
+    }
+
+    // 更新超级块：只追加一条扩展记录，已有的块和inode都不移动
+    if (!extensions) {
+        MetaData.Features |= FEATURE_GROWN;
+        MetaData.BaseBlocks = MetaData.Blocks;
+        MetaData.BaseInodeBlocks = MetaData.InodeBlocks;
+    }
+    MetaData.Extensions[extensions].Start = (uint32_t) start;
+    MetaData.Extensions[extensions].InodeBlocks = (uint32_t) inode_blocks;
+    MetaData.ExtensionCount = extensions + 1;
+    MetaData.Blocks = (uint32_t) blocks;
+    MetaData.InodeBlocks += (uint32_t) inode_blocks;
+    MetaData.Inodes = MetaData.InodeBlocks * INODES_PER_BLOCK;
+    Block block{};
+    block.Super = MetaData;
+    write_block(cur_disk, 0, block.Data);
+
+    // 新区域单独成组，已有各组的位图原样移入新数组
+    std::unique_ptr<Group[]> grown(new Group[num_groups + 1]);
+    for (size_t g = 0; g < num_groups; g++) {
+        grown[g] = std::move(groups[g]);
+    }
+    Group &group = grown[num_groups];
+    group.Start = start;
+    group.Data  = start + inode_blocks;
+    group.End   = blocks;
+    group.Free.resize(blocks - start);
+    groups = std::move(grown);
+    num_groups++;
+
+    inode_counter.resize(MetaData.InodeBlocks, 0);
+    return true;
+}
+
+// Discard interface -----------------------------------------------------------
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::set_discard(bool enabled) {
+    if (!enabled && cur_disk) {
+        flush_discards();
+    }
+    discard_mode = enabled;
+}
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::trim() {
+    // 不允许未挂载就操作
+    if (!cur_disk || !cur_disk->mounted()) {
+        return -1;
+    }
+    flush_discards();
+
+    // 对每组中每一段连续的空闲块打洞
+    ssize_t trimmed = 0;
+    for (size_t g = 0; g < num_groups; g++) {
+        const Group &group = groups[g];
+        size_t start = group.Free.find_clear(0);
+        while (start < group.Free.size()) {
+            size_t end = group.Free.find_set(start);
+            if (!discard_blocks(cur_disk, group.Start + start, end - start)) {
+                return -1;
+            }
+            trimmed += end - start;
+            start = group.Free.find_clear(end);
+        }
+    }
+    return trimmed;
+}
+
+// Write inode back to block ---------------------------------------------------
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::write_inode_to_block(size_t inumber, Inode *inode) {
+    // 不允许未挂载就操作
+    if (!cur_disk || !cur_disk->mounted()) {
+        return;
+    }
+
+    // 在第i块inode块的第j个位置
+    size_t i = inumber / INODES_PER_BLOCK;
+    size_t j = inumber % INODES_PER_BLOCK;
+
+    Block block{};
+    read_block(cur_disk, inode_block(MetaData, i), block.Data);
+    block.Inodes[j] = *inode;
+    write_block(cur_disk, inode_block(MetaData, i), block.Data);
+}
+
+// write real data to block ----------------------------------------------------
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::write_data_to_block(size_t offset, size_t *num_bytes, size_t length, char *data, uint32_t blocknum) {
+    PROFILE_SCOPE("write_data_to_block");
+
+    // 不允许未挂载就操作
+    if (!cur_disk || !cur_disk->mounted()) {
+        return;
+    }
+
+    // 缓冲区用于先存储整个块大小的数据，按块对齐
+    Block block{};
+    char *ptr = block.Data;
+    read_block(cur_disk, blocknum, ptr);
+
+    // 从偏移量开始修改数据，不超过块尾和剩余长度
+    size_t count = std::min(BLOCK_SIZE - offset, length - *num_bytes);
+    memcpy(ptr + offset, data + *num_bytes, count);
+    *num_bytes += count;
+    write_block(cur_disk, blocknum, ptr);
+}
+
+
+// Small file helpers ----------------------------------------------------------
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::packed(const Inode &inode) {
+    return inode.Valid & (INODE_INLINE | INODE_FRAGMENT);
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::has_blocks(const Inode &inode) {
+    for (uint32_t k : inode.Direct) {
+        if (k) {
+            return true;
+        }
+    }
+    return inode.Indirect != 0;
+}
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::read_small(const Inode &inode, char *data, size_t length, size_t offset) {
+    if (inode.Valid & INODE_INLINE) {
+        memcpy(data, inode.Inline + offset, length);
+    } else if (inode.Valid & INODE_FRAGMENT) {
+        Block block{};
+        read_block(cur_disk, inode.Direct[0], block.Data);
+        memcpy(data, block.Data + (inode.Valid >> FRAGMENT_SHIFT) * FRAGMENT_SIZE + offset, length);
+    }
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::allocate_fragments(uint32_t count, uint32_t &blocknum, uint32_t &index, bool &fresh) {
+    uint32_t run = (1u << count) - 1;
+
+    // 先在未满的碎片块中找连续的空闲碎片
+    for (auto &entry : fragment_blocks) {
+        for (uint32_t i = 0; i + count <= FRAGMENTS_PER_BLOCK; i++) {
+            if (entry.second & (run << i)) {
+                continue;
+            }
+            blocknum = entry.first;
+            index = i;
+            fresh = false;
+            entry.second |= run << i;
+            if (entry.second == FRAGMENT_FULL) {
+                fragment_blocks.erase(blocknum);
+            }
+            return true;
+        }
+    }
+
+    // 没有合适的碎片块，新分配一块
+    blocknum = 0;
+    if (!allocate_block(blocknum)) {
+        return false;
+    }
+    index = 0;
+    fresh = true;
+    if (run != FRAGMENT_FULL) {
+        fragment_blocks[blocknum] = run;
+    }
+    return true;
+}
+
+template <size_t BLOCK_BYTES>
+void BlockVolume<BLOCK_BYTES>::release_small(Inode &inode, size_t size) {
+    if (inode.Valid & INODE_FRAGMENT) {
+        uint32_t count = (size + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+        uint32_t run = ((1u << count) - 1) << (inode.Valid >> FRAGMENT_SHIFT);
+
+        // 不在表中的碎片块是满的
+        auto entry = fragment_blocks.find(inode.Direct[0]);
+        uint32_t mask = (entry == fragment_blocks.end() ? FRAGMENT_FULL : entry->second) & ~run;
+        if (mask) {
+            fragment_blocks[inode.Direct[0]] = mask;
+        } else {
+            fragment_blocks.erase(inode.Direct[0]);
+            release_block(inode.Direct[0]);
+        }
+    }
+
+    inode.Valid &= ~(INODE_INLINE | INODE_FRAGMENT | (FRAGMENT_FULL << FRAGMENT_SHIFT));
+    memset(inode.Inline, 0, INLINE_SIZE);
+}
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::write_small(size_t inumber, Inode &inode, size_t old_size, char *data, size_t length, size_t offset) {
+    uint32_t old_count = (inode.Valid & INODE_FRAGMENT) ? (old_size + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE : 0;
+    uint32_t new_count = inode.Size <= INLINE_SIZE ? 0 : (inode.Size + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+    uint32_t first = inode.Valid >> FRAGMENT_SHIFT;
+
+    // 碎片后面有足够的空闲碎片时原地扩展
+    if (old_count && new_count > old_count && first + new_count <= FRAGMENTS_PER_BLOCK) {
+        uint32_t grow = ((1u << (new_count - old_count)) - 1) << (first + old_count);
+        auto entry = fragment_blocks.find(inode.Direct[0]);
+        if (entry != fragment_blocks.end() && !(entry->second & grow)) {
+            entry->second |= grow;
+            if (entry->second == FRAGMENT_FULL) {
+                fragment_blocks.erase(entry);
+            }
+            old_count = new_count;
+        }
+    }
+
+    // 原有碎片装得下，只需修改碎片块
+    if (old_count && old_count == new_count) {
+        Block block{};
+        read_block(cur_disk, inode.Direct[0], block.Data);
+        memcpy(block.Data + first * FRAGMENT_SIZE + offset, data, length);
+        write_block(cur_disk, inode.Direct[0], block.Data);
+        if (inode.Size != old_size) {
+            write_inode_to_block(inumber, &inode);
+        }
+        return length;
+    }
+
+    // 合并旧内容与新数据
+    char buffer[FRAGMENT_LIMIT] = {0};
+    read_small(inode, buffer, old_size, 0);
+    memcpy(buffer + offset, data, length);
+
+    if (!new_count) {
+        release_small(inode, old_size);
+        memcpy(inode.Inline, buffer, inode.Size);
+        inode.Valid |= INODE_INLINE;
+        write_inode_to_block(inumber, &inode);
+        return length;
+    }
+
+    uint32_t blocknum = 0;
+    uint32_t index = 0;
+    bool fresh = false;
+    if (!allocate_fragments(new_count, blocknum, index, fresh)) {
+        inode.Size = old_size;
+        write_inode_to_block(inumber, &inode);
+        return 0;
+    }
+
+    // 新分配的碎片块无需先读出
+    Block block{};
+    if (!fresh) {
+        read_block(cur_disk, blocknum, block.Data);
+    }
+    memcpy(block.Data + index * FRAGMENT_SIZE, buffer, inode.Size);
+    write_block(cur_disk, blocknum, block.Data);
+
+    release_small(inode, old_size);
+    inode.Direct[0] = blocknum;
+    inode.Valid |= INODE_FRAGMENT | (index << FRAGMENT_SHIFT);
+    write_inode_to_block(inumber, &inode);
+    return length;
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::unpack_small(Inode &inode, size_t old_size) {
+    Block block{};
+    uint32_t blocknum = 0;
+    if (old_size && !allocate_block(blocknum)) {
+        return false;
+    }
+
+    // 旧内容搬到独立的数据块中
+    read_small(inode, block.Data, old_size, 0);
+    release_small(inode, old_size);
+    if (old_size) {
+        write_block(cur_disk, blocknum, block.Data);
+        inode.Direct[0] = blocknum;
+    }
+    return true;
+}
+
+// Write to inode --------------------------------------------------------------
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::write(size_t inumber, char *data, size_t length, size_t offset) {
+    PROFILE_SCOPE("write");
+
+    // 不允许未挂载就操作
+    if (!cur_disk || !cur_disk->mounted()) {
+        return -1;
+    }
+
+    // Load inode
+    Inode inode{};
+    Block indirect{};
+    size_t num_bytes = 0;
+    size_t old_offset = offset;
+    size_t old_size = 0;
+
+    // 超过最大可能长度，分开比较以免相加溢出
+    const size_t max_file = (POINTERS_PER_BLOCK + POINTERS_PER_INODE) * BLOCK_SIZE;
+    if (offset > max_file || length > max_file - offset) {
+        return -1;
+    }
+    size_t max_size = length + offset;
+    alloc_group = group_of_inode(inumber);
+
+    if (!load_inode(inumber, &inode)) {
+        inode.Valid = true;
+        inode.Size = max_size;
+        for (uint32_t &i : inode.Direct) {
+            i = 0;
+        }
+        inode.Indirect = 0;
+        inode_counter[inumber / INODES_PER_BLOCK]++;
+        inodes_used++;
+        mark_used(inode_block(MetaData, inumber / INODES_PER_BLOCK));
+    } else {
+        // 重设inode大小
+        old_size = inode.Size;
+        inode.Size = std::max<size_t>(inode.Size, max_size);
+    }
+
+    // 小文件内联在inode中或打包进碎片块，超过上限时转换为普通布局
+    if (packed(inode) || !has_blocks(inode)) {
+        if (max_size <= FRAGMENT_LIMIT) {
+            return write_small(inumber, inode, old_size, data, length, offset);
+        }
+        if (!unpack_small(inode, old_size)) {
+            inode.Size = old_size;
+            write_inode_to_block(inumber, &inode);
+            return 0;
+        }
+    }
+
+    // 预分配的块第一次写入前，保证没写到的部分读出为零
+    settle_unwritten(inode, offset, length);
+
+    // Write block and copy to data
+    // 从直接索引开始写
+    if (offset < POINTERS_PER_INODE * BLOCK_SIZE) {
+        // 直接索引块下标
+        uint32_t direct_node = offset / BLOCK_SIZE;
+        offset %= BLOCK_SIZE;
+
+        // 尝试为直接索引分配块，若磁盘已满则直接返回，下同
+        if (!own_block(inode.Direct[direct_node])) {
+            inode.Size = old_size;
+            write_inode_to_block(inumber, &inode);
+            return num_bytes;
+        }
+        // 真实写入数据
+        write_data_to_block(offset, &num_bytes, length, data, inode.Direct[direct_node]);
+        direct_node++;
+
+        // 写入了足够数据
+        if (num_bytes == length) {
+            write_inode_to_block(inumber, &inode);
+            return length;
+        }
+
+        for (int i = direct_node; i < (int) POINTERS_PER_INODE; i++) {
+            // 之后的直接索引从0开始写
+            if (!own_block(inode.Direct[direct_node])) {
+                inode.Size = std::max(old_size, old_offset + num_bytes);
+                write_inode_to_block(inumber, &inode);
+                return num_bytes;
+            }
+            write_data_to_block(0, &num_bytes, length, data, inode.Direct[direct_node]);
+            direct_node++;
+
+            // 写入了足够数据
+            if (num_bytes == length) {
+                write_inode_to_block(inumber, &inode);
+                return length;
+            }
+        }
+
+        // 开始使用间接索引块，共享的间接索引块需要先复制
+        if (inode.Indirect) {
+            if (!own_block(inode.Indirect, true)) {
+                inode.Size = std::max(old_size, old_offset + num_bytes);
+                write_inode_to_block(inumber, &inode);
+                return num_bytes;
+            }
+            read_block(cur_disk, inode.Indirect, indirect.Data);
+        } else {
+            // 目前没有间接索引块，尝试分配
+            if (!allocate_block(inode.Indirect)) {
+                inode.Size = std::max(old_size, old_offset + num_bytes);
+                write_inode_to_block(inumber, &inode);
+                return num_bytes;
+            }
+            read_block(cur_disk, inode.Indirect, indirect.Data);
+
+            // 新创建的间接索引块，先全部置0
+            for (uint32_t &Pointer : indirect.Pointers) {
+                Pointer = 0;
+            }
+        }
+
+        for (uint32_t &Pointer : indirect.Pointers) {
+            // 尝试分配间接索引块指向的数据块
+            if (!own_block(Pointer)) {
+                inode.Size = std::max(old_size, old_offset + num_bytes);
+                write_block(cur_disk, inode.Indirect, indirect.Data);
+                write_inode_to_block(inumber, &inode);
+                return num_bytes;
+            }
+            write_data_to_block(0, &num_bytes, length, data, Pointer);
+
+
+            // 写入了足够数据
+            if (num_bytes == length) {
+                write_block(cur_disk, inode.Indirect, indirect.Data);
+                write_inode_to_block(inumber, &inode);
+                return length;
+            }
+        }
+
+        // 没有多余空间了
+        write_block(cur_disk, inode.Indirect, indirect.Data);
+        write_inode_to_block(inumber, &inode);
+        return num_bytes;
+    } else { // 从间接索引开始写
+        // 先去掉直接索引块的偏移量部分
+        offset -= POINTERS_PER_INODE * BLOCK_SIZE;
+        // 计算间接索引块下标
+        uint32_t indirect_node = offset / BLOCK_SIZE;
+        offset %= BLOCK_SIZE;
+
+        // 同上
+        if (inode.Indirect) {
+            if (!own_block(inode.Indirect, true)) {
+                inode.Size = old_size;
+                write_inode_to_block(inumber, &inode);
+                return num_bytes;
+            }
+            read_block(cur_disk, inode.Indirect, indirect.Data);
+        } else {
+            // 目前没有间接索引块，尝试分配
+            if (!allocate_block(inode.Indirect)) {
+                inode.Size = old_size;
+                write_inode_to_block(inumber, &inode);
+                return num_bytes;
+            }
+            read_block(cur_disk, inode.Indirect, indirect.Data);
+
+            // 新创建的间接索引块，先全部置0
+            for (uint32_t &Pointer : indirect.Pointers) {
+                Pointer = 0;
+            }
+        }
+
+        if (!own_block(indirect.Pointers[indirect_node])) {
+            inode.Size = old_size;
+            write_block(cur_disk, inode.Indirect, indirect.Data);
+            write_inode_to_block(inumber, &inode);
+            return num_bytes;
+        }
+        write_data_to_block(offset, &num_bytes, length, data, indirect.Pointers[indirect_node]);
+        indirect_node++;
+
+        // 写入了足够数据
+        if (num_bytes == length) {
+            write_block(cur_disk, inode.Indirect, indirect.Data);
+            write_inode_to_block(inumber, &inode);
+            return length;
+        }
+
+        for (int i = indirect_node; i < (int) POINTERS_PER_BLOCK; i++) {
+            // 尝试分配间接索引指向的块
+            if (!own_block(indirect.Pointers[i])) {
+                inode.Size = std::max(old_size, old_offset + num_bytes);
+                write_block(cur_disk, inode.Indirect, indirect.Data);
+                write_inode_to_block(inumber, &inode);
+                return num_bytes;
+            }
+            write_data_to_block(0, &num_bytes, length, data, indirect.Pointers[i]);
+
+            // 写入了足够数据
+            if (num_bytes == length) {
+                write_block(cur_disk, inode.Indirect, indirect.Data);
+                write_inode_to_block(inumber, &inode);
+                return length;
+            }
+        }
+
+        // 没有多余空间了
+        write_block(cur_disk, inode.Indirect, indirect.Data);
+        write_inode_to_block(inumber, &inode);
+        return num_bytes;
+    }
+}
+
+// Map file block to disk block ------------------------------------------------
+
+template <size_t BLOCK_BYTES>
+uint32_t BlockVolume<BLOCK_BYTES>::block_of(const Inode &inode, uint32_t index) {
+    if (index < POINTERS_PER_INODE) {
+        return inode.Direct[index];
+    }
+    index -= POINTERS_PER_INODE;
+    if (!inode.Indirect || index >= POINTERS_PER_BLOCK) {
+        return 0;
+    }
+    Block indirect{};
+    read_block(cur_disk, inode.Indirect, indirect.Data);
+    return indirect.Pointers[index];
+}
+
+// Directory helpers -----------------------------------------------------------
+
+// FNV-1a 哈希
+static uint32_t hash_name(const std::string &name) {
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : name) {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// 将路径拆分为各级名字，忽略多余的 '/'
+static std::vector<std::string> split_path(const std::string &path) {
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find('/', start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        if (end > start) {
+            parts.push_back(path.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return parts;
+}
+
+static bool valid_name(const std::string &name) {
+    return !name.empty() && name.size() <= Volume::NAME_LENGTH && name != "." && name != "..";
+}
+
+static bool entry_matches(const char *entry, const std::string &name) {
+    return strnlen(entry, Volume::NAME_LENGTH) == name.size() && !memcmp(entry, name.data(), name.size());
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::init_directory(size_t inumber, size_t parent) {
+    // 空目录只有一个块：0号槽位存放目录头
+    Block block{};
+    block.Header.Parent = (uint32_t) parent;
+    if (write(inumber, block.Data, BLOCK_SIZE, 0) != (ssize_t) BLOCK_SIZE) {
+        return false;
+    }
+
+    Inode inode{};
+    if (!load_inode(inumber, &inode)) {
+        return false;
+    }
+    inode.Valid |= INODE_DIRECTORY;
+    write_inode_to_block(inumber, &inode);
+    return true;
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::ensure_root() {
+    if (!cur_disk || !cur_disk->mounted()) {
+        return false;
+    }
+    if (MetaData.Features & FEATURE_DIRECTORIES) {
+        return true;
+    }
+
+    ssize_t root = create();
+    if (root < 0) {
+        return false;
+    }
+    if (!init_directory(root, root)) {
+        remove(root);
+        return false;
+    }
+
+    Block block{};
+    read_block(cur_disk, 0, block.Data);
+    block.Super.Features |= FEATURE_DIRECTORIES;
+    block.Super.RootInode = (uint32_t) root;
+    write_block(cur_disk, 0, block.Data);
+    MetaData = block.Super;
+    return true;
+}
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::dir_lookup(size_t dir, const std::string &name) {
+    std::string key = std::to_string(dir) + '/' + name;
+    auto cached = dentry_cache.find(key);
+    if (cached != dentry_cache.end()) {
+        return cached->second;
+    }
+
+    Inode inode{};
+    if (!load_inode(dir, &inode) || !(inode.Valid & INODE_DIRECTORY)) {
+        return -1;
+    }
+
+    Block block{};
+    if (name == "." || name == "..") {
+        if (name == ".") {
+            return dir;
+        }
+        read_block(cur_disk, inode.Direct[0], block.Data);
+        return block.Header.Parent;
+    }
+
+    // 线性探测，遇到空槽位即不存在
+    uint32_t slots = inode.Size / sizeof(DirEntry);
+    uint32_t slot = hash_name(name) & (slots - 1);
+    int64_t loaded = -1;
+    for (uint32_t n = 0; n < slots; n++, slot = (slot + 1) & (slots - 1)) {
+        if (slot == 0) {
+            continue;
+        }
+        if ((int64_t) (slot / ENTRIES_PER_BLOCK) != loaded) {
+            loaded = slot / ENTRIES_PER_BLOCK;
+            read_block(cur_disk, block_of(inode, loaded), block.Data);
+        }
+        DirEntry &entry = block.Entries[slot % ENTRIES_PER_BLOCK];
+        if (entry.Type == ENTRY_FREE) {
+            break;
+        }
+        if (entry.Type != ENTRY_DELETED && entry_matches(entry.Name, name)) {
+            if (dentry_cache.size() >= DENTRY_CACHE_SIZE) {
+                dentry_cache.clear();
+            }
+            dentry_cache[key] = entry.Inumber;
+            return entry.Inumber;
+        }
+    }
+    return -1;
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::dir_rehash(size_t dir, Inode &inode, uint32_t slots) {
+    // 读出全部有效目录项，按新的槽位数重新散列后整体写回
+    uint32_t old_slots = inode.Size / sizeof(DirEntry);
+
+    // 先确认空闲块足够，避免写到一半时磁盘已满
+    size_t needed = (slots - old_slots) / ENTRIES_PER_BLOCK;
+    if (old_slots / ENTRIES_PER_BLOCK <= POINTERS_PER_INODE && slots / ENTRIES_PER_BLOCK > POINTERS_PER_INODE) {
+        needed++;
+    }
+    size_t available = free_blocks();
+    if (needed > available) {
+        return false;
+    }
+
+    std::vector<DirEntry> table(slots);
+    Block block{};
+    read_block(cur_disk, inode.Direct[0], block.Data);
+    DirHeader header = block.Header;
+    header.Tombstones = 0;
+
+    for (uint32_t b = 0; b < old_slots / ENTRIES_PER_BLOCK; b++) {
+        read_block(cur_disk, block_of(inode, b), block.Data);
+        for (uint32_t k = (b == 0); k < ENTRIES_PER_BLOCK; k++) {
+            DirEntry &entry = block.Entries[k];
+            if (entry.Type != ENTRY_FILE && entry.Type != ENTRY_DIRECTORY) {
+                continue;
+            }
+            std::string name(entry.Name, strnlen(entry.Name, NAME_LENGTH));
+            uint32_t slot = hash_name(name) & (slots - 1);
+            while (slot == 0 || table[slot].Type != ENTRY_FREE) {
+                slot = (slot + 1) & (slots - 1);
+            }
+            table[slot] = entry;
+        }
+    }
+    memcpy(&table[0], &header, sizeof(DirHeader));
+
+    size_t length = slots * sizeof(DirEntry);
+    if (write(dir, (char *) table.data(), length, 0) != (ssize_t) length) {
+        return false;
+    }
+    return load_inode(dir, &inode);
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::dir_insert(size_t dir, const std::string &name, size_t inumber, uint8_t type) {
+    Inode inode{};
+    if (!valid_name(name) || !load_inode(dir, &inode) || !(inode.Valid & INODE_DIRECTORY)) {
+        return false;
+    }
+
+    Block header{};
+    read_block(cur_disk, inode.Direct[0], header.Data);
+
+    // 装载因子超过7/8时扩容(或仅清理墓碑)，保证探测序列较短
+    uint32_t slots = inode.Size / sizeof(DirEntry);
+    if ((header.Header.Entries + header.Header.Tombstones + 2) * 8 > slots * 7) {
+        uint32_t new_slots = slots;
+        while ((header.Header.Entries + 2) * 2 > new_slots && new_slots < DIRECTORY_MAX_SLOTS) {
+            new_slots *= 2;
+        }
+        if (new_slots != slots || header.Header.Tombstones) {
+            if (!dir_rehash(dir, inode, new_slots)) {
+                return false;
+            }
+            slots = new_slots;
+            read_block(cur_disk, inode.Direct[0], header.Data);
+        }
+    }
+    if (header.Header.Entries + 2 > slots) {
+        return false;
+    }
+
+    // 探测整条序列以确认名字不存在，同时记下第一个可复用槽位
+    Block block{};
+    int64_t loaded = -1;
+    int64_t target = -1;
+    uint32_t slot = hash_name(name) & (slots - 1);
+    for (uint32_t n = 0; n < slots; n++, slot = (slot + 1) & (slots - 1)) {
+        if (slot == 0) {
+            continue;
+        }
+        if ((int64_t) (slot / ENTRIES_PER_BLOCK) != loaded) {
+            loaded = slot / ENTRIES_PER_BLOCK;
+            read_block(cur_disk, block_of(inode, loaded), block.Data);
+        }
+        DirEntry &entry = block.Entries[slot % ENTRIES_PER_BLOCK];
+        if (entry.Type == ENTRY_DELETED) {
+            if (target < 0) {
+                target = slot;
+            }
+            continue;
+        }
+        if (entry.Type == ENTRY_FREE) {
+            if (target < 0) {
+                target = slot;
+            }
+            break;
+        }
+        if (entry_matches(entry.Name, name)) {
+            return false;
+        }
+    }
+    if (target < 0) {
+        return false;
+    }
+
+    uint32_t blocknum = block_of(inode, target / ENTRIES_PER_BLOCK);
+    if ((int64_t) (target / ENTRIES_PER_BLOCK) != loaded) {
+        read_block(cur_disk, blocknum, block.Data);
+    }
+    DirEntry &entry = block.Entries[target % ENTRIES_PER_BLOCK];
+    if (entry.Type == ENTRY_DELETED) {
+        header.Header.Tombstones--;
+    }
+    header.Header.Entries++;
+    entry.Inumber = (uint32_t) inumber;
+    entry.Type = type;
+    memset(entry.Name, 0, NAME_LENGTH);
+    memcpy(entry.Name, name.data(), name.size());
+
+    // 目录项与目录头在同一块时只写一次
+    if (blocknum == inode.Direct[0]) {
+        block.Header = header.Header;
+    } else {
+        write_block(cur_disk, inode.Direct[0], header.Data);
+    }
+    write_block(cur_disk, blocknum, block.Data);
+    return true;
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::dir_erase(size_t dir, const std::string &name) {
+    Inode inode{};
+    if (!load_inode(dir, &inode) || !(inode.Valid & INODE_DIRECTORY)) {
+        return false;
+    }
+
+    Block block{};
+    uint32_t slots = inode.Size / sizeof(DirEntry);
+    uint32_t slot = hash_name(name) & (slots - 1);
+    int64_t loaded = -1;
+    for (uint32_t n = 0; n < slots; n++, slot = (slot + 1) & (slots - 1)) {
+        if (slot == 0) {
+            continue;
+        }
+        if ((int64_t) (slot / ENTRIES_PER_BLOCK) != loaded) {
+            loaded = slot / ENTRIES_PER_BLOCK;
+            read_block(cur_disk, block_of(inode, loaded), block.Data);
+        }
+        DirEntry &entry = block.Entries[slot % ENTRIES_PER_BLOCK];
+        if (entry.Type == ENTRY_FREE) {
+            return false;
+        }
+        if (entry.Type == ENTRY_DELETED || !entry_matches(entry.Name, name)) {
+            continue;
+        }
+
+        // 删除的槽位置为墓碑，保持探测序列连续
+        entry.Type = ENTRY_DELETED;
+        dentry_cache.erase(std::to_string(dir) + '/' + name);
+        if (loaded == 0) {
+            block.Header.Entries--;
+            block.Header.Tombstones++;
+        } else {
+            Block header{};
+            read_block(cur_disk, inode.Direct[0], header.Data);
+            header.Header.Entries--;
+            header.Header.Tombstones++;
+            write_block(cur_disk, inode.Direct[0], header.Data);
+        }
+        write_block(cur_disk, block_of(inode, loaded), block.Data);
+        return true;
+    }
+    return false;
+}
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::resolve(const std::string &path) {
+    // 查找不改动磁盘：还没有根目录的旧镜像上什么也找不到
+    if (!cur_disk || !cur_disk->mounted() || !(MetaData.Features & FEATURE_DIRECTORIES)) {
+        return -1;
+    }
+
+    ssize_t inumber = MetaData.RootInode;
+    for (const std::string &name : split_path(path)) {
+        inumber = dir_lookup(inumber, name);
+        if (inumber < 0) {
+            return -1;
+        }
+    }
+    return inumber;
+}
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::resolve_parent(const std::string &path, std::string &name) {
+    std::vector<std::string> parts = split_path(path);
+    if (parts.empty() || !valid_name(parts.back())) {
+        return -1;
+    }
+    name = parts.back();
+
+    size_t slash = path.find_last_of('/', path.find_last_not_of('/'));
+    return resolve(slash == std::string::npos ? "" : path.substr(0, slash));
+}
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::create_at(const char *path, bool directory) {
+    // 旧镜像第一次按路径创建时才建立根目录
+    if (!ensure_root()) {
+        return -1;
+    }
+    std::string name;
+    ssize_t parent = resolve_parent(path, name);
+    if (parent < 0 || dir_lookup(parent, name) >= 0) {
+        return -1;
+    }
+
+    ssize_t inumber = create();
+    if (inumber < 0) {
+        return -1;
+    }
+    if (directory && !init_directory(inumber, parent)) {
+        remove(inumber);
+        return -1;
+    }
+    if (!dir_insert(parent, name, inumber, directory ? ENTRY_DIRECTORY : ENTRY_FILE)) {
+        remove(inumber);
+        return -1;
+    }
+    return inumber;
+}
+
+// Path based interface --------------------------------------------------------
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::open(const char *path) {
+    return resolve(path);
+}
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::create(const char *path) {
+    return create_at(path, false);
+}
+
+template <size_t BLOCK_BYTES>
+ssize_t BlockVolume<BLOCK_BYTES>::mkdir(const char *path) {
+    return create_at(path, true);
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::unlink(const char *path) {
+    std::string name;
+    ssize_t parent = resolve_parent(path, name);
+    if (parent < 0) {
+        return false;
+    }
+    ssize_t inumber = dir_lookup(parent, name);
+    if (inumber < 0) {
+        return false;
+    }
+
+    // 只允许删除空目录
+    Inode inode{};
+    if (load_inode(inumber, &inode) && (inode.Valid & INODE_DIRECTORY)) {
+        Block block{};
+        read_block(cur_disk, inode.Direct[0], block.Data);
+        if (block.Header.Entries) {
+            return false;
+        }
+    }
+
+    return dir_erase(parent, name) && remove(inumber);
+}
+
+template <size_t BLOCK_BYTES>
+bool BlockVolume<BLOCK_BYTES>::list(const char *path, std::vector<DirectoryEntry> &entries) {
+    ssize_t dir = resolve(path);
+    Inode inode{};
+    if (dir < 0 || !load_inode(dir, &inode) || !(inode.Valid & INODE_DIRECTORY)) {
+        return false;
+    }
+
+    Block block{};
+    uint32_t slots = inode.Size / sizeof(DirEntry);
+    for (uint32_t b = 0; b < slots / ENTRIES_PER_BLOCK; b++) {
+        read_block(cur_disk, block_of(inode, b), block.Data);
+        for (uint32_t k = (b == 0); k < ENTRIES_PER_BLOCK; k++) {
+            DirEntry &entry = block.Entries[k];
+            if (entry.Type != ENTRY_FILE && entry.Type != ENTRY_DIRECTORY) {
+                continue;
+            }
+            entries.push_back({std::string(entry.Name, strnlen(entry.Name, NAME_LENGTH)), entry.Inumber,
+                               entry.Type == ENTRY_DIRECTORY});
+        }
+    }
+
+    // 按名字排序，输出与散列顺序无关
+    std::sort(entries.begin(), entries.end(), [](const DirectoryEntry &a, const DirectoryEntry &b) {
+        return a.Name < b.Name;
+    });
+    return true;
+}
+
+// Supported geometries ---------------------------------------------------------
+
+template class BlockVolume<4096>;
+template class BlockVolume<8192>;
+template class BlockVolume<16384>;
+template class BlockVolume<32768>;
+template class BlockVolume<65536>;
+
+// File system front end --------------------------------------------------------
+
+size_t FileSystem::block_size_of(const Volume::SuperBlock &super) {
+    if (super.MagicNumber != Volume::MAGIC_NUMBER) {
+        return 0;
+    }
+    // 旧镜像中没有记录块大小
+    return super.BlockSize ? super.BlockSize : Disk::BLOCK_SIZE;
+}
+
+Volume *FileSystem::make_volume(size_t block_size) {
+    switch (block_size) {
+        case 4096:  return new BlockVolume<4096>();
+        case 8192:  return new BlockVolume<8192>();
+        case 16384: return new BlockVolume<16384>();
+        case 32768: return new BlockVolume<32768>();
+        case 65536: return new BlockVolume<65536>();
+        default:    return NULL;
+    }
+}
+
+void FileSystem::debug(Disk *disk) {
+    Volume::SuperBlock super;
+    Volume::read_super(disk, super);
+
+    // 日志结构卷先打印日志，再打印日志之上的文件系统
+    if (super.MagicNumber == LogDisk::LOG_MAGIC) {
+        LogDisk::debug(disk);
+        // 已挂载的日志不能再次打开，经由挂载的日志读取，还能看到尚未写回的块
+        if (log && log->base() == disk) {
+            debug(log.get());
+            return;
+        }
+        LogDisk opened;
+        if (opened.open(disk)) {
+            debug(&opened);
+        }
+        return;
+    }
+
+    switch (block_size_of(super)) {
+        case 8192:  BlockVolume<8192>::debug(disk, super); break;
+        case 16384: BlockVolume<16384>::debug(disk, super); break;
+        case 32768: BlockVolume<32768>::debug(disk, super); break;
+        case 65536: BlockVolume<65536>::debug(disk, super); break;
+        default:    BlockVolume<4096>::debug(disk, super); break;
+    }
+}
+
+bool FileSystem::format(Disk *disk, size_t block_size, uint32_t inode_percent, bool logged) {
+    if (inode_percent < 1 || inode_percent > 50) {
+        return false;
+    }
+    if (logged) {
+        // 块大小不支持时不要先清掉磁盘
+        std::unique_ptr<Volume> supported(make_volume(block_size));
+        LogDisk log;
+        return supported && LogDisk::format(disk) && log.open(disk) && format(&log, block_size, inode_percent);
+    }
+    switch (block_size) {
+        case 4096:  return BlockVolume<4096>::format(disk, inode_percent);
+        case 8192:  return BlockVolume<8192>::format(disk, inode_percent);
+        case 16384: return BlockVolume<16384>::format(disk, inode_percent);
+        case 32768: return BlockVolume<32768>::format(disk, inode_percent);
+        case 65536: return BlockVolume<65536>::format(disk, inode_percent);
+        default:    return false;
+    }
+}
+
+bool FileSystem::mount(Disk *disk) {
+    // 若已挂载则不处理
+    if (disk->mounted()) {
+        return false;
+    }
+
+    // 超级块只读一次，按其中记录的块大小选择实现
+    Volume::SuperBlock super;
+    Volume::read_super(disk, super);
+
+    // 日志结构卷挂载在日志提供的逻辑盘上
+    std::unique_ptr<LogDisk> opened;
+    if (super.MagicNumber == LogDisk::LOG_MAGIC) {
+        opened.reset(new LogDisk());
+        if (!opened->open(disk)) {
+            return false;
+        }
+        disk = opened.get();
+        Volume::read_super(disk, super);
+    }
+    std::unique_ptr<Volume> mounted(make_volume(block_size_of(super)));
+    if (!mounted || !mounted->mount(disk, super)) {
+        return false;
+    }
+    mounted->set_discard(discard_mode);
+    volume = std::move(mounted);
+    log = std::move(opened);
+    device = disk;
+    return true;
+}
+
+template <typename Operation>
+auto FileSystem::batch(Operation operation) -> decltype(operation()) {
+    device->begin_batch();
+    try {
+        auto result = operation();
+        device->end_batch();
+        return result;
+    } catch (...) {
+        // 出错前排队的请求也要完成，再抛出原来的异常；
+        // 写失败的块仍留在队列里，下次flush时重试
+        try {
+            device->end_batch();
+        } catch (std::exception &e) {
+            fprintf(stderr, "%s\n", e.what());
+        }
+        throw;
+    }
+}
+
+ssize_t FileSystem::create() {
+    return volume ? batch([&] { return volume->create(); }) : -1;
+}
+
+bool FileSystem::remove(size_t inumber) {
+    return volume && batch([&] { return volume->remove(inumber); });
+}
+
+ssize_t FileSystem::stat(size_t inumber) {
+    return volume ? volume->stat(inumber) : -1;
+}
+
+ssize_t FileSystem::read(size_t inumber, char *data, size_t length, size_t offset) {
+    return volume ? batch([&] { return volume->read(inumber, data, length, offset); }) : -1;
+}
+
+ssize_t FileSystem::write(size_t inumber, char *data, size_t length, size_t offset) {
+    return volume ? batch([&] { return volume->write(inumber, data, length, offset); }) : -1;
+}
+
+std::unique_ptr<FileView> FileSystem::map(size_t inumber) {
+    std::unique_ptr<FileView> view(new FileView());
+    if (!volume || !volume->map(inumber, *view)) {
+        return nullptr;
+    }
+    return view;
+}
+
+size_t FileSystem::create_many(size_t count, std::vector<size_t> &inumbers) {
+    inumbers.clear();
+    return volume ? batch([&] { return volume->create_many(count, inumbers); }) : 0;
+}
+
+void FileSystem::stat_many(const std::vector<size_t> &inumbers, std::vector<ssize_t> &sizes) {
+    if (volume) {
+        volume->stat_many(inumbers, sizes);
+    } else {
+        sizes.assign(inumbers.size(), -1);
+    }
+}
+
+size_t FileSystem::remove_many(const std::vector<size_t> &inumbers) {
+    return volume ? batch([&] { return volume->remove_many(inumbers); }) : 0;
+}
+
+ssize_t FileSystem::clone(size_t inumber) {
+    return volume ? batch([&] { return volume->clone(inumber); }) : -1;
+}
+
+ssize_t FileSystem::copy_range(size_t src, size_t src_offset, size_t dst, size_t dst_offset, size_t length) {
+    return volume ? batch([&] { return volume->copy_range(src, src_offset, dst, dst_offset, length); }) : -1;
+}
+
+ssize_t FileSystem::splice_in(size_t inumber, size_t offset, int fd, off_t fd_offset, size_t length) {
+    return volume ? batch([&] { return volume->splice_in(inumber, offset, fd, fd_offset, length); }) : -1;
+}
+
+ssize_t FileSystem::splice_out(size_t inumber, size_t offset, int fd, off_t fd_offset, size_t length) {
+    return volume ? batch([&] { return volume->splice_out(inumber, offset, fd, fd_offset, length); }) : -1;
+}
+
+bool FileSystem::statfs(StatFS &stats) {
+    return volume && volume->statfs(stats);
+}
+
+ssize_t FileSystem::defrag(size_t budget) {
+    return volume ? batch([&] { return volume->defrag(budget); }) : -1;
+}
+
+ssize_t FileSystem::extents(size_t inumber) {
+    return volume ? volume->extents(inumber) : -1;
+}
+
+bool FileSystem::fallocate(size_t inumber, size_t offset, size_t length) {
+    return volume && batch([&] { return volume->fallocate(inumber, offset, length); });
+}
+
+bool FileSystem::grow(size_t blocks, bool inodes) {
+    return volume && batch([&] { return volume->grow(blocks, inodes); });
+}
+
+ssize_t FileSystem::clean(size_t budget) {
+    return volume && log ? log->clean(budget) : -1;
+}
+
+void FileSystem::set_discard(bool enabled) {
+    // 挂载前设置的模式在挂载时生效
+    discard_mode = enabled;
+    if (volume) {
+        volume->set_discard(enabled);
+    }
+}
+
+ssize_t FileSystem::trim() {
+    return volume ? batch([&] { return volume->trim(); }) : -1;
+}
+
+ssize_t FileSystem::open(const char *path) {
+    return volume ? volume->open(path) : -1;
+}
+
+ssize_t FileSystem::create(const char *path) {
+    return volume ? batch([&] { return volume->create(path); }) : -1;
+}
+
+ssize_t FileSystem::mkdir(const char *path) {
+    return volume ? batch([&] { return volume->mkdir(path); }) : -1;
+}
+
+bool FileSystem::unlink(const char *path) {
+    return volume && batch([&] { return volume->unlink(path); });
+}
+
+bool FileSystem::list(const char *path, std::vector<DirectoryEntry> &entries) {
+    return volume && volume->list(path, entries);
 }
@@ -0,0 +1,491 @@
+// log_disk.cpp: log-structured block layer over a disk
+
+#include "sfs/log_disk.h"
+#include "sfs/profile.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <stdio.h>
+#include <string.h>
+
+const uint32_t LogDisk::LOG_MAGIC;
+const uint32_t LogDisk::SEGMENT_BLOCKS;
+const size_t LogDisk::CHECKPOINT_SEGMENTS;
+const size_t LogDisk::RESERVE_SEGMENTS;
+const uint64_t LogDisk::NONE;
+
+// 每个映射块保存的表项数
+static const size_t MAP_ENTRIES = Disk::BLOCK_SIZE / sizeof(uint64_t);
+
+bool LogDisk::layout(size_t blocks, SuperBlock &geometry) {
+    // 逻辑块数小于物理块数，按物理块数估计映射表大小
+    uint64_t map_blocks = (blocks + MAP_ENTRIES - 1) / MAP_ENTRIES;
+    uint64_t start = 1 + 2 * (1 + map_blocks);
+    if (blocks <= start) {
+    	return false;
+    }
+
+    // 小盘缩短段长，保证有足够多的段可供清理
+    uint32_t segment_blocks = SEGMENT_BLOCKS;
+    while (segment_blocks > 8 && (blocks - start) / segment_blocks < 32) {
+    	segment_blocks /= 2;
+    }
+    uint64_t segments = (blocks - start) / segment_blocks;
+    uint64_t reserve = std::max<uint64_t>(RESERVE_SEGMENTS, segments / 10);
+    if (segments <= reserve + 1) {
+    	return false;
+    }
+
+    geometry.MagicNumber   = LOG_MAGIC;
+    geometry.SegmentBlocks = segment_blocks;
+    geometry.Segments	   = segments;
+    geometry.Blocks	   = (segments - reserve) * (segment_blocks - 1);
+    geometry.MapBlocks	   = map_blocks;
+    return true;
+}
+
+uint32_t LogDisk::checksum(const std::vector<uint64_t> &map) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint64_t entry : map) {
+    	for (int shift = 0; shift < 64; shift += 8) {
+    	    hash = (hash ^ ((entry >> shift) & 0xff)) * 16777619u;
+	}
+    }
+    return hash;
+}
+
+bool LogDisk::format(Disk *disk) {
+    SuperBlock geometry;
+    if (disk->mounted() || !layout(disk->size(), geometry)) {
+    	return false;
+    }
+
+    // 清零后映射表全为零，过去的段摘要也不会被前滚
+    disk->zero_blocks(0, disk->size());
+
+    std::vector<char> block(BLOCK_SIZE, 0);
+    memcpy(block.data(), &geometry, sizeof(geometry));
+    disk->write(0, block.data());
+
+    // 第一个检查点：所有逻辑块都未写过
+    std::vector<uint64_t> map(geometry.MapBlocks * MAP_ENTRIES, 0);
+    Checkpoint checkpoint{LOG_MAGIC, checksum(map), 1, 0, 0};
+    memset(block.data(), 0, BLOCK_SIZE);
+    memcpy(block.data(), &checkpoint, sizeof(checkpoint));
+    disk->write(1 + (1 + geometry.MapBlocks), block.data());
+    return true;
+}
+
+void LogDisk::debug(Disk *disk) {
+    std::vector<char> block(BLOCK_SIZE);
+    SuperBlock super;
+    disk->read(0, block.data());
+    memcpy(&super, block.data(), sizeof(super));
+
+    printf("Log:\n");
+    if (super.MagicNumber != LOG_MAGIC) {
+    	printf("    magic number is invalid\n");
+    	return;
+    }
+    printf("    magic number is valid\n");
+    printf("    %lu segments of %u blocks\n", super.Segments, super.SegmentBlocks);
+    printf("    %lu logical blocks\n", super.Blocks);
+
+    for (uint64_t region = 0; region < 2; region++) {
+    	Checkpoint checkpoint;
+    	disk->read(1 + region * (1 + super.MapBlocks), block.data());
+    	memcpy(&checkpoint, block.data(), sizeof(checkpoint));
+    	if (checkpoint.MagicNumber == LOG_MAGIC) {
+    	    printf("    checkpoint %lu after segment %lu\n", checkpoint.Generation, checkpoint.Sequence);
+	}
+    }
+}
+
+bool LogDisk::open(Disk *disk) {
+    if (Base || disk->mounted()) {
+    	return false;
+    }
+
+    std::vector<char> block(BLOCK_SIZE);
+    disk->read(0, block.data());
+    memcpy(&Geometry, block.data(), sizeof(Geometry));
+    if (Geometry.MagicNumber != LOG_MAGIC || Geometry.SegmentBlocks < 2 || Geometry.SegmentBlocks > MAP_ENTRIES - 1) {
+    	return false;
+    }
+
+    Start = 1 + 2 * (1 + Geometry.MapBlocks);
+    if (Start + Geometry.Segments * Geometry.SegmentBlocks > disk->size() ||
+    	Geometry.Blocks > Geometry.MapBlocks * MAP_ENTRIES) {
+    	return false;
+    }
+
+    Base   = disk;
+    Blocks = Geometry.Blocks;
+    free(Buffer);
+    if (posix_memalign((void **) &Buffer, BLOCK_SIZE, Geometry.SegmentBlocks * BLOCK_SIZE) != 0) {
+    	throw std::bad_alloc();
+    }
+    if (!recover()) {
+    	Base = NULL;
+    	return false;
+    }
+
+    // 前滚过的段要先记入检查点，之后才能复用空出来的段
+    disk->mount();
+    if (Dirty) {
+    	checkpoint();
+    }
+    return true;
+}
+
+bool LogDisk::recover() {
+    static_assert(sizeof(Summary) == BLOCK_SIZE, "segment summary must fill a block");
+    std::vector<char> block(BLOCK_SIZE);
+    Checkpoint best{};
+    Checkpoint checkpoint;
+
+    // 取两个区域中有效且较新的检查点
+    for (uint64_t generation = 0; generation < 2; generation++) {
+    	Base->read(region(generation), block.data());
+    	memcpy(&checkpoint, block.data(), sizeof(checkpoint));
+    	if (checkpoint.MagicNumber != LOG_MAGIC || checkpoint.Generation % 2 != generation ||
+    	    checkpoint.Generation <= best.Generation) {
+    	    continue;
+	}
+
+    	std::vector<uint64_t> map(Geometry.MapBlocks * MAP_ENTRIES);
+    	Base->read_blocks(region(generation) + 1, Geometry.MapBlocks, (char *) map.data());
+    	if (checksum(map) != checkpoint.Checksum) {
+    	    continue;
+	}
+    	best = checkpoint;
+    	Map.swap(map);
+    }
+    if (!best.Generation) {
+    	return false;
+    }
+
+    Generation = best.Generation;
+    Sequence   = best.Sequence;
+    Stale[Generation % 2].assign(Geometry.MapBlocks, false);
+    Stale[(Generation + 1) % 2].assign(Geometry.MapBlocks, true);
+
+    // 从检查点记下的段开始，沿摘要中的指针前滚之后写出的段
+    size_t rolled = 0;
+    Summary summary;
+    Next = best.Head;
+    while (Next < Geometry.Segments) {
+    	Base->read(segment_start(Next), (char *) &summary);
+    	if (summary.MagicNumber != LOG_MAGIC || summary.Sequence != Sequence + 1 || summary.Count >= Geometry.SegmentBlocks) {
+    	    break;
+	}
+    	for (uint32_t i = 0; i < summary.Count; i++) {
+    	    if (summary.Logical[i] < Geometry.Blocks) {
+    	    	Map[summary.Logical[i]] = segment_start(Next) + 1 + i;
+	    }
+	}
+    	Sequence = summary.Sequence;
+    	Cursor	 = Next;
+    	Next	 = summary.Following;
+    	rolled++;
+    }
+
+    // 由映射表重建每个段的存活块
+    Owner.assign(Geometry.Segments * Geometry.SegmentBlocks, NONE);
+    Live.assign(Geometry.Segments, 0);
+    for (size_t blocknum = 0; blocknum < Geometry.Blocks; blocknum++) {
+    	uint64_t physical = Map[blocknum];
+    	if (!physical) {
+    	    continue;
+	}
+    	uint64_t slot = physical - Start;
+    	if (physical < Start || slot >= Owner.size() || slot % Geometry.SegmentBlocks == 0 || Owner[slot] != NONE) {
+    	    return false;
+	}
+    	Owner[slot] = blocknum;
+    	Live[slot / Geometry.SegmentBlocks]++;
+    }
+    States.assign(Geometry.Segments, FREE);
+    for (size_t segment = 0; segment < Geometry.Segments; segment++) {
+    	if (Live[segment]) {
+    	    States[segment] = USED;
+	}
+    }
+    if (Next >= Geometry.Segments || States[Next] != FREE) {
+    	Next = NONE;
+    }
+
+    Dirty = rolled > 0;
+    if (Dirty) {
+    	Stale[0].assign(Geometry.MapBlocks, true);
+    	Stale[1].assign(Geometry.MapBlocks, true);
+    }
+    return true;
+}
+
+LogDisk::~LogDisk() {
+    // 析构函数不能抛出异常，写不出去的段在下次打开时丢失
+    if (Base) {
+    	try {
+    	    sync();
+	} catch (std::exception &e) {
+    	    fprintf(stderr, "%s\n", e.what());
+	}
+    	Base->unmount();
+    	Base = NULL;
+    }
+    free(Buffer);
+}
+
+size_t LogDisk::available() const {
+    size_t count = 0;
+    for (State state : States) {
+    	count += state == FREE || state == PENDING;
+    }
+    return count;
+}
+
+void LogDisk::release(uint64_t physical) {
+    uint64_t slot = physical - Start;
+    size_t segment = slot / Geometry.SegmentBlocks;
+    Owner[slot] = NONE;
+    Live[segment]--;
+    if (!Live[segment] && States[segment] == USED) {
+    	States[segment] = PENDING;
+    }
+}
+
+void LogDisk::remap(size_t blocknum, uint64_t physical) {
+    if (Map[blocknum]) {
+    	release(Map[blocknum]);
+    }
+    Map[blocknum] = physical;
+    if (physical) {
+    	uint64_t slot = physical - Start;
+    	Owner[slot] = blocknum;
+    	Live[slot / Geometry.SegmentBlocks]++;
+    }
+    Stale[0][blocknum / MAP_ENTRIES] = true;
+    Stale[1][blocknum / MAP_ENTRIES] = true;
+    Dirty = true;
+}
+
+void LogDisk::reserve(bool pending) {
+    if (Next != NONE) {
+    	return;
+    }
+
+    // 从上次打开的段往后找，日志尽量顺序推进
+    for (size_t i = 1; i <= Geometry.Segments; i++) {
+    	size_t segment = (Cursor + i) % Geometry.Segments;
+    	if (States[segment] == FREE || (pending && States[segment] == PENDING)) {
+    	    Next = segment;
+    	    return;
+	}
+    }
+}
+
+void LogDisk::open_segment() {
+    // 没有预留段时由检查点预留并记下，空出来的段也在检查点之后才能复用
+    if (Next == NONE) {
+    	checkpoint();
+    }
+    if (Next == NONE) {
+    	throw std::runtime_error("log is full!");
+    }
+
+    States[Next] = CURRENT;
+    Current = Cursor = Next;
+    Next    = NONE;
+    Fill    = 1;
+    memset(Buffer, 0, BLOCK_SIZE);
+}
+
+void LogDisk::append(size_t blocknum, const char *data) {
+    // 空闲段不足时先在前台清理
+    if (Current == NONE && !Cleaning) {
+    	while (available() < 2 && clean_one(Geometry.SegmentBlocks - 2)) {
+	}
+    }
+    if (Current == NONE) {
+    	open_segment();
+    }
+
+    Summary *summary = (Summary *) Buffer;
+    memcpy(Buffer + Fill * BLOCK_SIZE, data, BLOCK_SIZE);
+    summary->Logical[Fill - 1] = blocknum;
+    remap(blocknum, segment_start(Current) + Fill);
+    if (++Fill == Geometry.SegmentBlocks) {
+    	write_segment();
+    }
+}
+
+void LogDisk::write_segment() {
+    if (Current == NONE) {
+    	return;
+    }
+
+    size_t segment = Current;
+    Current = NONE;
+    if (Fill == 1) {
+    	// 前一段或检查点已经指向该段，仍然预留给下一次写入
+    	States[segment] = FREE;
+    	Next = segment;
+    	return;
+    }
+
+    // 摘要和数据一次顺序写出，摘要中记下之后要写的段
+    reserve(false);
+    Summary *summary = (Summary *) Buffer;
+    summary->MagicNumber = LOG_MAGIC;
+    summary->Count	 = Fill - 1;
+    summary->Sequence	 = ++Sequence;
+    summary->Following	 = Next;
+    Base->write_blocks(segment_start(segment), Fill, Buffer);
+
+    States[segment] = Live[segment] ? USED : PENDING;
+    if (++Flushed >= CHECKPOINT_SEGMENTS || Next == NONE) {
+    	checkpoint();
+    }
+}
+
+void LogDisk::checkpoint() {
+    PROFILE_SCOPE("LogDisk::checkpoint");
+    Generation++;
+    reserve(true);
+    std::vector<bool> &stale = Stale[Generation % 2];
+
+    // 只写出该区域上次写入后变化过的映射块，最后写检查点头
+    for (size_t first = 0; first < Geometry.MapBlocks;) {
+    	if (!stale[first]) {
+    	    first++;
+    	    continue;
+	}
+    	size_t last = first;
+    	while (last < Geometry.MapBlocks && stale[last]) {
+    	    stale[last++] = false;
+	}
+    	Base->write_blocks(region(Generation) + 1 + first, last - first, (char *) &Map[first * MAP_ENTRIES]);
+    	first = last;
+    }
+
+    std::vector<char> block(BLOCK_SIZE, 0);
+    Checkpoint checkpoint{LOG_MAGIC, checksum(Map), Generation, Sequence, Next};
+    memcpy(block.data(), &checkpoint, sizeof(checkpoint));
+    Base->write(region(Generation), block.data());
+
+    Dirty   = false;
+    Flushed = 0;
+    std::replace(States.begin(), States.end(), PENDING, FREE);
+}
+
+bool LogDisk::clean_one(size_t limit) {
+    PROFILE_SCOPE("LogDisk::clean");
+
+    // 贪心：存活块最少的段
+    size_t victim = NONE;
+    for (size_t segment = 0; segment < Geometry.Segments; segment++) {
+    	if (States[segment] == USED && Live[segment] <= limit && (victim == NONE || Live[segment] < Live[victim])) {
+    	    victim = segment;
+	}
+    }
+    if (victim == NONE) {
+    	return false;
+    }
+
+    std::vector<char> data(Geometry.SegmentBlocks * BLOCK_SIZE);
+    Base->read_blocks(segment_start(victim), Geometry.SegmentBlocks, data.data());
+
+    Cleaning = true;
+    size_t first = segment_start(victim) - Start;
+    for (uint32_t i = 1; i < Geometry.SegmentBlocks; i++) {
+    	if (Owner[first + i] != NONE) {
+    	    append(Owner[first + i], data.data() + i * BLOCK_SIZE);
+	}
+    }
+    Cleaning = false;
+    Cleaned++;
+    return true;
+}
+
+size_t LogDisk::clean(size_t budget) {
+    // 后台只清理存活块不超过四分之三的段
+    size_t cleaned = 0;
+    while (cleaned < budget && available() < Geometry.Segments / 4 &&
+    	   clean_one((Geometry.SegmentBlocks - 1) * 3 / 4)) {
+    	cleaned++;
+    }
+    return cleaned;
+}
+
+void LogDisk::sync() {
+    Disk::flush();
+    write_segment();
+    if (Dirty) {
+    	checkpoint();
+    }
+}
+
+bool LogDisk::punch(size_t blocknum, size_t nblocks) {
+    for (size_t i = 0; i < nblocks; i++) {
+    	if (Map[blocknum + i]) {
+    	    remap(blocknum + i, 0);
+	}
+    }
+    return true;
+}
+
+void LogDisk::read(size_t blocknum, char *data) {
+    read_blocks(blocknum, 1, data);
+}
+
+void LogDisk::write(size_t blocknum, char *data) {
+    write_blocks(blocknum, 1, data);
+}
+
+void LogDisk::read_blocks(size_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, nblocks, data);
+    finish_reads();
+
+    size_t buffered = Current == NONE ? 0 : segment_start(Current);
+    for (size_t i = 0; i < nblocks;) {
+    	uint64_t physical = Map[blocknum + i];
+    	if (!physical) {
+    	    memset(data + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+    	    i++;
+    	    continue;
+	}
+    	if (buffered && physical >= buffered && physical < buffered + Fill) {
+    	    memcpy(data + i * BLOCK_SIZE, Buffer + (physical - buffered) * BLOCK_SIZE, BLOCK_SIZE);
+    	    i++;
+    	    continue;
+	}
+
+    	// 物理上连续的一段合并成一次读
+    	size_t count = 1;
+    	while (i + count < nblocks && Map[blocknum + i + count] == physical + count &&
+    	       (!buffered || physical + count < buffered || physical + count >= buffered + Fill)) {
+    	    count++;
+	}
+    	Base->read_blocks(physical, count, data + i * BLOCK_SIZE);
+    	i += count;
+    }
+    overlay(blocknum, nblocks, data);
+
+    Reads += nblocks;
+}
+
+void LogDisk::write_blocks(size_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, nblocks, data);
+    if (queue_write(blocknum, nblocks, data)) {
+    	return;
+    }
+
+    for (size_t i = 0; i < nblocks; i++) {
+    	append(blocknum + i, data + i * BLOCK_SIZE);
+    }
+
+    Writes += nblocks;
+}
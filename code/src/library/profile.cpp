@@ -0,0 +1,225 @@
+// profile.cpp: hot-path profiling probes
+
+#include "sfs/profile.h"
+
+#ifdef SFS_PROFILE
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// 调用路径树中的一个节点：同一父节点下同名探针共用一个节点
+struct Profile::Node {
+    const char		*Name;	    // Probe name
+    Node		*Parent;    // Caller (NULL for a thread's root)
+    std::vector<Node *>	Children;   // Probes entered from this one
+    uint64_t		Calls;	    // Times entered
+    uint64_t		Cycles;	    // Cycles spent inside, callees included
+    uint64_t		Callees;    // Cycles spent inside probed callees
+};
+
+namespace {
+
+struct Totals {
+    uint64_t Calls;
+    uint64_t Cycles;
+    uint64_t Self;
+};
+
+// 每个线程一棵树，线程退出后仍保留以便汇总
+struct Registry {
+    std::mutex			Lock;
+    std::vector<Profile::Node *> Roots;
+
+    ~Registry() {
+    	// 退出时输出到stderr，不影响命令的正常输出
+    	bool sampled = false;
+    	for (Profile::Node *root : Roots) {
+    	    sampled = sampled || root->Callees;
+	}
+    	if (sampled) {
+    	    Profile::report(stderr);
+	}
+    	for (Profile::Node *root : Roots) {
+    	    release(root);
+	}
+    }
+
+    static void release(Profile::Node *node) {
+    	for (Profile::Node *child : node->Children) {
+    	    release(child);
+	}
+    	delete node;
+    }
+};
+
+Registry Probes;
+thread_local Profile::Node *Current = NULL;
+
+inline uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+Profile::Node *thread_root() {
+    Profile::Node *root = new Profile::Node{"<thread>", NULL, {}, 0, 0, 0};
+    std::lock_guard<std::mutex> lock(Probes.Lock);
+    Probes.Roots.push_back(root);
+    return root;
+}
+
+bool recursive(const Profile::Node *node) {
+    for (const Profile::Node *caller = node->Parent; caller; caller = caller->Parent) {
+    	if (strcmp(caller->Name, node->Name) == 0) {
+    	    return true;
+	}
+    }
+    return false;
+}
+
+// 按探针名与按调用路径两种方式累加
+void collect(const Profile::Node *node, const std::string &path,
+    	     std::map<std::string, Totals> &flat, std::map<std::string, Totals> &paths) {
+    for (const Profile::Node *child : node->Children) {
+    	std::string name = path.empty() ? child->Name : path + " > " + child->Name;
+    	uint64_t self = child->Cycles - std::min(child->Cycles, child->Callees);
+
+    	Totals &total = flat[child->Name];
+    	total.Calls += child->Calls;
+    	total.Self  += self;
+    	if (!recursive(child)) {
+    	    total.Cycles += child->Cycles;
+	}
+
+    	Totals &call = paths[name];
+    	call.Calls  += child->Calls;
+    	call.Cycles += child->Cycles;
+    	call.Self   += self;
+
+    	collect(child, name, flat, paths);
+    }
+}
+
+void clear(Profile::Node *node) {
+    node->Calls = node->Cycles = node->Callees = 0;
+    for (Profile::Node *child : node->Children) {
+    	clear(child);
+    }
+}
+
+}
+
+Profile::Scope::Scope(const char *name) {
+    if (!Current) {
+    	Current = thread_root();
+    }
+    Parent = Current;
+
+    Node *node = NULL;
+    for (Node *child : Parent->Children) {
+    	if (child->Name == name || strcmp(child->Name, name) == 0) {
+    	    node = child;
+    	    break;
+	}
+    }
+    if (!node) {
+    	node = new Node{name, Parent, {}, 0, 0, 0};
+    	Parent->Children.push_back(node);
+    }
+
+    Current = node;
+    Start = cycles();
+}
+
+Profile::Scope::~Scope() {
+    uint64_t elapsed = cycles() - Start;
+    Current->Calls++;
+    Current->Cycles += elapsed;
+    Parent->Callees += elapsed;
+    Current = Parent;
+}
+
+bool Profile::enabled() {
+    return true;
+}
+
+void Profile::report(FILE *stream) {
+    std::map<std::string, Totals> flat, paths;
+    {
+    	std::lock_guard<std::mutex> lock(Probes.Lock);
+    	for (const Node *root : Probes.Roots) {
+    	    collect(root, "", flat, paths);
+	}
+    }
+
+    uint64_t calls = 0;
+    for (auto &entry : flat) {
+    	calls += entry.second.Calls;
+    }
+    if (!calls) {
+    	fprintf(stream, "no profile samples recorded.\n");
+    	return;
+    }
+
+    // 平面剖析按自身耗时从高到低排列
+    std::vector<std::pair<std::string, Totals>> order(flat.begin(), flat.end());
+    std::sort(order.begin(), order.end(), [](const std::pair<std::string, Totals> &a, const std::pair<std::string, Totals> &b) {
+    	return a.second.Self > b.second.Self;
+    });
+
+    fprintf(stream, "flat profile (cycles):\n");
+    fprintf(stream, "%12s %16s %16s %12s  %s\n", "calls", "total", "self", "self/call", "probe");
+    for (auto &entry : order) {
+    	if (!entry.second.Calls) {
+    	    continue;
+	}
+    	fprintf(stream, "%12lu %16lu %16lu %12lu  %s\n", entry.second.Calls, entry.second.Cycles,
+    	    	entry.second.Self, entry.second.Self / entry.second.Calls, entry.first.c_str());
+    }
+
+    fprintf(stream, "call-path profile (cycles):\n");
+    fprintf(stream, "%12s %16s %16s  %s\n", "calls", "total", "self", "path");
+    for (auto &entry : paths) {
+    	if (!entry.second.Calls) {
+    	    continue;
+	}
+    	fprintf(stream, "%12lu %16lu %16lu  %s\n", entry.second.Calls, entry.second.Cycles,
+    	    	entry.second.Self, entry.first.c_str());
+    }
+}
+
+void Profile::reset() {
+    std::lock_guard<std::mutex> lock(Probes.Lock);
+    for (Node *root : Probes.Roots) {
+    	clear(root);
+    }
+}
+
+#else
+
+bool Profile::enabled() {
+    return false;
+}
+
+void Profile::report(FILE *stream) {
+    fprintf(stream, "profiling is not enabled in this build (make PROFILE=1).\n");
+}
+
+void Profile::reset() {
+}
+
+#endif
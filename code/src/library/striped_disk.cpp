@@ -0,0 +1,259 @@
+// striped_disk.cpp: RAID-0 disk emulator over several image files
+
+#include "sfs/profile.h"
+#include "sfs/striped_disk.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// 成员镜像只扩展不截断，在线扩容过的条带盘以较小的块数打开时不丢失数据
+static bool extend(int fd, size_t bytes) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && (st.st_size >= (off_t) bytes || ftruncate(fd, bytes) == 0);
+}
+
+void StripedDisk::open(const std::vector<std::string> &paths, size_t nblocks, size_t stripe, bool direct) {
+    char what[BUFSIZ];
+
+    if (paths.empty() || stripe == 0) {
+    	snprintf(what, BUFSIZ, "striped disk needs at least one image and a non-zero stripe unit!");
+    	throw std::invalid_argument(what);
+    }
+
+    // 每个成员保存整数个条带单元
+    size_t stripes = (nblocks + stripe - 1) / stripe;
+    size_t member_blocks = (stripes + paths.size() - 1) / paths.size() * stripe;
+
+    for (const std::string &path : paths) {
+    	int fd = ::open(path.c_str(), O_RDWR|O_CREAT|(direct ? O_DIRECT : 0), 0600);
+    	if (fd < 0 || !extend(fd, member_blocks*BLOCK_SIZE)) {
+    	    snprintf(what, BUFSIZ, "Unable to open %s: %s", path.c_str(), strerror(errno));
+    	    if (fd >= 0) {
+    	    	close(fd);
+	    }
+    	    throw std::runtime_error(what);
+	}
+    	Members.push_back(fd);
+    }
+
+    StripeBlocks = stripe;
+    Blocks   = nblocks;
+    Reads    = 0;
+    Writes   = 0;
+    Discards = 0;
+    Head     = 0;
+    Elapsed  = 0;
+    Direct   = direct;
+
+    // 位图记录的是条带盘的逻辑块，保存在第一个成员旁边
+    load_changed(paths[0].c_str());
+}
+
+StripedDisk::~StripedDisk() {
+    if (!Members.empty()) {
+    	// 基类析构时成员已经关闭，排队的写入要在这里完成
+    	try {
+    	    flush();
+	} catch (std::exception &e) {
+    	    fprintf(stderr, "%s\n", e.what());
+	}
+    	report();
+    	for (int fd : Members) {
+    	    close(fd);
+	}
+    	Members.clear();
+    }
+}
+
+bool StripedDisk::grow(size_t nblocks) {
+    if (nblocks <= Blocks) {
+    	return true;
+    }
+
+    size_t stripes = (nblocks + StripeBlocks - 1) / StripeBlocks;
+    size_t member_blocks = (stripes + Members.size() - 1) / Members.size() * StripeBlocks;
+    for (size_t member = 0; member < Members.size(); member++) {
+    	if (!extend(Members[member], member_blocks*BLOCK_SIZE)) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to grow member %lu: %s", member, strerror(errno));
+    	    throw std::runtime_error(what);
+	}
+    }
+
+    // 成员按条带单元取整，旧大小之后的块可能留有内容，打洞清零后再启用
+    if (!punch(Blocks, nblocks - Blocks)) {
+    	return false;
+    }
+    resize(nblocks);
+    return true;
+}
+
+std::vector<StripedDisk::Extent> StripedDisk::split(size_t blocknum, size_t nblocks, char *data) const {
+    std::vector<Extent> extents;
+
+    while (nblocks > 0) {
+    	// 块所在的条带单元及其在成员中的位置
+    	size_t stripe = blocknum / StripeBlocks;
+    	size_t within = blocknum % StripeBlocks;
+    	size_t count  = std::min(nblocks, StripeBlocks - within);
+    	size_t member_block = stripe / Members.size() * StripeBlocks + within;
+
+    	extents.push_back({stripe % Members.size(), (off_t)(member_block*BLOCK_SIZE), count*BLOCK_SIZE, data});
+    	blocknum += count;
+    	nblocks  -= count;
+    	data     += count*BLOCK_SIZE;
+    }
+
+    return extents;
+}
+
+void StripedDisk::transfer(const std::vector<Extent> &extents, bool writing) {
+    std::vector<int> errors(Members.size(), 0);
+    std::vector<bool> involved(Members.size(), false);
+    for (const Extent &extent : extents) {
+    	involved[extent.Member] = true;
+    }
+
+    // 每个成员按顺序完成自己的部分
+    auto run = [&](size_t member) {
+    	for (const Extent &extent : extents) {
+    	    if (extent.Member != member) {
+    	    	continue;
+	    }
+    	    ssize_t done = writing ? pwrite(Members[member], extent.Data, extent.Length, extent.Offset)
+    	    			   : pread(Members[member], extent.Data, extent.Length, extent.Offset);
+    	    if (done != (ssize_t)extent.Length) {
+    	    	errors[member] = done < 0 ? errno : EIO;
+    	    	return;
+	    }
+	}
+    };
+
+    // 只涉及一个成员时无需创建线程
+    std::vector<std::thread> threads;
+    size_t first = extents.front().Member;
+    for (size_t member = 0; member < Members.size(); member++) {
+    	if (involved[member] && member != first) {
+    	    threads.push_back(std::thread(run, member));
+	}
+    }
+    run(first);
+    for (std::thread &thread : threads) {
+    	thread.join();
+    }
+
+    for (size_t member = 0; member < Members.size(); member++) {
+    	if (errors[member]) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to %s member %lu: %s", writing ? "write" : "read", member, strerror(errors[member]));
+    	    throw std::runtime_error(what);
+	}
+    }
+}
+
+void StripedDisk::read(size_t blocknum, char *data) {
+    PROFILE_SCOPE("Disk::read");
+    read_blocks(blocknum, 1, data);
+}
+
+void StripedDisk::write(size_t blocknum, char *data) {
+    PROFILE_SCOPE("Disk::write");
+    write_blocks(blocknum, 1, data);
+}
+
+void StripedDisk::read_blocks(size_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, nblocks, data);
+    finish_reads();
+
+    char *buffer = aligned(data, nblocks);
+    transfer(split(blocknum, nblocks, buffer), false);
+    if (buffer != data) {
+    	memcpy(data, buffer, nblocks*BLOCK_SIZE);
+    }
+    overlay(blocknum, nblocks, data);
+
+    charge(blocknum, nblocks);
+    Reads += nblocks;
+}
+
+void StripedDisk::write_blocks(size_t blocknum, size_t nblocks, char *data) {
+    sanity_check(blocknum, nblocks, data);
+    if (queue_write(blocknum, nblocks, data)) {
+    	return;
+    }
+
+    char *buffer = aligned(data, nblocks);
+    if (buffer != data) {
+    	memcpy(buffer, data, nblocks*BLOCK_SIZE);
+    }
+    transfer(split(blocknum, nblocks, buffer), true);
+
+    charge(blocknum, nblocks);
+    mark(blocknum, nblocks);
+    Writes += nblocks;
+}
+
+bool StripedDisk::punch(size_t blocknum, size_t nblocks) {
+    // 只需要区间，不需要缓冲区
+    for (const Extent &extent : split(blocknum, nblocks, NULL)) {
+    	if (fallocate(Members[extent.Member], FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, extent.Offset, extent.Length) < 0) {
+    	    if (errno == EOPNOTSUPP || errno == ENOSYS) {
+    	    	return false;
+	    }
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to discard %lu: %s", blocknum, strerror(errno));
+    	    throw std::runtime_error(what);
+	}
+    }
+    return true;
+}
+
+bool StripedDisk::copy_in(size_t blocknum, size_t nblocks, int fd, off_t offset) {
+    if (blocknum > Blocks || nblocks > Blocks - blocknum) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "copy range (%lu, %lu) is out of bounds!", blocknum, nblocks);
+    	throw std::invalid_argument(what);
+    }
+
+    flush();
+    mark(blocknum, nblocks);
+
+    // 各段在宿主文件中依次相连
+    for (const Extent &extent : split(blocknum, nblocks, NULL)) {
+    	if (!copy_file(fd, offset, Members[extent.Member], extent.Offset, extent.Length)) {
+    	    return false;
+	}
+    	offset += extent.Length;
+    }
+
+    charge(blocknum, nblocks);
+    Writes += nblocks;
+    return true;
+}
+
+bool StripedDisk::copy_out(size_t blocknum, size_t nblocks, int fd, off_t offset) {
+    if (blocknum > Blocks || nblocks > Blocks - blocknum) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "copy range (%lu, %lu) is out of bounds!", blocknum, nblocks);
+    	throw std::invalid_argument(what);
+    }
+
+    flush();
+    for (const Extent &extent : split(blocknum, nblocks, NULL)) {
+    	if (!copy_file(Members[extent.Member], extent.Offset, fd, offset, extent.Length)) {
+    	    return false;
+	}
+    	offset += extent.Length;
+    }
+
+    charge(blocknum, nblocks);
+    Reads += nblocks;
+    return true;
+}
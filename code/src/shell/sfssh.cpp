@@ -2,53 +2,228 @@
 
 #include "sfs/disk.h"
 #include "sfs/fs.h"
+#include "sfs/profile.h"
+#include "sfs/striped_disk.h"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 // Macros
 
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
+// Globals
+
+static size_t AutoDefragBudget = 0;	// Blocks to defragment after each command
+static size_t AutoCleanBudget = 1;	// Log segments to clean after each command
+static size_t PipelineBuffers = 8;	// Buffers in the copyin/copyout ring
+static size_t PipelineBufferSize = 1 << 20;	// Bytes per ring buffer
+
+// Host I/O threads used by the copy pipeline
+const static size_t PIPELINE_THREADS = 4;
+
+// Types
+
+struct Transfer {
+    std::string	Path;	    // Host file
+    int		Fd;	    // Open host file
+    size_t	Inumber;    // Inode in file system
+    size_t	Copied;	    // Bytes copied so far
+    bool	Failed;	    // Whether the file system side failed
+    int		Error;	    // errno of a failed host read or write
+};
+
+// A ring of buffers passed between the thread doing file system I/O and the
+// threads doing host I/O.  Filled buffers travel on lanes; a chunk without
+// data marks the end of its file.
+class Pipeline {
+public:
+    struct Chunk {
+    	size_t	File;	    // Index of transfer
+    	size_t	Offset;	    // Offset of data in file
+    	size_t	Length;	    // Bytes of data
+    	char   *Data;	    // Buffer (NULL at end of file)
+    };
+
+    Pipeline(size_t buffers, size_t size, size_t lanes) : Size(size), Lanes(lanes) {
+    	for (size_t i = 0; i < buffers; i++) {
+    	    void *data = NULL;
+    	    if (posix_memalign(&data, Disk::BLOCK_SIZE, size) != 0) {
+    	    	throw std::bad_alloc();
+	    }
+    	    Buffers.push_back((char *) data);
+	}
+    	Free = Buffers;
+    }
+
+    ~Pipeline() {
+    	for (char *data : Buffers) {
+    	    free(data);
+	}
+    }
+
+    size_t size() const { return Size; }
+
+    // Wait for an empty buffer
+    char *acquire() {
+    	std::unique_lock<std::mutex> lock(Lock);
+    	Changed.wait(lock, [this] { return !Free.empty(); });
+    	char *data = Free.back();
+    	Free.pop_back();
+    	return data;
+    }
+
+    // Return a buffer once its data has been consumed
+    void release(char *data) {
+    	std::lock_guard<std::mutex> lock(Lock);
+    	Free.push_back(data);
+    	Changed.notify_all();
+    }
+
+    void put(size_t lane, const Chunk &chunk) {
+    	std::lock_guard<std::mutex> lock(Lock);
+    	Lanes[lane].push_back(chunk);
+    	Changed.notify_all();
+    }
+
+    // Wait for the next chunk on a lane
+    Chunk get(size_t lane) {
+    	std::unique_lock<std::mutex> lock(Lock);
+    	Changed.wait(lock, [this, lane] { return !Lanes[lane].empty(); });
+    	Chunk chunk = Lanes[lane].front();
+    	Lanes[lane].pop_front();
+    	return chunk;
+    }
+
+private:
+    size_t		Size;	    // Bytes per buffer
+    std::vector<char *>	Buffers;    // All buffers
+    std::vector<char *>	Free;	    // Empty buffers
+    std::vector<std::deque<Chunk>> Lanes;   // Filled buffers per consumer
+    std::mutex		Lock;
+    std::condition_variable Changed;
+};
+
 // Command prototypes
 
 void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_mount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_map(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_create(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_remove(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_create_many(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_stat_many(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_remove_many(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_clone(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_copy(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_defrag(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_frag(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_fallocate(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_grow(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_clean(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_discard(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_trim(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_df(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_ls(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_mkdir(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_open(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_unlink(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_checkpoint(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_export_incremental(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_apply_incremental(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_copyin_many(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_copyout_many(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_pipeline(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_profile(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 
 bool copyout(FileSystem &fs, size_t inumber, const char *path);
+void preallocate(FileSystem &fs, size_t inumber, off_t size);
 bool copyin(FileSystem &fs, const char *path, size_t inumber);
+void copyin_pipeline(FileSystem &fs, std::vector<Transfer> &files);
+void copyout_pipeline(FileSystem &fs, std::vector<Transfer> &files);
+bool read_list(const char *path, bool inode_first, std::vector<Transfer> &files);
 
 // Main execution
 
 int main(int argc, char *argv[]) {
-    Disk	disk;
+    std::unique_ptr<Disk> disk;
     FileSystem	fs;
+    size_t	stripe = 0;
+    Disk::Timing timing{};
+    bool	timed = false;
+    bool	direct = false;
 
-    if (argc != 3) {
-    	fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
+    // 可选参数：条带单元、时间模型、O_DIRECT
+    int argi = 1;
+    while (argc - argi > 2 && argv[argi][0] == '-') {
+    	if (streq(argv[argi], "-d")) {
+    	    direct = true;
+    	    argi += 1;
+    	    continue;
+	} else if (streq(argv[argi], "-s")) {
+    	    stripe = atoi(argv[argi + 1]);
+	} else if (streq(argv[argi], "-t") && Disk::timing_profile(argv[argi + 1], timing)) {
+    	    timed = true;
+	} else {
+    	    break;
+	}
+    	argi += 2;
+    }
+
+    if (argc - argi != 2) {
+    	fprintf(stderr, "Usage: %s [-d] [-s <stripe>] [-t <hdd|ssd|seek_base,seek_per_block,seek_max,latency,bandwidth>] <diskfile>[,<diskfile>...] <nblocks>\n", argv[0]);
     	return EXIT_FAILURE;
     }
 
+    // 用逗号分隔的多个镜像组成条带盘
+    std::vector<std::string> paths;
+    std::stringstream ss(argv[argi]);
+    for (std::string path; std::getline(ss, path, ',');) {
+    	paths.push_back(path);
+    }
+
     try {
-    	disk.open(argv[1], atoi(argv[2]));
-    } catch (std::runtime_error &e) {
-    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[1], e.what());
+    	if (paths.size() > 1 || stripe) {
+    	    StripedDisk *striped = new StripedDisk();
+    	    disk.reset(striped);
+    	    striped->open(paths, strtoull(argv[argi + 1], NULL, 10), stripe ? stripe : StripedDisk::DEFAULT_STRIPE, direct);
+	} else {
+    	    disk.reset(new Disk());
+    	    disk->open(argv[argi], strtoull(argv[argi + 1], NULL, 10), direct);
+	}
+    } catch (std::exception &e) {
+    	fprintf(stderr, "Unable to open disk %s: %s\n", argv[argi], e.what());
     	return EXIT_FAILURE;
     }
 
+    if (timed) {
+    	disk->set_timing(timing);
+    }
+
     while (true) {
 	char line[BUFSIZ], cmd[BUFSIZ], arg1[BUFSIZ], arg2[BUFSIZ];
 
@@ -65,31 +240,91 @@ int main(int argc, char *argv[]) {
 	}
 
 	if (streq(cmd, "debug")) {
-	    do_debug(disk, fs, args, arg1, arg2);
+	    do_debug(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "format")) {
-	    do_format(disk, fs, args, arg1, arg2);
+	    do_format(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "mount")) {
-	    do_mount(disk, fs, args, arg1, arg2);
+	    do_mount(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "cat")) {
-	    do_cat(disk, fs, args, arg1, arg2);
+	    do_cat(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "map")) {
+	    do_map(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "copyout")) {
-	    do_copyout(disk, fs, args, arg1, arg2);
+	    do_copyout(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "create")) {
-	    do_create(disk, fs, args, arg1, arg2);
+	    do_create(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "remove")) {
-	    do_remove(disk, fs, args, arg1, arg2);
+	    do_remove(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "stat")) {
-	    do_stat(disk, fs, args, arg1, arg2);
+	    do_stat(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "copyin")) {
-	    do_copyin(disk, fs, args, arg1, arg2);
+	    do_copyin(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "create_many")) {
+	    do_create_many(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "stat_many")) {
+	    do_stat_many(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "remove_many")) {
+	    do_remove_many(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "clone")) {
+	    do_clone(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "copy")) {
+	    do_copy(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "defrag")) {
+	    do_defrag(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "frag")) {
+	    do_frag(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "fallocate")) {
+	    do_fallocate(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "grow")) {
+	    do_grow(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "clean")) {
+	    do_clean(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "discard")) {
+	    do_discard(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "trim")) {
+	    do_trim(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "df")) {
+	    do_df(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "ls")) {
+	    do_ls(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "mkdir")) {
+	    do_mkdir(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "open")) {
+	    do_open(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "unlink")) {
+	    do_unlink(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "copyin_many")) {
+	    do_copyin_many(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "copyout_many")) {
+	    do_copyout_many(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "pipeline")) {
+	    do_pipeline(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "checkpoint")) {
+	    do_checkpoint(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "export-incremental")) {
+	    do_export_incremental(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "apply-incremental")) {
+	    do_apply_incremental(*disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "profile")) {
+	    do_profile(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "help")) {
-	    do_help(disk, fs, args, arg1, arg2);
+	    do_help(*disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "exit") || streq(cmd, "quit")) {
 	    break;
 	} else {
 	    printf("Unknown command: %s", line);
 	    printf("Type 'help' for a list of commands.\n");
 	}
+
+	// 在命令之间做少量碎片整理
+	if (AutoDefragBudget) {
+	    fs.defrag(AutoDefragBudget);
+	}
+
+	// 日志结构卷在命令之间清理少量段，前台写入就不必等清理
+	if (AutoCleanBudget) {
+	    fs.clean(AutoCleanBudget);
+	}
     }
 
     return EXIT_SUCCESS;
@@ -107,12 +342,16 @@ void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 }
 
 void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-    	printf("Usage: format\n");
+    if (args > 3) {
+    	printf("Usage: format [block_size | log [inode_percent]]\n");
     	return;
     }
 
-    if (fs.format(&disk)) {
+    // 默认4096字节的块，10%的块用作inode；log表示日志结构布局
+    bool logged = args >= 2 && streq(arg1, "log");
+    size_t block_size = args >= 2 && !logged ? atoi(arg1) : Disk::BLOCK_SIZE;
+    uint32_t inode_percent = args == 3 ? atoi(arg2) : Volume::DEFAULT_INODE_PERCENT;
+    if (fs.format(&disk, block_size, inode_percent, logged)) {
     	printf("disk formatted.\n");
     } else {
     	printf("format failed!\n");
@@ -143,6 +382,25 @@ void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     }
 }
 
+void do_map(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: map <inode>\n");
+    	return;
+    }
+
+    std::unique_ptr<FileView> view = fs.map(atoi(arg1));
+    if (!view) {
+    	printf("map failed!\n");
+    	return;
+    }
+
+    // 直接从映射的镜像输出，不经过中间缓冲区
+    for (const FileView::Span &span : view->spans()) {
+    	fwrite(span.Data, 1, span.Length, stdout);
+    }
+    printf("%lu bytes in %lu spans (%lu bytes mapped)\n", view->size(), view->spans().size(), view->mapped());
+}
+
 void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 3) {
     	printf("Usage: copyout <inode> <file>\n");
@@ -155,12 +413,12 @@ void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 }
 
 void do_create(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-    	printf("Usage: create\n");
+    if (args != 1 && args != 2) {
+    	printf("Usage: create [path]\n");
     	return;
     }
 
-    ssize_t inumber = fs.create();
+    ssize_t inumber = args == 2 ? fs.create(arg1) : fs.create();
     if (inumber >= 0) {
     	printf("created inode %ld.\n", inumber);
     } else {
@@ -208,73 +466,723 @@ void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     }
 }
 
+void do_create_many(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: create_many <count>\n");
+    	return;
+    }
+
+    std::vector<size_t> inumbers;
+    size_t created = fs.create_many(atoi(arg1), inumbers);
+    if (created > 0) {
+    	printf("created %lu inodes (%lu to %lu).\n", created, inumbers.front(), inumbers.back());
+    } else {
+    	printf("create_many failed!\n");
+    }
+}
+
+void do_stat_many(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 3) {
+    	printf("Usage: stat_many <inode> <count>\n");
+    	return;
+    }
+
+    std::vector<size_t> inumbers;
+    for (int i = 0; i < atoi(arg2); i++) {
+    	inumbers.push_back(atoi(arg1) + i);
+    }
+
+    std::vector<ssize_t> sizes;
+    fs.stat_many(inumbers, sizes);
+    for (size_t i = 0; i < inumbers.size(); i++) {
+    	if (sizes[i] >= 0) {
+    	    printf("inode %lu has size %ld bytes.\n", inumbers[i], sizes[i]);
+	}
+    }
+}
+
+void do_remove_many(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 3) {
+    	printf("Usage: remove_many <inode> <count>\n");
+    	return;
+    }
+
+    std::vector<size_t> inumbers;
+    for (int i = 0; i < atoi(arg2); i++) {
+    	inumbers.push_back(atoi(arg1) + i);
+    }
+
+    printf("removed %lu inodes.\n", fs.remove_many(inumbers));
+}
+
+void do_clone(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: clone <inode>\n");
+    	return;
+    }
+
+    ssize_t inumber = fs.clone(atoi(arg1));
+    if (inumber >= 0) {
+    	printf("cloned inode %d to inode %ld.\n", atoi(arg1), inumber);
+    } else {
+    	printf("clone failed!\n");
+    }
+}
+
+void do_copy(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 3) {
+    	printf("Usage: copy <inode> <inode>\n");
+    	return;
+    }
+
+    ssize_t copied = fs.copy_range(atoi(arg1), 0, atoi(arg2), 0, SIZE_MAX);
+    if (copied >= 0) {
+    	printf("copied %ld bytes from inode %d to inode %d.\n", copied, atoi(arg1), atoi(arg2));
+    } else {
+    	printf("copy failed!\n");
+    }
+}
+
+void do_defrag(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args == 3 && streq(arg1, "auto")) {
+    	AutoDefragBudget = atoi(arg2);
+    	printf("auto defrag %s.\n", AutoDefragBudget ? "enabled" : "disabled");
+    	return;
+    }
+    if (args != 1 && args != 2) {
+    	printf("Usage: defrag [budget | auto <budget>]\n");
+    	return;
+    }
+
+    // 没有预算时一直整理到无块可移动
+    ssize_t moved = 0;
+    for (ssize_t step = 1; step > 0 && (args == 1 || !moved);) {
+    	step = fs.defrag(args == 2 ? atoi(arg1) : SIZE_MAX);
+    	if (step < 0) {
+    	    printf("defrag failed!\n");
+    	    return;
+	}
+    	moved += step;
+    }
+    printf("defrag moved %ld blocks.\n", moved);
+}
+
+void do_frag(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: frag <inode>\n");
+    	return;
+    }
+
+    ssize_t extents = fs.extents(atoi(arg1));
+    if (extents >= 0) {
+    	printf("inode %d has %ld extents.\n", atoi(arg1), extents);
+    } else {
+    	printf("frag failed!\n");
+    }
+}
+
+void do_fallocate(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 3) {
+    	printf("Usage: fallocate <inode> <bytes>\n");
+    	return;
+    }
+
+    if (fs.fallocate(atoi(arg1), 0, strtoull(arg2, NULL, 10))) {
+    	printf("reserved %s bytes for inode %d.\n", arg2, atoi(arg1));
+    } else {
+    	printf("fallocate failed!\n");
+    }
+}
+
+void do_grow(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args < 2 || (args == 3 && !streq(arg2, "inodes"))) {
+    	printf("Usage: grow <blocks> [inodes]\n");
+    	return;
+    }
+
+    if (fs.grow(strtoull(arg1, NULL, 10), args == 3)) {
+    	printf("disk grown to %s blocks.\n", arg1);
+    } else {
+    	printf("grow failed!\n");
+    }
+}
+
+void do_clean(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args == 3 && streq(arg1, "auto")) {
+    	AutoCleanBudget = atoi(arg2);
+    	printf("auto clean %s.\n", AutoCleanBudget ? "enabled" : "disabled");
+    	return;
+    }
+    if (args != 1 && args != 2) {
+    	printf("Usage: clean [segments | auto <segments>]\n");
+    	return;
+    }
+
+    ssize_t cleaned = fs.clean(args == 2 ? atoi(arg1) : SIZE_MAX);
+    if (cleaned >= 0) {
+    	printf("cleaned %ld segments.\n", cleaned);
+    } else {
+    	printf("clean failed!\n");
+    }
+}
+
+void do_discard(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2 || (!streq(arg1, "on") && !streq(arg1, "off"))) {
+    	printf("Usage: discard <on|off>\n");
+    	return;
+    }
+
+    fs.set_discard(streq(arg1, "on"));
+    printf("discard %s.\n", streq(arg1, "on") ? "enabled" : "disabled");
+}
+
+void do_trim(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: trim\n");
+    	return;
+    }
+
+    ssize_t trimmed = fs.trim();
+    if (trimmed >= 0) {
+    	printf("trimmed %ld blocks.\n", trimmed);
+    } else {
+    	printf("trim failed!\n");
+    }
+}
+
+void do_df(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: df\n");
+    	return;
+    }
+
+    FileSystem::StatFS stats;
+    if (!fs.statfs(stats)) {
+    	printf("df failed!\n");
+    	return;
+    }
+    if (stats.BlockSize != Disk::BLOCK_SIZE) {
+    	printf("%lu bytes per block.\n", stats.BlockSize);
+    }
+    printf("%lu of %lu data blocks free.\n", stats.FreeBlocks, stats.DataBlocks);
+    printf("%lu of %lu inodes free.\n", stats.FreeInodes, stats.Inodes);
+}
+
+void do_ls(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1 && args != 2) {
+    	printf("Usage: ls [path]\n");
+    	return;
+    }
+
+    std::vector<FileSystem::DirectoryEntry> entries;
+    if (!fs.list(args == 2 ? arg1 : "/", entries)) {
+    	printf("ls failed!\n");
+    	return;
+    }
+
+    for (auto &entry : entries) {
+    	printf("%6lu %8ld %s%s\n", entry.Inumber, fs.stat(entry.Inumber), entry.Name.c_str(), entry.Directory ? "/" : "");
+    }
+}
+
+void do_mkdir(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: mkdir <path>\n");
+    	return;
+    }
+
+    ssize_t inumber = fs.mkdir(arg1);
+    if (inumber >= 0) {
+    	printf("created directory %s as inode %ld.\n", arg1, inumber);
+    } else {
+    	printf("mkdir failed!\n");
+    }
+}
+
+void do_open(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: open <path>\n");
+    	return;
+    }
+
+    ssize_t inumber = fs.open(arg1);
+    if (inumber >= 0) {
+    	printf("%s is inode %ld.\n", arg1, inumber);
+    } else {
+    	printf("open failed!\n");
+    }
+}
+
+void do_unlink(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: unlink <path>\n");
+    	return;
+    }
+
+    if (fs.unlink(arg1)) {
+    	printf("unlinked %s.\n", arg1);
+    } else {
+    	printf("unlink failed!\n");
+    }
+}
+
+void do_copyin_many(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: copyin_many <listfile>\n");
+    	return;
+    }
+
+    std::vector<Transfer> files;
+    if (!read_list(arg1, false, files)) {
+    	return;
+    }
+
+    copyin_pipeline(fs, files);
+    for (Transfer &file : files) {
+    	if (file.Error) {
+    	    fprintf(stderr, "Unable to read %s: %s\n", file.Path.c_str(), strerror(file.Error));
+	}
+    	if (file.Failed || file.Error) {
+    	    printf("copyin of %s failed after %lu bytes!\n", file.Path.c_str(), file.Copied);
+	} else {
+    	    printf("copied %lu bytes from %s to inode %lu.\n", file.Copied, file.Path.c_str(), file.Inumber);
+	}
+    	close(file.Fd);
+    }
+}
+
+void do_copyout_many(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: copyout_many <listfile>\n");
+    	return;
+    }
+
+    std::vector<Transfer> files;
+    if (!read_list(arg1, true, files)) {
+    	return;
+    }
+
+    copyout_pipeline(fs, files);
+    for (Transfer &file : files) {
+    	if (file.Error) {
+    	    fprintf(stderr, "Unable to write %s: %s\n", file.Path.c_str(), strerror(file.Error));
+    	    printf("copyout to %s failed after %lu bytes!\n", file.Path.c_str(), file.Copied);
+	} else {
+    	    printf("copied %lu bytes from inode %lu to %s.\n", file.Copied, file.Inumber, file.Path.c_str());
+	}
+    	close(file.Fd);
+    }
+}
+
+void do_pipeline(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1 && args != 3) {
+    	printf("Usage: pipeline [<buffers> <KiB>]\n");
+    	return;
+    }
+
+    if (args == 3) {
+    	if (atoi(arg1) <= 0 || atoi(arg2) <= 0) {
+    	    printf("pipeline needs at least one buffer of at least 1 KiB!\n");
+    	    return;
+	}
+    	PipelineBuffers = atoi(arg1);
+    	PipelineBufferSize = (size_t) atoi(arg2) << 10;
+    }
+    printf("pipeline uses %lu buffers of %lu KiB.\n", PipelineBuffers, PipelineBufferSize >> 10);
+}
+
+void do_checkpoint(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: checkpoint\n");
+    	return;
+    }
+
+    ssize_t changed = disk.checkpoint();
+    if (changed < 0) {
+    	printf("change tracking started.\n");
+    } else {
+    	printf("checkpoint taken, %ld blocks changed since the last one.\n", changed);
+    }
+}
+
+void do_export_incremental(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: export-incremental <file>\n");
+    	return;
+    }
+
+    if (!disk.tracking()) {
+    	printf("no checkpoint to export from!\n");
+    	return;
+    }
+
+    int fd = open(arg1, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if (fd < 0) {
+    	fprintf(stderr, "Unable to open %s: %s\n", arg1, strerror(errno));
+    	return;
+    }
+
+    size_t extents;
+    ssize_t exported = disk.export_changes(fd, extents);
+    close(fd);
+    printf("exported %ld changed blocks in %lu extents.\n", exported, extents);
+}
+
+void do_apply_incremental(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: apply-incremental <file>\n");
+    	return;
+    }
+
+    // 挂载后文件系统缓存的元数据会与写入的块不一致
+    if (disk.mounted()) {
+    	printf("cannot apply a delta to a mounted disk!\n");
+    	return;
+    }
+
+    int fd = open(arg1, O_RDONLY);
+    if (fd < 0) {
+    	fprintf(stderr, "Unable to open %s: %s\n", arg1, strerror(errno));
+    	return;
+    }
+
+    ssize_t applied = disk.apply_changes(fd);
+    close(fd);
+    if (applied >= 0) {
+    	printf("applied %ld changed blocks.\n", applied);
+    } else {
+    	printf("apply failed!\n");
+    }
+}
+
+void do_profile(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args > 2 || (args == 2 && !streq(arg1, "reset"))) {
+    	printf("Usage: profile [reset]\n");
+    	return;
+    }
+
+    // 未开启PROFILE编译时探针不存在，只打印提示
+    Profile::report(stdout);
+    if (args == 2 && Profile::enabled()) {
+    	Profile::reset();
+    	printf("profile reset.\n");
+    }
+}
+
 void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     printf("Commands are:\n");
-    printf("    format\n");
+    printf("    format  [block_size | log [inode_percent]]\n");
     printf("    mount\n");
     printf("    debug\n");
-    printf("    create\n");
+    printf("    create  [path]\n");
     printf("    remove  <inode>\n");
     printf("    cat     <inode>\n");
+    printf("    map     <inode>\n");
     printf("    stat    <inode>\n");
     printf("    copyin  <file> <inode>\n");
     printf("    copyout <inode> <file>\n");
+    printf("    copyin_many  <listfile>\n");
+    printf("    copyout_many <listfile>\n");
+    printf("    pipeline [<buffers> <KiB>]\n");
+    printf("    create_many <count>\n");
+    printf("    stat_many   <inode> <count>\n");
+    printf("    remove_many <inode> <count>\n");
+    printf("    clone   <inode>\n");
+    printf("    copy    <inode> <inode>\n");
+    printf("    defrag  [budget | auto <budget>]\n");
+    printf("    frag    <inode>\n");
+    printf("    fallocate <inode> <bytes>\n");
+    printf("    grow    <blocks> [inodes]\n");
+    printf("    clean   [segments | auto <segments>]\n");
+    printf("    discard <on|off>\n");
+    printf("    trim\n");
+    printf("    df\n");
+    printf("    ls      [path]\n");
+    printf("    mkdir   <path>\n");
+    printf("    open    <path>\n");
+    printf("    unlink  <path>\n");
+    printf("    checkpoint\n");
+    printf("    export-incremental <file>\n");
+    printf("    apply-incremental  <file>\n");
+    printf("    profile [reset]\n");
     printf("    help\n");
     printf("    quit\n");
     printf("    exit\n");
 }
 
 bool copyout(FileSystem &fs, size_t inumber, const char *path) {
-    FILE *stream = fopen(path, "w");
-    if (stream == nullptr) {
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0) {
     	fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
     	return false;
     }
 
-    char buffer[4*BUFSIZ] = {0};
-    size_t offset = 0;
-    while (true) {
-    	ssize_t result = fs.read(inumber, buffer, sizeof(buffer), offset);
-    	if (result <= 0) {
-    	    break;
-	}
-	fwrite(buffer, 1, result, stream);
-	offset += result;
+    // 普通文件由文件系统直接复制，其他文件（如/dev/stdout）按流写出
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    	ssize_t copied = fs.splice_out(inumber, 0, fd, 0, SIZE_MAX);
+    	printf("%lu bytes copied\n", copied > 0 ? copied : 0);
+    	close(fd);
+    	return true;
     }
 
-    printf("%lu bytes copied\n", offset);
-    fclose(stream);
+    // 管道等不能直接复制，经缓冲区环由写线程输出
+    std::vector<Transfer> files(1, Transfer{path, fd, inumber, 0, false, 0});
+    copyout_pipeline(fs, files);
+    if (files[0].Error) {
+    	fprintf(stderr, "Unable to write %s: %s\n", path, strerror(files[0].Error));
+    }
+
+    printf("%lu bytes copied\n", files[0].Copied);
+    close(fd);
     return true;
 }
 
+void preallocate(FileSystem &fs, size_t inumber, off_t size) {
+    // 大小已知且超过一块时先预留连续的块；预留失败时照常边写边分配
+    FileSystem::StatFS stats{};
+    if (fs.statfs(stats) && (size_t) size > stats.BlockSize) {
+    	fs.fallocate(inumber, 0, size);
+    }
+}
+
 bool copyin(FileSystem &fs, const char *path, size_t inumber) {
-    FILE *stream = fopen(path, "r");
-    if (stream == nullptr) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
     	fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
     	return false;
     }
 
-    char buffer[4*BUFSIZ] = {0};
-    size_t offset = 0;
-    while (true) {
-    	ssize_t result = fread(buffer, 1, sizeof(buffer), stream);
-    	if (result <= 0) {
-    	    break;
+    // 普通文件由文件系统直接复制，管道等按流读入
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    	preallocate(fs, inumber, st.st_size);
+    	ssize_t copied = fs.splice_in(inumber, 0, fd, 0, st.st_size);
+    	if (copied != st.st_size) {
+    	    fprintf(stderr, "fs.splice_in only wrote %ld bytes, not %ld bytes\n", copied, (long) st.st_size);
 	}
+    	printf("%lu bytes copied\n", copied > 0 ? copied : 0);
+    	close(fd);
+    	return true;
+    }
 
-	ssize_t actual = fs.write(inumber, buffer, result, offset);
-	if (actual < 0) {
-	    fprintf(stderr, "fs.write returned invalid result %ld\n", actual);
-	    break;
+    // 读线程从管道读入缓冲区环，本线程写入文件系统
+    std::vector<Transfer> files(1, Transfer{path, fd, inumber, 0, false, 0});
+    copyin_pipeline(fs, files);
+    if (files[0].Error) {
+    	fprintf(stderr, "Unable to read %s: %s\n", path, strerror(files[0].Error));
+    }
+
+    printf("%lu bytes copied\n", files[0].Copied);
+    close(fd);
+    return true;
+}
+
+// Copy pipeline
+
+// Returns bytes read, short only at end of file, or -1 on error
+static ssize_t read_full(int fd, char *data, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+    	ssize_t got = read(fd, data + total, length - total);
+    	if (got < 0 && errno == EINTR) {
+    	    continue;
 	}
-	offset += actual;
-	if (actual != result) {
-	    fprintf(stderr, "fs.write only wrote %ld bytes, not %ld bytes\n", actual, result);
-	    break;
+    	if (got < 0) {
+    	    return -1;
+	}
+    	if (got == 0) {
+    	    break;
 	}
+    	total += got;
     }
+    return total;
+}
 
-    printf("%lu bytes copied\n", offset);
-    fclose(stream);
+static bool write_full(int fd, const char *data, size_t length) {
+    while (length > 0) {
+    	ssize_t put = write(fd, data, length);
+    	if (put < 0 && errno == EINTR) {
+    	    continue;
+	}
+    	if (put <= 0) {
+    	    return false;
+	}
+    	data   += put;
+    	length -= put;
+    }
     return true;
 }
+
+void copyin_pipeline(FileSystem &fs, std::vector<Transfer> &files) {
+    Pipeline pipeline(PipelineBuffers, PipelineBufferSize, 1);
+    std::unique_ptr<std::atomic<bool>[]> stop(new std::atomic<bool>[files.size()]);
+    for (size_t i = 0; i < files.size(); i++) {
+    	stop[i] = false;
+    }
+
+    // 普通文件的大小已知，先为每个文件预留连续的块
+    for (Transfer &file : files) {
+    	struct stat st;
+    	if (fstat(file.Fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    	    preallocate(fs, file.Inumber, st.st_size);
+	}
+    }
+
+    // 读线程各自认领文件，同一文件的块按顺序进入唯一的通道
+    std::atomic<size_t> next(0);
+    auto reader = [&]() {
+    	for (size_t i = next++; i < files.size(); i = next++) {
+    	    size_t offset = 0;
+    	    while (!stop[i]) {
+    	    	char *data = pipeline.acquire();
+    	    	ssize_t got = read_full(files[i].Fd, data, pipeline.size());
+    	    	if (got <= 0) {
+    	    	    if (got < 0) {
+    	    	    	files[i].Error = errno;
+		    }
+    	    	    pipeline.release(data);
+    	    	    break;
+		}
+    	    	pipeline.put(0, {i, offset, (size_t) got, data});
+    	    	offset += got;
+    	    	if ((size_t) got < pipeline.size()) {
+    	    	    break;
+		}
+	    }
+    	    pipeline.put(0, {i, offset, 0, NULL});
+	}
+    };
+
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < std::min(files.size(), PIPELINE_THREADS); i++) {
+    	readers.emplace_back(reader);
+    }
+
+    // 文件系统不是线程安全的，所有写入都在本线程完成
+    for (size_t remaining = files.size(); remaining > 0;) {
+    	Pipeline::Chunk chunk = pipeline.get(0);
+    	if (!chunk.Data) {
+    	    remaining--;
+    	    continue;
+	}
+
+    	Transfer &file = files[chunk.File];
+    	if (!file.Failed) {
+    	    ssize_t actual = fs.write(file.Inumber, chunk.Data, chunk.Length, chunk.Offset);
+    	    if (actual < 0) {
+    	    	fprintf(stderr, "fs.write returned invalid result %ld\n", actual);
+    	    	file.Failed = true;
+	    } else {
+    	    	file.Copied += actual;
+    	    	if ((size_t) actual != chunk.Length) {
+    	    	    fprintf(stderr, "fs.write only wrote %ld bytes, not %ld bytes\n", actual, (long) chunk.Length);
+    	    	    file.Failed = true;
+		}
+	    }
+    	    stop[chunk.File] = file.Failed;
+	}
+    	pipeline.release(chunk.Data);
+    }
+
+    for (std::thread &thread : readers) {
+    	thread.join();
+    }
+}
+
+void copyout_pipeline(FileSystem &fs, std::vector<Transfer> &files) {
+    size_t lanes = std::min(files.size(), PIPELINE_THREADS);
+    Pipeline pipeline(PipelineBuffers, PipelineBufferSize, lanes);
+    std::unique_ptr<std::atomic<bool>[]> stop(new std::atomic<bool>[files.size()]);
+    for (size_t i = 0; i < files.size(); i++) {
+    	stop[i] = false;
+    }
+
+    // 每个文件固定由一个写线程按顺序写出，管道等也能保持顺序
+    auto writer = [&](size_t lane) {
+    	size_t remaining = (files.size() - lane + lanes - 1) / lanes;
+    	while (remaining > 0) {
+    	    Pipeline::Chunk chunk = pipeline.get(lane);
+    	    if (!chunk.Data) {
+    	    	remaining--;
+    	    	continue;
+	    }
+    	    Transfer &file = files[chunk.File];
+    	    if (!file.Error) {
+    	    	if (write_full(file.Fd, chunk.Data, chunk.Length)) {
+    	    	    file.Copied += chunk.Length;
+		} else {
+    	    	    file.Error = errno ? errno : EIO;
+    	    	    stop[chunk.File] = true;
+		}
+	    }
+    	    pipeline.release(chunk.Data);
+	}
+    };
+
+    std::vector<std::thread> writers;
+    for (size_t lane = 0; lane < lanes; lane++) {
+    	writers.emplace_back(writer, lane);
+    }
+
+    // 文件系统的读取都在本线程完成
+    for (size_t i = 0; i < files.size(); i++) {
+    	size_t offset = 0;
+    	while (!stop[i]) {
+    	    char *data = pipeline.acquire();
+    	    ssize_t got = fs.read(files[i].Inumber, data, pipeline.size(), offset);
+    	    if (got <= 0) {
+    	    	pipeline.release(data);
+    	    	break;
+	    }
+    	    pipeline.put(i % lanes, {i, offset, (size_t) got, data});
+    	    offset += got;
+	}
+    	pipeline.put(i % lanes, {i, offset, 0, NULL});
+    }
+
+    for (std::thread &thread : writers) {
+    	thread.join();
+    }
+}
+
+bool read_list(const char *path, bool inode_first, std::vector<Transfer> &files) {
+    FILE *list = fopen(path, "r");
+    if (list == nullptr) {
+    	fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+    	return false;
+    }
+
+    // 每行一个文件：copyin_many为"<file> <inode>"，copyout_many为"<inode> <file>"
+    char line[BUFSIZ], first[BUFSIZ], second[BUFSIZ];
+    bool valid = true;
+    while (valid && fgets(line, BUFSIZ, list) != NULL) {
+    	int fields = sscanf(line, "%s %s", first, second);
+    	if (fields <= 0) {
+    	    continue;
+	}
+    	if (fields != 2) {
+    	    printf("bad line in %s: %s", path, line);
+    	    valid = false;
+    	    break;
+	}
+
+    	const char *file = inode_first ? second : first;
+    	int fd = inode_first ? open(file, O_WRONLY|O_CREAT|O_TRUNC, 0666) : open(file, O_RDONLY);
+    	if (fd < 0) {
+    	    fprintf(stderr, "Unable to open %s: %s\n", file, strerror(errno));
+    	    valid = false;
+    	    break;
+	}
+    	files.push_back(Transfer{file, fd, strtoull(inode_first ? first : second, NULL, 10), 0, false, 0});
+    }
+    fclose(list);
+
+    if (!valid) {
+    	for (Transfer &file : files) {
+    	    close(file.Fd);
+	}
+    	files.clear();
+    }
+    return valid;
+}
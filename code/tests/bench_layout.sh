@@ -0,0 +1,57 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Benchmark: in-place and log-structured layouts on a 4096 block image
+#
+# Each workload runs in its own session under the simulated disk timing
+# model; the table shows the disk counters and simulated time it reported.
+
+BLOCKS=4096
+FILES=512
+
+head -c 4096 /dev/urandom > $SCRATCH/small
+head -c 1048576 /dev/urandom > $SCRATCH/large
+
+# Small random updates: every file rewritten twice in scattered orders
+for i in $(seq 0 $((FILES - 1))); do
+    echo "$SCRATCH/small $(( (i * 199) % FILES ))"
+done > $SCRATCH/updates
+for i in $(seq 0 $((FILES - 1))); do
+    echo "$SCRATCH/small $(( (i * 317 + 5) % FILES ))"
+done >> $SCRATCH/updates
+
+# Sequential read of every file in inode order
+for i in $(seq 0 $((FILES - 1))); do
+    echo "$i $SCRATCH/out"
+done > $SCRATCH/reads
+
+# Print reads, writes and simulated time of one session
+measure() {
+    ./bin/sfssh -t $1 $SCRATCH/image $BLOCKS 2> /dev/null | tail -n 3 |
+    	awk '/reads/ { r = $1 } /writes/ { w = $1 } /simulated/ { t = $1 } END { printf "%8d %8d %12.3f\n", r, w, t }'
+}
+
+run() {
+    local layout=$1 profile=$2
+
+    rm -f $SCRATCH/image
+    printf "format $([ $layout = log ] && echo log)\nmount\ncreate_many $FILES\n" | ./bin/sfssh $SCRATCH/image $BLOCKS > /dev/null 2>&1
+    printf "%-16s %-10s %-4s " "random updates" $layout $profile
+    printf "mount\ncopyin_many $SCRATCH/updates\n" | measure $profile
+    printf "%-16s %-10s %-4s " "sequential read" $layout $profile
+    printf "mount\ncopyout_many $SCRATCH/reads\n" | measure $profile
+
+    rm -f $SCRATCH/image
+    printf "format $([ $layout = log ] && echo log)\nmount\ncreate\n" | ./bin/sfssh $SCRATCH/image $BLOCKS > /dev/null 2>&1
+    printf "%-16s %-10s %-4s " "large copyin" $layout $profile
+    printf "mount\ncopyin $SCRATCH/large 0\n" | measure $profile
+}
+
+printf "%-16s %-10s %-4s %8s %8s %12s\n" workload layout disk reads writes "ms"
+for profile in hdd ssd; do
+    for layout in in-place log; do
+    	run $layout $profile
+    done
+done
@@ -0,0 +1,53 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: data/image.20
+
+test-input() {
+    cat <<EOF
+mount
+create_many 130
+stat_many 0 5
+stat_many 126 5
+remove_many 1 4
+stat_many 0 5
+debug
+EOF
+}
+
+test-output() {
+    cat <<EOF
+disk mounted.
+created 130 inodes (0 to 131).
+inode 0 has size 0 bytes.
+inode 1 has size 0 bytes.
+inode 2 has size 27160 bytes.
+inode 3 has size 9546 bytes.
+inode 4 has size 0 bytes.
+inode 126 has size 0 bytes.
+inode 127 has size 0 bytes.
+inode 128 has size 0 bytes.
+inode 129 has size 0 bytes.
+inode 130 has size 0 bytes.
+removed 4 inodes.
+inode 0 has size 0 bytes.
+SuperBlock:
+    magic number is valid
+    20 blocks
+    2 inode blocks
+    256 inodes
+15 disk block reads
+3 disk block writes
+EOF
+}
+
+cp data/image.20 $SCRATCH/image.20
+echo -n "Testing batch operations in $SCRATCH/image.20 ... "
+if diff -u <(test-input | ./bin/sfssh $SCRATCH/image.20 20 2> /dev/null | grep -v -e '^Inode' -e 'size: 0 bytes' -e 'direct blocks:$') <(test-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
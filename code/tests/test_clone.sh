@@ -0,0 +1,40 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: data/image.200
+
+test-clone-output() {
+    cat <<EOF
+disk mounted.
+cloned inode 9 to inode 0.
+cloned inode 9 to inode 3.
+8192 bytes copied
+409305 bytes copied
+removed inode 9.
+removed inode 0.
+EOF
+}
+
+test-clone-copyout() {
+    cat <<EOF
+disk mounted.
+409305 bytes copied
+125 disk block reads
+0 disk block writes
+EOF
+}
+
+cp data/image.200 $SCRATCH/image.200
+head -c 8192 /dev/zero > $SCRATCH/zero
+echo -n "Testing clone in $SCRATCH/image.200 ... "
+if diff -u <(printf "mount\nclone 9\nclone 9\ncopyin $SCRATCH/zero 0\ncopyout 9 $SCRATCH/9.copy\nremove 9\nremove 0\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -v "disk block") <(test-clone-output) > $SCRATCH/test.log &&
+   diff -u <(printf "mount\ncopyout 3 $SCRATCH/3.copy\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null) <(test-clone-copyout) >> $SCRATCH/test.log &&
+   [ "$(md5sum < $SCRATCH/9.copy | awk '{print $1}')" = cc4e48a5fe0ba15b13a98b3fd34b340e ] &&
+   [ "$(md5sum < $SCRATCH/3.copy | awk '{print $1}')" = cc4e48a5fe0ba15b13a98b3fd34b340e ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,101 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: data/image.200
+
+test-copy-output() {
+    cat <<EOF
+disk mounted.
+created inode 0.
+copied 409305 bytes from inode 9 to inode 0.
+48 of 179 data blocks free.
+2556 of 2560 inodes free.
+copy failed!
+created inode 3.
+copied 105421 bytes from inode 2 to inode 3.
+8192 bytes copied
+409305 bytes copied
+409305 bytes copied
+EOF
+}
+
+cp data/image.200 $SCRATCH/image.200
+head -c 8192 /dev/zero > $SCRATCH/zero
+echo -n "Testing copy in $SCRATCH/image.200 ... "
+if diff -u <(printf "mount\ncreate\ncopy 9 0\ndf\ncopy 0 0\ncreate\ncopy 2 3\ncopyin $SCRATCH/zero 0\ncopyout 9 $SCRATCH/9.copy\ncopyout 0 $SCRATCH/0.copy\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -v "disk block") <(test-copy-output) > $SCRATCH/test.log &&
+   printf "mount\ncopyout 2 $SCRATCH/2.txt\ncopyout 3 $SCRATCH/3.copy\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1 &&
+   cmp -s $SCRATCH/2.txt $SCRATCH/3.copy &&
+   [ "$(md5sum < $SCRATCH/9.copy | awk '{print $1}')" = cc4e48a5fe0ba15b13a98b3fd34b340e ] &&
+   cmp -s <(cat $SCRATCH/zero; tail -c +8193 $SCRATCH/9.copy) $SCRATCH/0.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: splice_in from a host file shorter than the length leaves a clone intact
+
+test-short-output() {
+    cat <<EOF
+cloned inode 0 as inode 1.
+spliced 4096 bytes into inode 1.
+inode 1: 4096 bytes of B, then 28672 bytes of A.
+inode 0: 32768 bytes of A.
+EOF
+}
+
+cat > $SCRATCH/short.cpp <<EOF
+#include "sfs/fs.h"
+
+#include <cstdio>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Count the leading run of one byte, then of a second byte, in an inode
+static void report(FileSystem &fs, size_t inumber, char first, char second) {
+    std::string data(65536, '\0');
+    ssize_t size = fs.read(inumber, &data[0], data.size(), 0);
+    data.resize(size > 0 ? size : 0);
+    size_t a = data.find_first_not_of(first);
+    a = a == std::string::npos ? data.size() : a;
+    size_t b = data.find_first_not_of(second, a);
+    b = b == std::string::npos ? data.size() : b;
+    if (a < data.size()) {
+    	printf("inode %zu: %zu bytes of %c, then %zu bytes of %c.\n", inumber, a, first, b - a, second);
+    } else {
+    	printf("inode %zu: %zu bytes of %c.\n", inumber, a, first);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    Disk disk;
+    disk.open(argv[1], 200);
+    FileSystem::format(&disk);
+    FileSystem fs;
+    fs.mount(&disk);
+
+    std::string data(8 * 4096, 'A');
+    ssize_t inumber = fs.create();
+    fs.write(inumber, &data[0], data.size(), 0);
+    printf("cloned inode %zd as inode %zd.\n", inumber, fs.clone(inumber));
+
+    int fd = open(argv[2], O_RDONLY);
+    printf("spliced %zd bytes into inode 1.\n", fs.splice_in(1, 0, fd, 0, data.size()));
+    close(fd);
+    report(fs, 1, 'B', 'A');
+    report(fs, 0, 'A', 'A');
+    return 0;
+}
+EOF
+head -c 4096 /dev/zero | tr '\0' B > $SCRATCH/B
+echo -n "Testing splice_in from a short host file in $SCRATCH/image.short ... "
+if g++ -std=gnu++11 -Iinclude -o $SCRATCH/short $SCRATCH/short.cpp -Llib -lsfs -pthread &&
+   diff -u <($SCRATCH/short $SCRATCH/image.short $SCRATCH/B 2> /dev/null | grep -v "disk block") <(test-short-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,40 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: daemon with pipelined clients
+
+test-daemon-output() {
+    cat <<EOF
+4 clients, 776 requests, 0 errors
+served 776 requests
+disk mounted.
+899 of 899 data blocks free.
+12800 of 12800 inodes free.
+EOF
+}
+
+printf "format\n" | ./bin/sfssh $SCRATCH/image.1000 1000 > /dev/null 2>&1
+echo -n "Testing daemon in $SCRATCH/image.1000 ... "
+./bin/sfsd $SCRATCH/sfsd.sock $SCRATCH/image.1000 1000 > $SCRATCH/sfsd.log 2> /dev/null &
+DAEMON=$!
+for i in $(seq 50); do
+    [ -S $SCRATCH/sfsd.sock ] && break
+    sleep 0.1
+done
+./bin/sfsload $SCRATCH/sfsd.sock 4 64 8 > $SCRATCH/load.log 2> /dev/null
+kill -TERM $DAEMON
+wait $DAEMON
+# Requests from the pipelined clients should be batched and merged (about
+# 200 of 776 in practice); the exact count depends on scheduling
+merged=$(awk '/served/ { gsub(/\(/, "", $7); print $7 }' $SCRATCH/sfsd.log)
+if diff -u <(cat $SCRATCH/load.log; grep -o "served [0-9]* requests" $SCRATCH/sfsd.log; printf "mount\ndf\n" | ./bin/sfssh $SCRATCH/image.1000 1000 2> /dev/null | grep -v "disk block") <(test-daemon-output) > $SCRATCH/test.log &&
+   [ -n "$merged" ] && [ "$merged" -ge 100 ] &&
+   [ ! -e $SCRATCH/sfsd.sock ]; then
+    echo "Success"
+else
+    echo "Failure"
+    echo "merged: $merged"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,71 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: fragmented file on a fresh image
+
+test-defrag-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+created inode 1.
+created inode 2.
+8192 bytes copied
+8192 bytes copied
+removed inode 0.
+20480 bytes copied
+inode 2 has 2 extents.
+defrag moved 5 blocks.
+inode 2 has 1 extents.
+defrag moved 7 blocks.
+defrag moved 0 blocks.
+inode 1 has 1 extents.
+20480 bytes copied
+8192 bytes copied
+EOF
+}
+
+yes A | head -c 8192 > $SCRATCH/A
+yes B | head -c 8192 > $SCRATCH/B
+yes C | head -c 20480 > $SCRATCH/C
+# Fed through a pipe so copyin cannot preallocate and the file stays fragmented
+mkfifo $SCRATCH/C.fifo
+cat $SCRATCH/C > $SCRATCH/C.fifo &
+echo -n "Testing defrag in $SCRATCH/image.200 ... "
+if diff -u <(printf "format\nmount\ncreate\ncreate\ncreate\ncopyin $SCRATCH/A 0\ncopyin $SCRATCH/B 1\nremove 0\ncopyin $SCRATCH/C.fifo 2\nfrag 2\ndefrag 1\nfrag 2\ndefrag\ndefrag\nfrag 1\ncopyout 2 $SCRATCH/C.copy\ncopyout 1 $SCRATCH/B.copy\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -v "disk block") <(test-defrag-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/C $SCRATCH/C.copy && cmp -s $SCRATCH/B $SCRATCH/B.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: auto defrag between commands keeps data intact
+
+cp data/image.200 $SCRATCH/image.200
+printf "mount\ncopyout 1 $SCRATCH/1.txt\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+echo -n "Testing auto defrag in $SCRATCH/image.200 ... "
+printf "mount\ndefrag auto 8\nstat 1\nstat 1\ncopyout 1 $SCRATCH/1.copy\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+if cmp -s $SCRATCH/1.txt $SCRATCH/1.copy &&
+   [ "$(printf "debug\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | sed -n 8p)" = "    direct blocks: 21" ]; then
+    echo "Success"
+else
+    echo "Failure"
+fi
+
+# Test: moved blocks reach the disk before the inode that points at them
+
+cat $SCRATCH/C > $SCRATCH/C.fifo &
+printf "format\nmount\ncreate\ncreate\ncreate\ncopyin $SCRATCH/A 0\ncopyin $SCRATCH/B 1\nremove 0\ncopyin $SCRATCH/C.fifo 2\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+echo -n "Testing defrag write order in $SCRATCH/image.200 ... "
+# Writes past block 25 fail, so the move fails after the inode table could have been written
+(trap '' XFSZ; ulimit -f 100; printf "mount\ndefrag 1\n" | ./bin/sfssh $SCRATCH/image.200 200) > /dev/null 2>&1
+printf "mount\ncopyout 2 $SCRATCH/C.copy\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+if cmp -s $SCRATCH/C $SCRATCH/C.copy &&
+   [ "$(printf "debug\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -A2 "Inode 2" | tail -1)" = "    direct blocks: 21 22 25 26 27" ]; then
+    echo "Success"
+else
+    echo "Failure"
+fi
@@ -0,0 +1,38 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: data/image.200
+
+test-df-output() {
+    cat <<EOF
+disk mounted.
+50 of 179 data blocks free.
+2557 of 2560 inodes free.
+removed inode 9.
+151 of 179 data blocks free.
+2558 of 2560 inodes free.
+created inode 0.
+151 of 179 data blocks free.
+2557 of 2560 inodes free.
+EOF
+}
+
+test-df-remount() {
+    cat <<EOF
+disk mounted.
+151 of 179 data blocks free.
+2557 of 2560 inodes free.
+EOF
+}
+
+cp data/image.200 $SCRATCH/image.200
+echo -n "Testing df in $SCRATCH/image.200 ... "
+if diff -u <(printf "mount\ndf\nremove 9\ndf\ncreate\ndf\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -v "disk block") <(test-df-output) > $SCRATCH/test.log &&
+   diff -u <(printf "mount\ndf\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -v "disk block") <(test-df-remount) >> $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,30 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: data/image.200 with O_DIRECT
+
+test-direct-output() {
+    cat <<EOF
+disk mounted.
+409305 bytes copied
+105421 bytes copied
+removed inode 9.
+created inode 0.
+409305 bytes copied
+409305 bytes copied
+EOF
+}
+
+cp data/image.200 $SCRATCH/image.200
+printf "mount\ncopyout 2 $SCRATCH/2.plain\n" | ./bin/sfssh data/image.200 200 > /dev/null 2>&1
+echo -n "Testing O_DIRECT in $SCRATCH/image.200 ... "
+if diff -u <(printf "mount\ncopyout 9 $SCRATCH/9.txt\ncopyout 2 $SCRATCH/2.txt\nremove 9\ncreate\ncopyin $SCRATCH/9.txt 0\ncopyout 0 $SCRATCH/9.copy\n" | ./bin/sfssh -d $SCRATCH/image.200 200 2> /dev/null | grep -v "disk block") <(test-direct-output) > $SCRATCH/test.log &&
+   [ $(md5sum < $SCRATCH/9.copy | awk '{print $1}') = cc4e48a5fe0ba15b13a98b3fd34b340e ] &&
+   cmp -s $SCRATCH/2.txt $SCRATCH/2.plain; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
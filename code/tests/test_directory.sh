@@ -0,0 +1,109 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: data/image.200
+
+test-input() {
+    cat <<EOF
+mount
+mkdir /docs
+mkdir docs/old
+create /docs/readme
+copyin README.md 5
+ls
+ls /docs
+open /docs/old/../readme
+mkdir /docs
+create /docs/old/x
+unlink /docs/old
+unlink /docs/old/x
+unlink /docs/old
+ls /docs
+debug
+EOF
+}
+
+test-output() {
+    cat <<EOF
+disk mounted.
+created directory /docs as inode 3.
+created directory docs/old as inode 4.
+created inode 5.
+3141 bytes copied
+     3     4096 docs/
+     4     4096 old/
+     5     3141 readme
+/docs/old/../readme is inode 5.
+mkdir failed!
+created inode 6.
+unlink failed!
+unlinked /docs/old/x.
+unlinked /docs/old.
+     5     3141 readme
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+    root directory: inode 0
+Inode 0:
+    size: 4096 bytes
+    type: directory
+    direct blocks: 21
+Inode 1:
+    size: 1523 bytes
+    direct blocks: 152
+Inode 2:
+    size: 105421 bytes
+    direct blocks: 49 50 51 52 53
+    indirect block: 54
+    indirect data blocks: 55 56 57 58 59 60 61 62 63 64 65 66 67 68 69 70 71 72 73 74 75
+Inode 3:
+    size: 4096 bytes
+    type: directory
+    direct blocks: 27
+Inode 5:
+    size: 3141 bytes
+    direct blocks: 153
+Inode 9:
+    size: 409305 bytes
+    direct blocks: 22 23 24 25 26
+    indirect block: 28
+    indirect data blocks: 29 30 31 32 33 34 35 36 37 38 39 40 41 42 43 44 45 46 47 48 76 77 78 79 80 82 83 84 85 86 87 88 89 90 91 92 93 94 95 96 97 98 99 100 101 102 103 104 105 106 107 108 109 110 111 112 113 114 115 116 117 118 119 120 121 122 123 124 125 126 127 128 129 130 131 132 133 134 135 136 137 138 139 140 141 142 143 144 145 146 147 148 149 150 151
+133 disk block reads
+17 disk block writes
+EOF
+}
+
+cp data/image.200 $SCRATCH/image.200
+echo -n "Testing directories in $SCRATCH/image.200 ... "
+if diff -u <(test-input | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null) <(test-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: lookups on an image without directories fail and leave it unchanged
+
+test-lookup-output() {
+    cat <<EOF
+disk mounted.
+ls failed!
+open failed!
+2 disk block reads
+0 disk block writes
+EOF
+}
+
+cp data/image.5 $SCRATCH/image.5
+echo -n "Testing lookups without directories in $SCRATCH/image.5 ... "
+if diff -u <(printf "mount\nls /\nopen /README\n" | ./bin/sfssh $SCRATCH/image.5 5 2> /dev/null) <(test-lookup-output) > $SCRATCH/test.log &&
+   cmp -s data/image.5 $SCRATCH/image.5; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,50 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: data/image.200
+
+test-discard-output() {
+    cat <<EOF
+disk mounted.
+discard enabled.
+removed inode 9.
+removed inode 2.
+29 disk block reads
+2 disk block writes
+128 disk block discards
+EOF
+}
+
+test-trim-output() {
+    cat <<EOF
+disk mounted.
+trimmed 197 blocks.
+21 disk block reads
+0 disk block writes
+197 disk block discards
+EOF
+}
+
+cp data/image.200 $SCRATCH/image.200
+before=$(du -k $SCRATCH/image.200 | awk '{print $1}')
+echo -n "Testing discard in $SCRATCH/image.200 ... "
+if diff -u <(printf "mount\ndiscard on\nremove 9\nremove 2\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null) <(test-discard-output) > $SCRATCH/test.log &&
+   [ $(du -k $SCRATCH/image.200 | awk '{print $1}') -lt $before ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+before=$(du -k $SCRATCH/image.200 | awk '{print $1}')
+echo -n "Testing trim in $SCRATCH/image.200 ... "
+if diff -u <(printf "mount\ntrim\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null) <(test-trim-output) > $SCRATCH/test.log &&
+   [ $(du -k $SCRATCH/image.200 | awk '{print $1}') -lt $before ] &&
+   [ $(printf "mount\ncopyout 1 $SCRATCH/1.copy\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | head -n 2 | tail -n 1 | awk '{print $1}') = 1523 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,74 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: preallocated blocks read as zeros, and copyin reserves one extent
+
+test-fallocate-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+created inode 1.
+created inode 2.
+reserved 10000 bytes for inode 0.
+fallocate failed!
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+Inode 0:
+    size: 10000 bytes
+    unwritten from block index: 0
+    direct blocks: 21 22 23
+Inode 1:
+    size: 0 bytes
+    direct blocks:
+Inode 2:
+    size: 0 bytes
+    direct blocks:
+10000 bytes copied
+8192 bytes copied
+removed inode 0.
+20480 bytes copied
+inode 2 has 1 extents.
+20480 bytes copied
+EOF
+}
+
+yes A | head -c 8192 > $SCRATCH/A
+yes C | head -c 20480 > $SCRATCH/C
+head -c 10000 /dev/zero > $SCRATCH/zero
+echo -n "Testing fallocate in $SCRATCH/image.200 ... "
+if diff -u <(printf "format\nmount\ncreate\ncreate\ncreate\nfallocate 0 10000\nfallocate 1 999999999\ndebug\ncopyout 0 $SCRATCH/zero.copy\ncopyin $SCRATCH/A 1\nremove 0\ncopyin $SCRATCH/C 2\nfrag 2\ncopyout 2 $SCRATCH/C.copy\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -v "disk block") <(test-fallocate-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/zero $SCRATCH/zero.copy && cmp -s $SCRATCH/C $SCRATCH/C.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: a failed fallocate on a nearly full disk leaves a small file packed
+
+test-full-output() {
+    cat <<EOF
+1 of 179 data blocks free.
+fallocate failed!
+1 of 179 data blocks free.
+Inode 0:
+    size: 965 bytes
+    fragment block: 21 (fragments 0-3)
+EOF
+}
+
+head -c 965 README.md > $SCRATCH/small
+yes F | head -c $((176 * 4096)) > $SCRATCH/fill
+echo -n "Testing fallocate on a full disk in $SCRATCH/image.200 ... "
+if diff -u <((printf "format\nmount\ncreate\ncopyin $SCRATCH/small 0\ncreate\ncopyin $SCRATCH/fill 1\ndf\nfallocate 0 10000\ndf\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep "data blocks\|fallocate"; printf "debug\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | sed -n 6,8p)) <(test-full-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,54 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: 16 KiB blocks, 5% of blocks holding inodes
+
+test-geometry-debug() {
+    cat <<EOF
+disk formatted.
+SuperBlock:
+    magic number is valid
+    50 blocks
+    16384 bytes per block
+    3 inode blocks
+    1536 inodes
+16384 bytes per block.
+46 of 46 data blocks free.
+1536 of 1536 inodes free.
+EOF
+}
+
+test-geometry-remount() {
+    cat <<EOF
+disk mounted.
+inode 0 has size 409305 bytes.
+16384 bytes per block.
+20 of 46 data blocks free.
+1535 of 1536 inodes free.
+EOF
+}
+
+test-geometry-bad() {
+    cat <<EOF
+format failed!
+format failed!
+format failed!
+EOF
+}
+
+printf "mount\ncopyout 9 $SCRATCH/9.txt\n" | ./bin/sfssh data/image.200 200 > /dev/null 2>&1
+
+echo -n "Testing geometry in $SCRATCH/image ... "
+if diff -u <(printf "format 16384 5\ndebug\nmount\ndf\n" | ./bin/sfssh $SCRATCH/image 200 2> /dev/null | grep -v "disk block" | grep -v "disk mounted") <(test-geometry-debug) > $SCRATCH/test.log &&
+   printf "mount\ncreate\ncopyin $SCRATCH/9.txt 0\n" | ./bin/sfssh $SCRATCH/image 200 > /dev/null 2>&1 &&
+   diff -u <(printf "mount\nstat 0\ndf\n" | ./bin/sfssh $SCRATCH/image 200 2> /dev/null | grep -v "disk block") <(test-geometry-remount) >> $SCRATCH/test.log &&
+   printf "mount\ncopyout 0 $SCRATCH/0.txt\n" | ./bin/sfssh $SCRATCH/image 200 > /dev/null 2>&1 &&
+   cmp -s $SCRATCH/9.txt $SCRATCH/0.txt &&
+   diff -u <(printf "format 5000\nformat 4096 0\nformat 4096 60\n" | ./bin/sfssh $SCRATCH/image 200 2> /dev/null | grep -v "disk block") <(test-geometry-bad) >> $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,53 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: 70000 block sparse image (three block groups)
+
+test-groups-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+10000 bytes copied
+10000 bytes copied
+10000 bytes copied
+disk mounted.
+SuperBlock:
+    magic number is valid
+    70000 blocks
+    9831 inode blocks
+    1258368 inodes
+    3 block groups of 32768 blocks (3277 inode blocks each)
+Inode 0:
+    size: 10000 bytes
+    direct blocks: 3278 3279 3280
+Inode 500000:
+    size: 10000 bytes
+    direct blocks: 36046 36047 36048
+Inode 900000:
+    size: 10000 bytes
+    direct blocks: 68814 68815 68816
+60159 of 60168 data blocks free.
+1258365 of 1258368 inodes free.
+removed inode 500000.
+60162 of 60168 data blocks free.
+1258366 of 1258368 inodes free.
+10000 bytes copied
+EOF
+}
+
+yes "block group" | head -c 10000 > $SCRATCH/data
+sfssh() {
+    ./bin/sfssh $SCRATCH/image 70000 2> /dev/null | grep -v "disk block"
+}
+echo -n "Testing groups in $SCRATCH/image ... "
+if diff -u <(printf "format\nmount\ncreate\ncopyin $SCRATCH/data 0\ncopyin $SCRATCH/data 500000\ncopyin $SCRATCH/data 900000\n" | sfssh &&
+    	     printf "mount\ndebug\ndf\nremove 500000\ndf\ncopyout 900000 $SCRATCH/copy\n" | sfssh) <(test-groups-output) > $SCRATCH/test.log &&
+   cmp $SCRATCH/data $SCRATCH/copy > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,55 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: grow a copy of data/image.5 online, with and without inode capacity
+
+test-grow-output() {
+    cat <<EOF
+disk mounted.
+grow failed!
+disk grown to 20 blocks.
+SuperBlock:
+    magic number is valid
+    20 blocks
+    3 inode blocks
+    384 inodes
+    extension at block 5 (2 inode blocks)
+Inode 1:
+    size: 965 bytes
+    direct blocks: 2
+created 128 inodes (0 to 128).
+inode 128 has size 0 bytes.
+30000 bytes copied
+6 of 16 data blocks free.
+255 of 384 inodes free.
+disk grown to 30 blocks.
+16 of 26 data blocks free.
+255 of 384 inodes free.
+EOF
+}
+
+test-remount-output() {
+    cat <<EOF
+disk mounted.
+16 of 26 data blocks free.
+255 of 384 inodes free.
+30000 bytes copied
+removed inode 128.
+25 of 26 data blocks free.
+256 of 384 inodes free.
+EOF
+}
+
+cp data/image.5 $SCRATCH/image.5
+yes B | head -c 30000 > $SCRATCH/B
+echo -n "Testing grow in $SCRATCH/image.5 ... "
+if diff -u <(printf "mount\ngrow 4\ngrow 20 inodes\ndebug\ncreate_many 128\nstat 128\ncopyin $SCRATCH/B 128\ndf\ngrow 30\ndf\n" | ./bin/sfssh $SCRATCH/image.5 5 2> /dev/null | grep -v "disk block") <(test-grow-output) > $SCRATCH/test.log &&
+   diff -u <(printf "mount\ndf\ncopyout 128 $SCRATCH/B.copy\nremove 128\ndf\n" | ./bin/sfssh $SCRATCH/image.5 30 2> /dev/null | grep -v "disk block") <(test-remount-output) >> $SCRATCH/test.log &&
+   cmp -s $SCRATCH/B $SCRATCH/B.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
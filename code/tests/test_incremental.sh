@@ -0,0 +1,45 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: data/image.200
+
+test-incremental-output() {
+    cat <<EOF
+change tracking started.
+disk mounted.
+created inode 0.
+12813 bytes copied
+removed inode 1.
+exported 5 changed blocks in 2 extents.
+checkpoint taken, 5 blocks changed since the last one.
+applied 5 changed blocks.
+disk mounted.
+exported 0 changed blocks in 0 extents.
+exported 200 changed blocks in 4 extents.
+applied 200 changed blocks.
+EOF
+}
+
+cp data/image.200 $SCRATCH/image.200
+yes "incremental backup" | head -c 12813 > $SCRATCH/services
+sfssh() {
+    ./bin/sfssh $1 200 2> /dev/null | grep -v "disk block"
+}
+echo -n "Testing incremental in $SCRATCH/image.200 ... "
+if diff -u <(printf "checkpoint\n" | sfssh $SCRATCH/image.200 &&
+    	     cp $SCRATCH/image.200 $SCRATCH/backup.200 &&
+    	     printf "mount\ncreate\ncopyin $SCRATCH/services 0\nremove 1\nexport-incremental $SCRATCH/delta\ncheckpoint\n" | sfssh $SCRATCH/image.200 &&
+    	     printf "apply-incremental $SCRATCH/delta\n" | sfssh $SCRATCH/backup.200 &&
+    	     cmp $SCRATCH/image.200 $SCRATCH/backup.200 &&
+    	     printf "mount\nexport-incremental $SCRATCH/delta\n" | sfssh $SCRATCH/image.200 &&
+    	     : > $SCRATCH/image.200.changed &&
+    	     printf "export-incremental $SCRATCH/delta\n" | sfssh $SCRATCH/image.200 &&
+    	     printf "apply-incremental $SCRATCH/delta\n" | sfssh $SCRATCH/backup.200 &&
+    	     cmp $SCRATCH/image.200 $SCRATCH/backup.200) <(test-incremental-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
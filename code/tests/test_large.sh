@@ -0,0 +1,32 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: sparse 4.5 GiB image whose data region starts past 2 GiB
+
+test-large-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+3000000 bytes copied
+inode 0 has size 3000000 bytes.
+65536 bytes per block.
+36816 of 36863 data blocks free.
+75497471 of 75497472 inodes free.
+3000000 bytes copied
+EOF
+}
+
+yes "sixty-four bit" | head -c 3000000 > $SCRATCH/data
+echo -n "Testing large in $SCRATCH/image ... "
+if diff -u <(printf "format 65536 50\nmount\ncreate\ncopyin $SCRATCH/data 0\nstat 0\ndf\ncopyout 0 $SCRATCH/copy\n" | ./bin/sfssh $SCRATCH/image 1179648 2> /dev/null | grep -v "disk block") <(test-large-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/data $SCRATCH/copy &&
+   cmp -s <(tail -c +$((36865 * 65536 + 1)) $SCRATCH/image | head -c $((5 * 65536))) <(head -c $((5 * 65536)) $SCRATCH/data) &&
+   [ $(du -k $SCRATCH/image | cut -f 1) -lt 65536 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
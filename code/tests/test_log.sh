@@ -0,0 +1,130 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: 400 block log-structured image
+
+test-log-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+auto clean disabled.
+cleaned 21 segments.
+57 of 282 data blocks free.
+4051 of 4096 inodes free.
+Log:
+    magic number is valid
+    49 segments of 8 blocks
+    315 logical blocks
+SuperBlock:
+    magic number is valid
+    315 blocks
+    32 inode blocks
+    4096 inodes
+EOF
+}
+
+test-mounted-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+Log:
+    magic number is valid
+    24 segments of 8 blocks
+    140 logical blocks
+SuperBlock:
+    magic number is valid
+    140 blocks
+    14 inode blocks
+    1792 inodes
+Inode 0:
+    size: 20000 bytes
+    direct blocks: 15 16 17 18 19
+EOF
+}
+
+test-clean-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+clean failed!
+EOF
+}
+
+# Fill most of the volume, then rewrite every other file so that cleaning
+# has to copy the remaining files out of half-empty segments
+yes "log structured" | head -c 20000 > $SCRATCH/data
+commands() {
+    printf "format log\nmount\nclean auto 0\n"
+    for i in $(seq 0 44); do
+    	printf "create\ncopyin $SCRATCH/data $i\n"
+    done
+    for round in 1 2 3; do
+    	for i in $(seq 0 2 44); do
+    	    printf "copyin $SCRATCH/data $i\n"
+	done
+    done
+    printf "clean\ndf\n"
+}
+
+copyout() {
+    printf "mount\n"
+    for i in $(seq 0 44); do
+    	printf "copyout $i $SCRATCH/copy.$i\n"
+    done
+}
+
+sfssh() {
+    ./bin/sfssh $SCRATCH/image 400 2> /dev/null | grep -v "disk block\|created inode\|bytes copied"
+}
+
+echo -n "Testing log-structured layout in $SCRATCH/image ... "
+if diff -u <(commands | sfssh && printf "debug\n" | sfssh | grep -v "checkpoint" | head -n 9) <(test-log-output) > $SCRATCH/test.log &&
+   copyout | sfssh > /dev/null &&
+   (for i in $(seq 0 44); do cmp $SCRATCH/data $SCRATCH/copy.$i || exit 1; done) > /dev/null 2>&1; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+rm -f $SCRATCH/image
+echo -n "Testing debug of mounted log in $SCRATCH/image ... "
+if diff -u <(printf "format log\nmount\ncreate\ncopyin $SCRATCH/data 0\ndebug\n" | ./bin/sfssh $SCRATCH/image 200 2> /dev/null | grep -v "disk block\|created inode\|bytes copied\|checkpoint") <(test-mounted-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+rm -f $SCRATCH/image
+echo -n "Testing clean on in-place layout in $SCRATCH/image ... "
+if diff -u <(printf "format\nmount\nclean\n" | sfssh) <(test-clean-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Small random updates should cost less simulated disk time in the log
+for i in $(seq 0 255); do
+    echo "$SCRATCH/data $(( (i * 97) % 256 ))"
+done > $SCRATCH/updates
+head -c 4096 $SCRATCH/data > $SCRATCH/block
+sed -i "s|$SCRATCH/data|$SCRATCH/block|" $SCRATCH/updates
+updates() {
+    rm -f $SCRATCH/image
+    printf "format $1\nmount\ncreate_many 256\n" | ./bin/sfssh $SCRATCH/image 4096 > /dev/null 2>&1
+    printf "mount\ncopyin_many $SCRATCH/updates\n" | ./bin/sfssh -t hdd $SCRATCH/image 4096 2> /dev/null | awk '/simulated/ { print $1 }'
+}
+
+echo -n "Testing log-structured random updates against in-place ... "
+inplace=$(updates)
+logged=$(updates log)
+if [ -n "$inplace" ] && [ -n "$logged" ] && awk "BEGIN { exit !($logged < $inplace) }"; then
+    echo "Success"
+else
+    echo "Failure"
+    echo "in-place: $inplace ms, log-structured: $logged ms"
+fi
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: data/image.200, fresh striped disk
+
+test-map-output() {
+    cat <<EOF
+105421 bytes in 2 spans (105421 bytes mapped)
+map failed!
+48000 bytes in 2 spans (0 bytes mapped)
+3 bytes in 1 spans (0 bytes mapped)
+EOF
+}
+
+cp data/image.200 $SCRATCH/image.200
+yes "striped map" | head -n 4000 > $SCRATCH/data
+echo hi > $SCRATCH/small
+printf "mount\ncopyout 2 $SCRATCH/copy\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+
+echo -n "Testing map in $SCRATCH ... "
+if diff -u <(printf "mount\nmap 2\nmap 1000\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -a "spans\|failed" &&
+    	     printf "format\nmount\ncreate\ncopyin $SCRATCH/data 0\ncreate\ncopyin $SCRATCH/small 1\nmap 0\nmap 1\n" |
+    	     ./bin/sfssh -s 4 $SCRATCH/a,$SCRATCH/b 100 2> /dev/null | grep -a "spans") <(test-map-output) > $SCRATCH/test.log &&
+   printf "mount\nmap 2\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | tail -c +15 | head -c 105421 | cmp - $SCRATCH/copy > /dev/null; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
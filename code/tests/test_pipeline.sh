@@ -0,0 +1,48 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: data/image.200
+
+test-pipeline-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+pipeline uses 3 buffers of 4 KiB.
+created inode 0.
+created inode 1.
+created inode 2.
+created inode 3.
+30000 bytes copied
+copied 30000 bytes from $SCRATCH/a to inode 1.
+copied 12345 bytes from $SCRATCH/b to inode 2.
+copied 23893 bytes from $SCRATCH/c to inode 3.
+copied 30000 bytes from inode 1 to $SCRATCH/a.out.
+copied 12345 bytes from inode 2 to $SCRATCH/b.out.
+copied 23893 bytes from inode 3 to $SCRATCH/c.out.
+30000 bytes copied
+inode 3 has size 23893 bytes.
+EOF
+}
+
+cp data/image.200 $SCRATCH/image.200
+yes "alpha" | head -c 30000 > $SCRATCH/a
+yes "bravo two" | head -c 12345 > $SCRATCH/b
+seq 1 5000 > $SCRATCH/c
+printf "$SCRATCH/a 1\n$SCRATCH/b 2\n$SCRATCH/c 3\n" > $SCRATCH/in.list
+printf "1 $SCRATCH/a.out\n2 $SCRATCH/b.out\n3 $SCRATCH/c.out\n" > $SCRATCH/out.list
+mkfifo $SCRATCH/in.fifo $SCRATCH/out.fifo
+cat $SCRATCH/a > $SCRATCH/in.fifo &
+cat $SCRATCH/out.fifo > $SCRATCH/fifo.out &
+
+echo -n "Testing pipeline in $SCRATCH/image.200 ... "
+if diff -u <(printf "format\nmount\npipeline 3 4\ncreate\ncreate\ncreate\ncreate\ncopyin $SCRATCH/in.fifo 0\ncopyin_many $SCRATCH/in.list\ncopyout_many $SCRATCH/out.list\ncopyout 0 $SCRATCH/out.fifo\nstat 3\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -v "disk block") <(test-pipeline-output) > $SCRATCH/test.log &&
+   wait &&
+   cmp $SCRATCH/a $SCRATCH/a.out && cmp $SCRATCH/b $SCRATCH/b.out && cmp $SCRATCH/c $SCRATCH/c.out &&
+   cmp $SCRATCH/a $SCRATCH/fifo.out; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
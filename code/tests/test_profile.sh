@@ -0,0 +1,33 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: data/image.5
+
+test-profile-output() {
+    # Probes only exist in builds made with PROFILE=1
+    if grep -q "^profiling is not enabled" $SCRATCH/profile; then
+    	echo "profiling is not enabled in this build (make PROFILE=1)."
+    else
+    	cat <<EOF
+call-path profile (cycles):
+2 Disk::read
+2 read
+1 read > Disk::read
+2 read > load_inode
+2 read > load_inode > Disk::read
+EOF
+    fi
+}
+
+# cat must write to a pipe; regular files are copied without fs.read
+echo "$(printf "mount\ncat 1\nprofile\n" | ./bin/sfssh data/image.5 5 2> /dev/null)" > $SCRATCH/profile
+echo -n "Testing profile on data/image.5 ... "
+if diff -u <(sed -n '/^profiling/p; /^call-path/,/disk block/p' $SCRATCH/profile | grep -v "disk block\|path$" |
+    	     sed -E 's/^ *([0-9]+) +[0-9]+ +[0-9]+  /\1 /') <(test-profile-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
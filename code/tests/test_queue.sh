@@ -0,0 +1,34 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: data/image.200
+
+test-batch-output() {
+    cat <<EOF
+82 disk block reads
+20 disk block writes
+440.007 ms simulated disk time
+EOF
+}
+
+# Each operation rewrites the same inode, bitmap and directory blocks several
+# times; the disk queue performs each of them once when the operation ends
+seq 1 2000 > $SCRATCH/numbers
+yes "batched" | head -c 5000 > $SCRATCH/words
+commands() {
+    printf "mount\ncreate\ncopyin $SCRATCH/numbers 3\ncreate\ncopyin $SCRATCH/words 4\n"
+    printf "mkdir /a\nmkdir /a/b\ncreate /a/b/c\ncreate_many 40\n"
+}
+
+cp data/image.200 $SCRATCH/image.200
+echo -n "Testing queued requests in $SCRATCH/image.200 ... "
+if diff -u <(commands | ./bin/sfssh -t hdd $SCRATCH/image.200 200 2> /dev/null | tail -n 3) <(test-batch-output) > $SCRATCH/test.log &&
+   printf "mount\ncopyout 3 $SCRATCH/copy.3\ncopyout 4 $SCRATCH/copy.4\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1 &&
+   cmp $SCRATCH/numbers $SCRATCH/copy.3 > /dev/null 2>&1 && cmp $SCRATCH/words $SCRATCH/copy.4 > /dev/null 2>&1; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -121,13 +121,13 @@ SuperBlock:
     128 inodes
 Inode 0:
     size: 965 bytes
-    direct blocks: 3
+    fragment block: 3 (fragments 0-3)
 Inode 1:
     size: 965 bytes
     direct blocks: 2
 Inode 2:
     size: 965 bytes
-    direct blocks: 4
+    fragment block: 3 (fragments 4-7)
 removed inode 0.
 SuperBlock:
     magic number is valid
@@ -139,7 +139,7 @@ Inode 1:
     direct blocks: 2
 Inode 2:
     size: 965 bytes
-    direct blocks: 4
+    fragment block: 3 (fragments 4-7)
 created inode 0.
 965 bytes copied
 SuperBlock:
@@ -149,14 +149,14 @@ SuperBlock:
     128 inodes
 Inode 0:
     size: 965 bytes
-    direct blocks: 3
+    fragment block: 3 (fragments 0-3)
 Inode 1:
     size: 965 bytes
     direct blocks: 2
 Inode 2:
     size: 965 bytes
-    direct blocks: 4
-31 disk block reads
+    fragment block: 3 (fragments 4-7)
+28 disk block reads
 10 disk block writes
 EOF
 }
@@ -230,8 +230,8 @@ Inode 2:
     direct blocks: 4 5 6 7 8
     indirect block: 9
     indirect data blocks: 13 14
-42 disk block reads
-11 disk block writes
+36 disk block reads
+13 disk block writes
 EOF
 }
 
@@ -0,0 +1,84 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: data/image.5
+
+printf 'hello sfs\n' > $SCRATCH/tiny.txt
+head -c 965 README.md > $SCRATCH/small.txt
+
+test-input() {
+    cat <<EOF
+mount
+create
+copyin $SCRATCH/tiny.txt 0
+create
+copyin $SCRATCH/small.txt 2
+create
+copyin $SCRATCH/small.txt 3
+debug
+copyout 0 $SCRATCH/tiny.copy
+copyout 2 $SCRATCH/small.copy
+EOF
+}
+
+test-output() {
+    cat <<EOF
+disk mounted.
+created inode 0.
+10 bytes copied
+created inode 2.
+965 bytes copied
+created inode 3.
+965 bytes copied
+SuperBlock:
+    magic number is valid
+    5 blocks
+    1 inode blocks
+    128 inodes
+Inode 0:
+    size: 10 bytes
+    inline data
+Inode 1:
+    size: 965 bytes
+    direct blocks: 2
+Inode 2:
+    size: 965 bytes
+    fragment block: 3 (fragments 0-3)
+Inode 3:
+    size: 965 bytes
+    fragment block: 3 (fragments 4-7)
+10 bytes copied
+965 bytes copied
+22 disk block reads
+8 disk block writes
+EOF
+}
+
+cp data/image.5 $SCRATCH/image.5
+echo -n "Testing small files in $SCRATCH/image.5 ... "
+if diff -u <(test-input | ./bin/sfssh $SCRATCH/image.5 5 2> /dev/null) <(test-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/tiny.txt $SCRATCH/tiny.copy && cmp -s $SCRATCH/small.txt $SCRATCH/small.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Cat of an inline file only reads the inode block
+
+test-cat-output() {
+    cat <<EOF
+4 disk block reads
+0 disk block writes
+EOF
+}
+
+echo -n "Testing small file cat in $SCRATCH/image.5 ... "
+if diff -u <(printf "mount\ncat 0\n" | ./bin/sfssh $SCRATCH/image.5 5 2> /dev/null | tail -n 2) <(test-cat-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,38 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: striped disk over three images
+
+test-striped-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+409305 bytes copied
+409305 bytes copied
+EOF
+}
+
+printf "mount\ncopyout 9 $SCRATCH/9.txt\n" | ./bin/sfssh data/image.200 200 > /dev/null 2>&1
+echo -n "Testing striped disk in $SCRATCH/{a,b,c} ... "
+if diff -u <(printf "format\nmount\ncreate\ncopyin $SCRATCH/9.txt 0\ncopyout 0 $SCRATCH/9.copy\n" | ./bin/sfssh -s 4 $SCRATCH/a,$SCRATCH/b,$SCRATCH/c 200 2> /dev/null | grep -v "disk block") <(test-striped-output) > $SCRATCH/test.log &&
+   [ $(md5sum < $SCRATCH/9.copy | awk '{print $1}') = cc4e48a5fe0ba15b13a98b3fd34b340e ] &&
+   [ $(stat -c %s $SCRATCH/a) = 278528 ] && [ $(stat -c %s $SCRATCH/c) = 278528 ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: a single image with a stripe unit of one block is the plain layout
+
+cp data/image.200 $SCRATCH/image.200
+echo -n "Testing striped disk in $SCRATCH/image.200 ... "
+printf "mount\ncopyout 9 $SCRATCH/9.single\n" | ./bin/sfssh -s 1 $SCRATCH/image.200 200 > /dev/null 2>&1
+if cmp -s $SCRATCH/9.txt $SCRATCH/9.single; then
+    echo "Success"
+else
+    echo "Failure"
+fi
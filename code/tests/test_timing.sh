@@ -0,0 +1,38 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: data/image.200
+
+test-timing-hdd() {
+    cat <<EOF
+52 disk block reads
+0 disk block writes
+38.932 ms simulated disk time
+EOF
+}
+
+test-timing-ssd() {
+    cat <<EOF
+52 disk block reads
+0 disk block writes
+2.826 ms simulated disk time
+EOF
+}
+
+echo -n "Testing hdd timing on data/image.200 ... "
+if diff -u <(printf "mount\ncat 2\n" | ./bin/sfssh -t hdd data/image.200 200 2> /dev/null | tail -n 3) <(test-timing-hdd) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+echo -n "Testing ssd timing on data/image.200 ... "
+if diff -u <(printf "mount\ncat 2\n" | ./bin/sfssh -t ssd data/image.200 200 2> /dev/null | tail -n 3) <(test-timing-ssd) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi